@@ -0,0 +1,409 @@
+/*
+ * Copyright (C) 2011-2013 Colin Jones
+ * Copyright (C) 2014-2023 Valère Monseur
+ *
+ * Based on code by Matteo Marchesotti
+ * Copyright (C) 2007 Matteo Marchesotti <matteo.marchesotti@fsfe.org>
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * benchmark of the power supplies scan, of a full update tick, of the formatting
+ * of the tooltip and icon name and of the samples of the devices, without gtk on a sysfs
+ * tree generated by gen-power-supplies.sh
+ *
+ * cbatticon.c is included to reach its static functions, and the libc calls that
+ * enter the kernel and the allocations are counted by interposing them
+ *
+ * with --trace-hours, a trace of a discharge is written instead and replayed by cbatticon --replay
+ */
+
+#define main cbatticon_main
+#include "cbatticon.c"
+#undef main
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <stdarg.h>
+#include <stdlib.h>
+
+#define BENCH_DEFAULT_TICKS 10000
+#define BENCH_MAX_FDS       1024
+#define BENCH_TRACE_CAPACITY 50000000 /* µWh */
+#define BENCH_TRACE_INTERVAL 5        /* seconds between the recorded updates */
+
+static guint64 bench_syscalls    = 0;
+static guint64 bench_allocations = 0;
+static gint    bench_slow_fds[BENCH_MAX_FDS];
+
+/*
+ * allocation counters, forwarded to the glibc allocator
+ */
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t count, size_t size);
+extern void *__libc_realloc (void *pointer, size_t size);
+extern void *__libc_memalign (size_t alignment, size_t size);
+extern void  __libc_free (void *pointer);
+
+void *malloc (size_t size)
+{
+    bench_allocations++;
+    return __libc_malloc (size);
+}
+
+void *calloc (size_t count, size_t size)
+{
+    bench_allocations++;
+    return __libc_calloc (count, size);
+}
+
+void *realloc (void *pointer, size_t size)
+{
+    bench_allocations++;
+    return __libc_realloc (pointer, size);
+}
+
+int posix_memalign (void **pointer, size_t alignment, size_t size)
+{
+    bench_allocations++;
+    *pointer = __libc_memalign (alignment, size);
+    return *pointer != NULL ? 0 : ENOMEM;
+}
+
+void free (void *pointer)
+{
+    __libc_free (pointer);
+}
+
+/*
+ * syscall counters, the attributes of a supply with a .slow file are delayed
+ */
+
+#define BENCH_NEXT(name)                    \
+    static __typeof__ (name) *next = NULL;  \
+    if (next == NULL) next = dlsym (RTLD_NEXT, #name)
+
+static void bench_open_slow (const char *path, int fd)
+{
+    gchar *directory, *slow_path, *contents;
+
+    if (fd < 0 || fd >= BENCH_MAX_FDS) {
+        return;
+    }
+
+    bench_slow_fds[fd] = 0;
+
+    directory = g_path_get_dirname (path);
+    slow_path = g_build_filename (directory, ".slow", NULL);
+
+    if (g_file_get_contents (slow_path, &contents, NULL, NULL) == TRUE) {
+        bench_slow_fds[fd] = atoi (contents);
+        g_free (contents);
+    }
+
+    g_free (slow_path);
+    g_free (directory);
+}
+
+static void bench_read_slow (int fd)
+{
+    if (fd >= 0 && fd < BENCH_MAX_FDS && bench_slow_fds[fd] > 0) {
+        g_usleep (bench_slow_fds[fd]);
+    }
+}
+
+int open (const char *path, int flags, ...)
+{
+    BENCH_NEXT (open);
+    mode_t mode = 0;
+    int fd;
+
+    if (flags & O_CREAT) {
+        va_list arguments;
+        va_start (arguments, flags);
+        mode = va_arg (arguments, mode_t);
+        va_end (arguments);
+    }
+
+    bench_syscalls++;
+    fd = next (path, flags, mode);
+
+    /* the counters of bench_open_slow are not part of the measure */
+
+    if (g_str_has_prefix (path, sysfs_path) == TRUE) {
+        guint64 syscalls = bench_syscalls, allocations = bench_allocations;
+
+        bench_open_slow (path, fd);
+
+        bench_syscalls    = syscalls;
+        bench_allocations = allocations;
+    }
+
+    return fd;
+}
+
+int close (int fd)
+{
+    BENCH_NEXT (close);
+
+    bench_syscalls++;
+    return next (fd);
+}
+
+ssize_t read (int fd, void *buffer, size_t size)
+{
+    BENCH_NEXT (read);
+
+    bench_syscalls++;
+    bench_read_slow (fd);
+    return next (fd, buffer, size);
+}
+
+ssize_t pread (int fd, void *buffer, size_t size, off_t offset)
+{
+    BENCH_NEXT (pread);
+
+    bench_syscalls++;
+    bench_read_slow (fd);
+    return next (fd, buffer, size, offset);
+}
+
+DIR *opendir (const char *path)
+{
+    BENCH_NEXT (opendir);
+
+    bench_syscalls++;
+    return next (path);
+}
+
+struct dirent *readdir (DIR *directory)
+{
+    BENCH_NEXT (readdir);
+
+    bench_syscalls++;
+    return next (directory);
+}
+
+int closedir (DIR *directory)
+{
+    BENCH_NEXT (closedir);
+
+    bench_syscalls++;
+    return next (directory);
+}
+
+/*
+ * benchmark functions
+ */
+
+static void bench_changed_power_supplies (struct icon *tray_icon)
+{
+    changed_power_supplies ();
+}
+
+static void bench_get_power_supplies (struct icon *tray_icon)
+{
+    get_power_supplies ();
+}
+
+static void bench_update_tray_icon_status (struct icon *tray_icon)
+{
+    update_tray_icon_status (tray_icon);
+}
+
+static void bench_format (struct icon *tray_icon)
+{
+    static gint percentage = 0;
+
+    /* the strings of an update whose view changed, the percentage sweeps every icon bucket */
+
+    percentage = (percentage + 7) % 101;
+
+    get_tooltip_string (get_battery_string (DISCHARGING, percentage), get_time_string (percentage * 3));
+    get_icon_name (DISCHARGING, percentage);
+}
+
+static void bench_devices (struct icon *tray_icon)
+{
+    gint64 now = g_get_monotonic_time ();
+    guint i;
+
+    /* every device at once, the worst case of their own cadences */
+
+    for (i = 0; i < devices->len; i++) {
+        sample_device (g_ptr_array_index (devices, i), now);
+    }
+}
+
+static void bench_run (const gchar *label, void (*function) (struct icon *), struct icon *tray_icon, gint ticks)
+{
+    struct timespec start, end;
+    guint64 syscalls, allocations;
+    gdouble elapsed;
+    gint tick;
+
+    /* one tick out of the measure, to settle the power supplies and the caches */
+
+    function (tray_icon);
+
+    syscalls    = bench_syscalls;
+    allocations = bench_allocations;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+
+    for (tick = 0; tick < ticks; tick++) {
+        function (tray_icon);
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    elapsed = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+
+    g_print ("%-24s %10.0f ns/tick %8.2f syscalls/tick %8.2f allocations/tick\n", label, elapsed / ticks,
+        (gdouble)(bench_syscalls - syscalls) / ticks, (gdouble)(bench_allocations - allocations) / ticks);
+}
+
+#ifdef WITH_TRACE
+/*
+ * trace functions, a discharge recorded every BENCH_TRACE_INTERVAL from full to empty
+ */
+
+static void bench_write_trace (const gchar *path, gint hours)
+{
+    gchar value[SYSATTR_LTH];
+    GArray *supplies;
+    gint64 energy = BENCH_TRACE_CAPACITY;
+    gint64 power = BENCH_TRACE_CAPACITY / hours;
+    guint32 noise = 1;
+    gint ac, battery, tick, ticks;
+
+    if (open_trace (path) == FALSE) {
+        exit (1);
+    }
+
+    ac      = get_trace_supply ("AC");
+    battery = get_trace_supply ("BAT0");
+
+    supplies = g_array_new (FALSE, FALSE, sizeof (gint));
+    g_array_append_val (supplies, ac);
+    g_array_append_val (supplies, battery);
+    add_trace_scan (supplies);
+    g_array_free (supplies, TRUE);
+
+    add_trace_value (ac, TRACE_ATTRIBUTE_TYPE, "Mains");
+    add_trace_value (ac, SYSATTR_ONLINE, "0");
+    add_trace_value (battery, TRACE_ATTRIBUTE_TYPE, "Battery");
+    add_trace_value (battery, SYSATTR_PRESENT, "1");
+    add_trace_value (battery, SYSATTR_STATUS, "Discharging");
+    add_trace_value (battery, SYSATTR_ENERGY_FULL, G_STRINGIFY (BENCH_TRACE_CAPACITY));
+
+    ticks = hours * 3600 / BENCH_TRACE_INTERVAL;
+
+    for (tick = 0; tick <= ticks; tick++) {
+        g_string_append_c (trace_buffer, TRACE_TICK);
+        add_trace_varint (tick == 0 ? 1 : BENCH_TRACE_INTERVAL * G_USEC_PER_SEC);
+        add_trace_varint (0);
+        add_trace_varint (0);
+
+        /* the power drawn varies by up to 25 percent around the mean of the discharge */
+
+        noise = noise * 1103515245 + 12345;
+
+        g_snprintf (value, SYSATTR_LTH, "%" G_GINT64_FORMAT, power + power * (gint64)(noise >> 16 & 0xff) / 512 - power / 4);
+        add_trace_value (battery, SYSATTR_POWER_NOW, value);
+
+        g_snprintf (value, SYSATTR_LTH, "%" G_GINT64_FORMAT, MAX (energy, 0));
+        add_trace_value (battery, SYSATTR_ENERGY_NOW, value);
+
+        energy -= power * BENCH_TRACE_INTERVAL / 3600;
+
+        flush_trace ();
+    }
+
+    close (trace_fd);
+    trace_fd = -1;
+}
+#endif
+
+int main (int argc, char **argv)
+{
+    GError *error = NULL;
+
+    gint ticks = BENCH_DEFAULT_TICKS;
+    gint trace_hours = 0;
+    gchar *sampler_string = NULL;
+    struct icon *tray_icon;
+    GOptionContext *option_context;
+    GOptionEntry option_entries[] = {
+        { "ticks"    , 'n', 0, G_OPTION_ARG_INT   , &ticks                            , "Number of ticks", NULL },
+        { "aggregate", 'a', 0, G_OPTION_ARG_NONE  , &configuration.aggregate_batteries, "Aggregate all the batteries into one", NULL },
+        { "sampler"  , 's', 0, G_OPTION_ARG_STRING, &sampler_string                   , "Set sysfs sampler ('uevent' or 'file')", NULL },
+        { "devices"  , 0  , 0, G_OPTION_ARG_NONE  , &configuration.devices            , "Track the peripheral power supplies", NULL },
+#ifdef WITH_TRACE
+        { "trace-hours", 0, 0, G_OPTION_ARG_INT   , &trace_hours                      , "Write and replay the trace of a discharge of N hours", NULL },
+#endif
+        { NULL }
+    };
+
+    option_context = g_option_context_new ("SYSFS_ROOT");
+    g_option_context_add_main_entries (option_context, option_entries, NULL);
+
+    if (g_option_context_parse (option_context, &argc, &argv, &error) == FALSE || argc != 2 || ticks <= 0 || trace_hours < 0) {
+        g_printerr ("usage: %s [--ticks N] [--aggregate] [--sampler uevent|file] [--devices] SYSFS_ROOT\n"
+                    "       %s --trace-hours N TRACE_FILE\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    g_option_context_free (option_context);
+
+    /* the replay writes its timeline to the standard output and its duration to the standard error */
+
+#ifdef WITH_TRACE
+    if (trace_hours > 0) {
+        gchar *replay_argv[] = { argv[0], "--replay", argv[1], NULL };
+
+        bench_write_trace (argv[1], trace_hours);
+
+        return cbatticon_main (3, replay_argv);
+    }
+#endif
+
+    if (g_strcmp0 (sampler_string, "file") == 0) {
+        configuration.sampler = SAMPLER_FILE;
+    }
+
+    sysfs_path = g_build_filename (argv[1], SYSFS_POWER_SUPPLY, NULL);
+
+    configuration.headless = TRUE;
+#ifdef WITH_NOTIFY
+    configuration.hide_notification = TRUE;
+#endif
+
+    tray_icon = g_new0 (struct icon, 1);
+    tray_icon->name = g_strdup ("");
+
+    bench_run ("changed_power_supplies", bench_changed_power_supplies, tray_icon, ticks);
+    bench_run ("get_power_supplies", bench_get_power_supplies, tray_icon, ticks);
+    bench_run ("update_tray_icon_status", bench_update_tray_icon_status, tray_icon, ticks);
+    bench_run ("format", bench_format, tray_icon, ticks);
+
+    if (configuration.devices == TRUE) {
+        bench_run ("devices", bench_devices, tray_icon, ticks);
+    }
+
+    return 0;
+}
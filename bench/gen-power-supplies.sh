@@ -0,0 +1,152 @@
+#!/bin/sh
+#
+# Generate a fake sysfs power_supply tree, to be used with cbatticon --sysfs-root
+# (or CBATTICON_SYSFS_ROOT) and with the benchmark
+#
+# Usage: gen-power-supplies.sh [options] ROOT
+#   -b count    number of batteries (default: 1)
+#   -a count    number of AC adapters (default: 1)
+#   -d count    number of peripheral batteries, with scope Device (default: 0)
+#   -o 0|1      AC online (default: 0)
+#   -u units    battery units: energy, charge or capacity (default: energy)
+#               capacity provides neither energy_now nor charge_now, only the percentage
+#   -s status   battery status: Charging, Discharging, Full, "Not charging" or Unknown
+#               (default: Discharging)
+#   -p percent  remaining percentage (default: 50)
+#   -r          no current rate (neither power_now nor current_now)
+#   -n          no uevent file
+#   -w usec     slow attributes, the benchmark delays each read by usec microseconds
+#
+
+batteries=1
+acs=1
+peripherals=0
+online=0
+units=energy
+status=Discharging
+percent=50
+rate=1
+uevent=1
+slow=0
+
+while getopts "b:a:d:o:u:s:p:rnw:" option; do
+    case $option in
+        b) batteries=$OPTARG ;;
+        a) acs=$OPTARG ;;
+        d) peripherals=$OPTARG ;;
+        o) online=$OPTARG ;;
+        u) units=$OPTARG ;;
+        s) status=$OPTARG ;;
+        p) percent=$OPTARG ;;
+        r) rate=0 ;;
+        n) uevent=0 ;;
+        w) slow=$OPTARG ;;
+        *) sed -n '3,21s/^# \{0,1\}//p' "$0" >&2; exit 1 ;;
+    esac
+done
+
+shift $((OPTIND - 1))
+
+if [ $# -ne 1 ]; then
+    sed -n '3,21s/^# \{0,1\}//p' "$0" >&2
+    exit 1
+fi
+
+case $units in
+    energy|charge|capacity) ;;
+    *) echo "unknown units: $units" >&2; exit 1 ;;
+esac
+
+root=$1/class/power_supply
+
+# only a tree generated by this script is replaced
+
+if [ -e "$root" ] && [ ! -e "$1/.fake-power-supplies" ]; then
+    echo "$root exists and was not generated, not replacing it" >&2
+    exit 1
+fi
+
+rm -rf "$root"
+mkdir -p "$root"
+touch "$1/.fake-power-supplies"
+
+# attribute NAME VALUE: write the attribute file and its uevent line
+
+attribute() {
+    printf '%s\n' "$2" > "$supply/$1"
+    printf 'POWER_SUPPLY_%s=%s\n' "$(echo "$1" | tr 'a-z' 'A-Z')" "$2" >> "$supply/.uevent"
+}
+
+supply_done() {
+    if [ "$uevent" -eq 1 ]; then
+        mv "$supply/.uevent" "$supply/uevent"
+    else
+        rm -f "$supply/.uevent"
+    fi
+
+    if [ "$slow" -gt 0 ]; then
+        echo "$slow" > "$supply/.slow"
+    fi
+}
+
+i=0
+while [ $i -lt "$acs" ]; do
+    supply=$root/AC$i
+    mkdir -p "$supply"
+    printf 'POWER_SUPPLY_NAME=AC%s\n' $i > "$supply/.uevent"
+    attribute type Mains
+    attribute online "$online"
+    supply_done
+    i=$((i + 1))
+done
+
+i=0
+while [ $i -lt "$batteries" ]; do
+    supply=$root/BAT$i
+    mkdir -p "$supply"
+    printf 'POWER_SUPPLY_NAME=BAT%s\n' $i > "$supply/.uevent"
+    attribute type Battery
+    attribute present 1
+    attribute status "$status"
+
+    # each battery has a different full capacity, to exercise the weighted aggregation
+
+    full=$((50000000 + i * 10000000))
+    now=$((full / 100 * percent))
+
+    case $units in
+        energy)
+            attribute energy_full $full
+            attribute energy_now $now
+            [ $rate -eq 1 ] && attribute power_now 10000000
+            ;;
+        charge)
+            attribute charge_full $((full / 12))
+            attribute charge_now $((now / 12))
+            [ $rate -eq 1 ] && attribute current_now 800000
+            ;;
+        capacity)
+            attribute energy_full $full
+            [ $rate -eq 1 ] && attribute power_now 10000000
+            ;;
+    esac
+
+    attribute capacity "$percent"
+    supply_done
+    i=$((i + 1))
+done
+
+i=0
+while [ $i -lt "$peripherals" ]; do
+    supply=$root/hidpp_battery_$i
+    mkdir -p "$supply"
+    printf 'POWER_SUPPLY_NAME=hidpp_battery_%s\n' $i > "$supply/.uevent"
+    attribute type Battery
+    attribute scope Device
+    attribute model_name "Wireless Mouse $i"
+    attribute online 1
+    attribute status Discharging
+    attribute capacity $((100 - i * 5 % 100))
+    supply_done
+    i=$((i + 1))
+done
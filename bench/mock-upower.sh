@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Run cbatticon with the UPower backend against a mock UPower service (python-dbusmock)
+# on a private bus, the system bus of cbatticon is redirected to it
+#
+# Usage: mock-upower.sh [cbatticon options]
+#   the mock has one AC adapter and one discharging battery, change them from
+#   another terminal with the address printed at startup, for example:
+#   gdbus call --address ADDRESS --dest org.freedesktop.UPower \
+#     --object-path /org/freedesktop/UPower \
+#     --method org.freedesktop.DBus.Mock.SetDeviceProperties \
+#     /org/freedesktop/UPower/devices/battery_BAT0 "{'Percentage': <15.0>, 'Energy': <7.5>}"
+#
+
+cbatticon=${CBATTICON:-$(dirname "$0")/../cbatticon}
+
+if [ -z "$MOCK_UPOWER_BUS" ]; then
+    MOCK_UPOWER_BUS=1 exec dbus-run-session -- "$0" "$@"
+fi
+
+export DBUS_SYSTEM_BUS_ADDRESS=$DBUS_SESSION_BUS_ADDRESS
+echo "mock UPower bus: $DBUS_SYSTEM_BUS_ADDRESS" >&2
+
+python3 -m dbusmock --template upower &
+mock=$!
+trap 'kill $mock' EXIT
+
+gdbus wait --system --timeout 10 org.freedesktop.UPower || exit 1
+
+# mock METHOD ARGUMENTS: call a method of the mock on the UPower object
+
+mock() {
+    method=$1
+    shift
+
+    gdbus call --system --dest org.freedesktop.UPower --object-path /org/freedesktop/UPower \
+        --method "org.freedesktop.DBus.Mock.$method" "$@" > /dev/null || exit 1
+}
+
+mock AddAC line_power_AC "Mock AC"
+mock SetDeviceProperties /org/freedesktop/UPower/devices/line_power_AC "{'Online': <false>}"
+mock AddDischargingBattery battery_BAT0 "Mock Battery" 50.0 3600
+mock SetDeviceProperties /org/freedesktop/UPower/devices/battery_BAT0 \
+    "{'EnergyFull': <50.0>, 'Energy': <25.0>, 'EnergyRate': <25.0>}"
+
+"$cbatticon" --backend upower "$@"
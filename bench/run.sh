@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# Run the benchmark on a set of generated power supplies trees
+#
+# Usage: run.sh [ticks]
+#
+
+bench=$(dirname "$0")
+ticks=${1:-10000}
+root=$(mktemp -d) || exit 1
+
+trap 'rm -rf "$root"' EXIT
+
+# scenario NAME BENCH_OPTIONS -- GENERATOR_OPTIONS
+
+scenario() {
+    name=$1
+    shift
+
+    options=
+    while [ "$1" != "--" ]; do
+        options="$options $1"
+        shift
+    done
+    shift
+
+    "$bench/gen-power-supplies.sh" "$@" "$root/$name" || exit 1
+
+    echo "# $name"
+    for sampler in file uevent; do
+        echo "## sampler $sampler"
+        "$bench/cbatticon-bench" --ticks "$ticks" --sampler $sampler $options "$root/$name" || exit 1
+    done
+    echo
+}
+
+scenario single                 -- -s Discharging
+scenario charge                 -- -u charge -s Charging -o 1
+scenario no-rate                -- -r
+scenario capacity-only          -- -u capacity
+scenario unknown-ac-online      -- -s Unknown -o 1
+scenario many-batteries --aggregate -- -b 8 -a 2
+scenario peripherals --devices  -- -d 16
+scenario slow-files             -- -w 100
+scenario no-uevent              -- -n
+
+# the replay of an 8 hours discharge, on the virtual clock (unless built without WITH_TRACE)
+
+if "$bench/cbatticon-bench" --help | grep -q -- --trace-hours; then
+    echo "# replay"
+    "$bench/cbatticon-bench" --trace-hours 8 "$root/discharge.trace" > /dev/null || exit 1
+    echo
+fi
+
+# the readers of the shared memory, against a writer thread updating it without pause
+
+echo "# shm"
+"$bench/shm-reader" --writer --seconds 2 --readers 2 || exit 1
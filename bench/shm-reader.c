@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) 2011-2013 Colin Jones
+ * Copyright (C) 2014-2023 Valère Monseur
+ *
+ * Based on code by Matteo Marchesotti
+ * Copyright (C) 2007 Matteo Marchesotti <matteo.marchesotti@fsfe.org>
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * benchmark of the readers of cbatticon-shm.h, reading the shared memory in a loop
+ *
+ * by default, the region of a running cbatticon --shm is read and the states are checked against
+ * their ranges; with --writer, a thread writes the region as fast as it can while the readers
+ * check that every field of each state they copy comes from the same write (no torn read)
+ *
+ * the header is used as a status bar module would, without glib
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cbatticon-shm.h"
+
+#define READER_DEFAULT_SECONDS 5
+#define READER_MAX_THREADS     64
+#define READER_CLOCK_READS     1024 /* reads between two checks of the clock */
+
+struct reader {
+    pthread_t thread;
+    uint64_t  reads;
+    uint64_t  failures;  /* the state was being written during all the retries */
+    uint64_t  torn;      /* fields of different writes, or out of their ranges */
+    uint64_t  states;    /* different states seen */
+    double    elapsed;   /* nanoseconds */
+};
+
+static struct cbatticon_shm *region   = NULL;
+static int                   seconds  = READER_DEFAULT_SECONDS;
+static int                   writer   = 0;
+static int                   stopping = 0;
+static uint64_t              writes   = 0;
+
+static double get_time (void)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+/*
+ * writer functions, every field of a state is derived from its serial
+ */
+
+static void fill_state (struct cbatticon_shm_state *state, uint64_t serial)
+{
+    state->serial             = serial;
+    state->update_time        = (int64_t)(serial * 3);
+    state->status             = (int32_t)(serial % 6);
+    state->percentage         = (int32_t)(serial % 101);
+    state->time               = (int32_t)(serial % 1000);
+    state->flags              = (uint32_t)(serial & 63);
+    state->full_capacity      = (double)serial;
+    state->remaining_capacity = serial * 0.5;
+    state->rate               = serial * 0.25;
+    state->confidence         = (serial % 100) / 100.0;
+}
+
+static int check_written_state (const struct cbatticon_shm_state *state)
+{
+    struct cbatticon_shm_state expected;
+
+    memset (&expected, 0, sizeof (expected));
+    fill_state (&expected, state->serial);
+
+    return memcmp (&expected, state, sizeof (expected)) == 0;
+}
+
+static void *run_writer (void *data)
+{
+    struct cbatticon_shm_state state;
+    uint64_t serial = 0;
+
+    (void)data;
+
+    memset (&state, 0, sizeof (state));
+
+    while (__atomic_load_n (&stopping, __ATOMIC_RELAXED) == 0) {
+        fill_state (&state, ++serial);
+
+        /* field by field, a reader missing the sequence counter would see a mix of two writes */
+
+        cbatticon_shm_write_begin (region);
+        region->state.serial             = state.serial;
+        region->state.update_time        = state.update_time;
+        region->state.status             = state.status;
+        region->state.percentage         = state.percentage;
+        region->state.time               = state.time;
+        region->state.flags              = state.flags;
+        region->state.full_capacity      = state.full_capacity;
+        region->state.remaining_capacity = state.remaining_capacity;
+        region->state.rate               = state.rate;
+        region->state.confidence         = state.confidence;
+        cbatticon_shm_write_end (region);
+    }
+
+    writes = serial;
+
+    return NULL;
+}
+
+/*
+ * reader functions
+ */
+
+static int check_cbatticon_state (const struct cbatticon_shm_state *state)
+{
+    if (state->status < CBATTICON_SHM_STATUS_NONE || state->status > CBATTICON_SHM_STATUS_NOTCHARGING)
+        return 0;
+    if (state->percentage < -1 || state->percentage > 100)
+        return 0;
+    if (state->time < -1)
+        return 0;
+    if (state->confidence < 0 || state->confidence > 1)
+        return 0;
+
+    return 1;
+}
+
+static void *run_reader (void *data)
+{
+    struct reader *reader = data;
+    struct cbatticon_shm_state state;
+    uint64_t serial = 0;
+    double start, end, deadline;
+    int i, result;
+
+    start    = get_time ();
+    deadline = start + seconds * 1e9;
+    end      = start;
+
+    while (end < deadline) {
+        for (i = 0; i < READER_CLOCK_READS; i++) {
+            result = cbatticon_shm_read (region, &state);
+
+            if (result == 0) {
+                reader->failures++;
+                continue;
+            }
+
+            if (result < 0) {
+                reader->torn++;
+                continue;
+            }
+
+            if ((writer != 0 ? check_written_state (&state) : check_cbatticon_state (&state)) == 0) {
+                reader->torn++;
+            }
+
+            if (state.serial != serial) {
+                serial = state.serial;
+                reader->states++;
+            }
+        }
+
+        reader->reads += READER_CLOCK_READS;
+        end = get_time ();
+    }
+
+    reader->elapsed = end - start;
+
+    return NULL;
+}
+
+static struct cbatticon_shm *create_private_region (void)
+{
+    char path[] = "/tmp/cbatticon-shm-XXXXXX";
+    struct cbatticon_shm *shm;
+    int fd;
+
+    fd = mkstemp (path);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    unlink (path);
+
+    if (ftruncate (fd, sizeof (struct cbatticon_shm)) < 0) {
+        close (fd);
+        return NULL;
+    }
+
+    shm = mmap (NULL, sizeof (struct cbatticon_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+
+    if (shm == MAP_FAILED) {
+        return NULL;
+    }
+
+    shm->magic   = CBATTICON_SHM_MAGIC;
+    shm->version = CBATTICON_SHM_VERSION;
+    shm->size    = sizeof (struct cbatticon_shm);
+
+    return shm;
+}
+
+static void usage (const char *name)
+{
+    fprintf (stderr, "usage: %s [--seconds N] [--readers N] [--writer | PATH]\n", name);
+}
+
+int main (int argc, char **argv)
+{
+    struct reader readers[READER_MAX_THREADS];
+    pthread_t writer_thread;
+    const char *path = NULL;
+    uint64_t reads = 0, failures = 0, torn = 0;
+    double elapsed = 0;
+    int count = 1, i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp (argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atoi (argv[++i]);
+        } else if (strcmp (argv[i], "--readers") == 0 && i + 1 < argc) {
+            count = atoi (argv[++i]);
+        } else if (strcmp (argv[i], "--writer") == 0) {
+            writer = 1;
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            usage (argv[0]);
+            return 1;
+        }
+    }
+
+    if (seconds <= 0 || count <= 0 || count > READER_MAX_THREADS || (writer != 0 && path != NULL)) {
+        usage (argv[0]);
+        return 1;
+    }
+
+    region = writer != 0 ? create_private_region () : cbatticon_shm_map (path);
+    if (region == NULL) {
+        fprintf (stderr, "cannot map %s: %s\n", writer != 0 ? "a private region" : (path != NULL ? path : CBATTICON_SHM_FILE),
+            errno != 0 ? strerror (errno) : "XDG_RUNTIME_DIR is not set");
+        return 1;
+    }
+
+    if (cbatticon_shm_read (region, &(struct cbatticon_shm_state){ 0 }) < 0) {
+        fprintf (stderr, "not a cbatticon region (version %d): %s\n", CBATTICON_SHM_VERSION, path != NULL ? path : CBATTICON_SHM_FILE);
+        return 1;
+    }
+
+    if (writer != 0 && pthread_create (&writer_thread, NULL, run_writer, NULL) != 0) {
+        fprintf (stderr, "cannot start the writer\n");
+        return 1;
+    }
+
+    memset (readers, 0, sizeof (readers));
+
+    for (i = 0; i < count; i++) {
+        if (pthread_create (&readers[i].thread, NULL, run_reader, &readers[i]) != 0) {
+            fprintf (stderr, "cannot start the readers\n");
+            return 1;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        pthread_join (readers[i].thread, NULL);
+
+        reads    += readers[i].reads;
+        failures += readers[i].failures;
+        torn     += readers[i].torn;
+        elapsed  += readers[i].elapsed;
+
+        printf ("reader %-3d %12llu reads %8.1f ns/read %10llu states %8llu failed %8llu torn\n", i,
+            (unsigned long long)readers[i].reads, readers[i].elapsed / readers[i].reads,
+            (unsigned long long)readers[i].states, (unsigned long long)readers[i].failures,
+            (unsigned long long)readers[i].torn);
+    }
+
+    if (writer != 0) {
+        __atomic_store_n (&stopping, 1, __ATOMIC_RELAXED);
+        pthread_join (writer_thread, NULL);
+        printf ("writer     %12llu writes\n", (unsigned long long)writes);
+    }
+
+    printf ("total      %12llu reads %8.1f ns/read %21s %8llu failed %8llu torn\n", (unsigned long long)reads,
+        elapsed / reads, "", (unsigned long long)failures, (unsigned long long)torn);
+
+    return torn == 0 ? 0 : 1;
+}
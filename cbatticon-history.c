@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2011-2013 Colin Jones
+ * Copyright (C) 2014-2023 Valère Monseur
+ *
+ * Based on code by Matteo Marchesotti
+ * Copyright (C) 2007 Matteo Marchesotti <matteo.marchesotti@fsfe.org>
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cbatticon.h"
+#include "cbatticon-history.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#define HISTORY_FILE         "history"
+#define HISTORY_MAGIC        "CBATHIST"
+#define HISTORY_VERSION      1
+#define HISTORY_RECORDS      (366 * 24 * 60) /* a year of 1 minute records */
+#define HISTORY_INTERVAL     60              /* seconds between records of the same status */
+#define HISTORY_SYNC_RECORDS 60              /* records between two asynchronous msync */
+#define HISTORY_SESSION_GAP  600             /* seconds without record that end a session */
+#define HISTORY_CLOCK_SKEW   300             /* seconds a wall clock set back is clamped to the last record */
+
+struct history_header {
+    gchar   magic[8];
+    guint32 version;
+    guint32 record_size;
+    guint32 capacity;
+    guint32 head;  /* index of the next record */
+    guint32 count;
+    guint32 reserved[9];
+};
+
+struct history_record {
+    guint32 timestamp;  /* seconds since the epoch */
+    guint8  status;
+    guint8  percentage;
+    guint8  unit;
+    gfloat  capacity;   /* remaining capacity in Wh (Ah), NAN when unknown */
+    gfloat  rate;       /* current rate in W (A), NAN when unknown */
+} __attribute__((packed));
+
+struct history_stats {
+    guint   count;
+    gdouble rate_min;
+    gdouble rate_max;
+    gdouble rate_sum;
+};
+
+/*
+ * history of the battery, an append-only circular buffer of records in a file mapped in memory
+ * the records are written in the mapping, the kernel writes them back with an occasional msync
+ */
+
+static struct history_header *history_header    = NULL;
+static struct history_record *history_records   = NULL;
+static gsize                  history_size      = 0;
+static gint                   history_status    = -1;
+static guint32                history_timestamp = 0;
+static guint                  history_unsynced  = 0;
+
+static guint get_history_index (guint32 timestamp);
+static void get_history_stats (const struct history_record *records, guint count, struct history_stats *stats);
+
+/*
+ * history functions
+ */
+
+gboolean open_history (gboolean read_only)
+{
+    struct history_header header;
+    gchar *directory, *path;
+    gint fd;
+
+    directory = g_build_filename (g_get_user_data_dir (), CBATTICON_STRING, NULL);
+    path = g_build_filename (directory, HISTORY_FILE, NULL);
+
+    if (read_only == FALSE) {
+        g_mkdir_with_parents (directory, 0700);
+    }
+
+    history_size = sizeof (struct history_header) + (gsize)HISTORY_RECORDS * sizeof (struct history_record);
+
+    fd = open (path, (read_only == TRUE ? O_RDONLY : O_RDWR | O_CREAT) | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        if (read_only == TRUE || configuration.debug_output == TRUE) {
+            g_printerr (_("Cannot open history file: %s (%s)\n"), path, g_strerror (errno));
+        }
+
+        g_free (path);
+        g_free (directory);
+        return FALSE;
+    }
+
+    /* a single instance records the history, the lock is released when the process exits */
+
+    if (read_only == FALSE && flock (fd, LOCK_EX | LOCK_NB) < 0) {
+        if (configuration.debug_output == TRUE) {
+            g_printf ("history: %s is locked by another instance\n", path);
+        }
+
+        close (fd);
+        g_free (path);
+        g_free (directory);
+        return FALSE;
+    }
+
+    /* the header is checked before mapping, a file with another layout is started over */
+
+    memset (&header, 0, sizeof (header));
+    if (pread (fd, &header, sizeof (header), 0) != sizeof (header) ||
+        memcmp (header.magic, HISTORY_MAGIC, sizeof (header.magic)) != 0 ||
+        header.version != HISTORY_VERSION ||
+        header.record_size != sizeof (struct history_record) ||
+        header.capacity != HISTORY_RECORDS) {
+        if (read_only == TRUE) {
+            g_printerr (_("Invalid history file: %s\n"), path);
+
+            close (fd);
+            g_free (path);
+            g_free (directory);
+            return FALSE;
+        }
+
+        memset (&header, 0, sizeof (header));
+        memcpy (header.magic, HISTORY_MAGIC, sizeof (header.magic));
+        header.version     = HISTORY_VERSION;
+        header.record_size = sizeof (struct history_record);
+        header.capacity    = HISTORY_RECORDS;
+
+        if (ftruncate (fd, 0) < 0 || ftruncate (fd, history_size) < 0 ||
+            pwrite (fd, &header, sizeof (header), 0) != sizeof (header)) {
+            g_printerr (_("Cannot create history file: %s (%s)\n"), path, g_strerror (errno));
+
+            close (fd);
+            g_free (path);
+            g_free (directory);
+            return FALSE;
+        }
+    }
+
+    history_header = mmap (NULL, history_size, read_only == TRUE ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (history_header == MAP_FAILED) {
+        g_printerr (_("Cannot map history file: %s (%s)\n"), path, g_strerror (errno));
+
+        history_header = NULL;
+        close (fd);
+        g_free (path);
+        g_free (directory);
+        return FALSE;
+    }
+
+    history_records = (struct history_record *)(history_header + 1);
+
+    /* the writer keeps the descriptor open to hold the lock */
+
+    if (read_only == TRUE) {
+        close (fd);
+    }
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("history: %s (%u records)\n", path, history_header->count);
+    }
+
+    g_free (path);
+    g_free (directory);
+    return TRUE;
+}
+
+void add_history_record (gint status, gint percentage)
+{
+    struct history_record *record;
+    guint32 timestamp, last_timestamp;
+    gboolean charge;
+
+    if (history_header == NULL) {
+        return;
+    }
+
+    /* the records are searched by timestamp, a wall clock set back must not take them out of order */
+    /* a small step back is clamped to the last record, the records of a clock that was far ahead are dropped */
+
+    timestamp = (guint32)(g_get_real_time () / G_USEC_PER_SEC);
+
+    while (history_header->count > 0) {
+        last_timestamp = history_records[(history_header->head + HISTORY_RECORDS - 1) % HISTORY_RECORDS].timestamp;
+
+        if (last_timestamp <= timestamp) {
+            break;
+        }
+
+        if (last_timestamp - timestamp <= HISTORY_CLOCK_SKEW) {
+            timestamp = last_timestamp;
+            break;
+        }
+
+        history_header->head = (history_header->head + HISTORY_RECORDS - 1) % HISTORY_RECORDS;
+        history_header->count--;
+        history_timestamp = 0;
+    }
+
+    /* one record per interval, and one for each change of status */
+
+    if (status == history_status && timestamp - history_timestamp < HISTORY_INTERVAL) {
+        return;
+    }
+
+    history_status    = status;
+    history_timestamp = timestamp;
+
+    charge = (status == CHARGING || status == DISCHARGING || status == NOTCHARGING);
+
+    record = &history_records[history_header->head];
+    record->timestamp  = timestamp;
+    record->status     = (guint8)status;
+    record->percentage = (guint8)CLAMP (percentage, 0, 100);
+    record->unit       = (guint8)last_capacity_unit;
+    record->capacity   = (charge == TRUE && last_remaining_capacity >= 0) ? last_remaining_capacity / (last_capacity_unit == CAPACITY_SCALED ? 1.0 : 1e6) : NAN;
+    record->rate       = (charge == TRUE && last_current_rate >= 0) ? last_current_rate / (last_capacity_unit == CAPACITY_SCALED ? 1.0 : 1e6) : NAN;
+
+    history_header->head = (history_header->head + 1) % HISTORY_RECORDS;
+    if (history_header->count < HISTORY_RECORDS) {
+        history_header->count++;
+    }
+
+    if (++history_unsynced >= HISTORY_SYNC_RECORDS) {
+        history_unsynced = 0;
+        msync (history_header, history_size, MS_ASYNC);
+    }
+}
+
+static guint get_history_index (guint32 timestamp)
+{
+    guint first, low, high, middle;
+
+    /* binary search of the first record at or after the timestamp, in the order of the records */
+
+    first = (history_header->head + HISTORY_RECORDS - history_header->count) % HISTORY_RECORDS;
+    low   = 0;
+    high  = history_header->count;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+
+        if (history_records[(first + middle) % HISTORY_RECORDS].timestamp < timestamp) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+static void get_history_stats (const struct history_record *records, guint count, struct history_stats *stats)
+{
+    guint i;
+
+    /* branchless so that the compiler can vectorize it */
+
+    for (i = 0; i < count; i++) {
+        gdouble rate = records[i].rate;
+        gboolean valid = (records[i].status == DISCHARGING) & (rate == rate);
+
+        stats->count    += valid;
+        stats->rate_sum += valid ? rate : 0;
+        stats->rate_min  = (valid && rate < stats->rate_min) ? rate : stats->rate_min;
+        stats->rate_max  = (valid && rate > stats->rate_max) ? rate : stats->rate_max;
+    }
+}
+
+void query_history (gint hours)
+{
+    static const gchar *unit_labels[] = { "Wh", "Ah", "%" };
+    static const gchar *rate_labels[] = { "W", "A", "%/h" };
+
+    struct history_stats stats = { 0, G_MAXDOUBLE, -G_MAXDOUBLE, 0 };
+    const struct history_record *record, *session_start = NULL, *session_end = NULL;
+    guint first, start, count, segment, i, sessions = 0;
+    guint32 from;
+    gdouble session_capacity, total_capacity = 0, total_duration = 0;
+    gchar *from_string, *to_string;
+    GDateTime *date_time;
+
+    if (open_history (TRUE) == FALSE) {
+        return;
+    }
+
+    from  = (hours > 0) ? (guint32)(g_get_real_time () / G_USEC_PER_SEC) - (guint32)hours * 3600 : 0;
+    first = (history_header->head + HISTORY_RECORDS - history_header->count) % HISTORY_RECORDS;
+    start = get_history_index (from);
+    count = history_header->count - start;
+
+    if (count == 0) {
+        g_print (_("No history\n"));
+        return;
+    }
+
+    /* the range is at most two contiguous segments of the circular buffer */
+
+    start = (first + start) % HISTORY_RECORDS;
+    segment = MIN (count, HISTORY_RECORDS - start);
+    get_history_stats (&history_records[start], segment, &stats);
+    get_history_stats (history_records, count - segment, &stats);
+
+    date_time = g_date_time_new_from_unix_local (history_records[start].timestamp);
+    from_string = g_date_time_format (date_time, "%Y-%m-%d %H:%M");
+    g_date_time_unref (date_time);
+
+    date_time = g_date_time_new_from_unix_local (history_records[(start + count - 1) % HISTORY_RECORDS].timestamp);
+    to_string = g_date_time_format (date_time, "%Y-%m-%d %H:%M");
+    g_date_time_unref (date_time);
+
+    g_print (_("History: %u records from %s to %s\n"), count, from_string, to_string);
+    g_free (from_string);
+    g_free (to_string);
+
+    if (stats.count > 0) {
+        g_print (_("Discharge rate: min %.2f, mean %.2f, max %.2f %s\n"), stats.rate_min, stats.rate_sum / stats.count,
+            stats.rate_max, rate_labels[history_records[start].unit % G_N_ELEMENTS (rate_labels)]);
+    }
+
+    /*
+     * a discharge session is a run of discharging records,
+     * ended by another status or by a gap (suspend, shutdown) in the records
+     */
+
+    g_print (_("Discharge sessions:\n"));
+
+    for (i = 0; i <= count; i++) {
+        record = (i < count) ? &history_records[(start + i) % HISTORY_RECORDS] : NULL;
+
+        if (session_start != NULL &&
+            (record == NULL || record->status != DISCHARGING || record->timestamp - session_end->timestamp > HISTORY_SESSION_GAP)) {
+            gchar *session_string;
+
+            date_time = g_date_time_new_from_unix_local (session_start->timestamp);
+            session_string = g_date_time_format (date_time, "%Y-%m-%d %H:%M");
+            g_date_time_unref (date_time);
+
+            session_capacity = session_start->capacity - session_end->capacity;
+            if (session_capacity != session_capacity) {
+                session_capacity = 0;
+            }
+
+            g_print ("  %s  %4uh %02um  %3u%% -> %3u%%  %8.2f %s\n", session_string,
+                (session_end->timestamp - session_start->timestamp) / 3600,
+                (session_end->timestamp - session_start->timestamp) / 60 % 60,
+                session_start->percentage, session_end->percentage,
+                session_capacity, unit_labels[session_start->unit % G_N_ELEMENTS (unit_labels)]);
+            g_free (session_string);
+
+            sessions++;
+            total_capacity += session_capacity;
+            total_duration += session_end->timestamp - session_start->timestamp;
+            session_start = NULL;
+        }
+
+        if (record != NULL && record->status == DISCHARGING) {
+            if (session_start == NULL) {
+                session_start = record;
+            }
+
+            session_end = record;
+        }
+    }
+
+    if (sessions > 0) {
+        g_print (_("%u sessions, mean duration %.0f minutes, mean %.2f %s per session\n"), sessions,
+            total_duration / sessions / 60.0, total_capacity / sessions,
+            unit_labels[history_records[start].unit % G_N_ELEMENTS (unit_labels)]);
+    }
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2011-2013 Colin Jones
+ * Copyright (C) 2014-2023 Valère Monseur
+ *
+ * Based on code by Matteo Marchesotti
+ * Copyright (C) 2007 Matteo Marchesotti <matteo.marchesotti@fsfe.org>
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * history of the battery (--history), recorded by each update in $XDG_DATA_HOME/cbatticon/history
+ */
+
+#ifndef CBATTICON_HISTORY_H
+#define CBATTICON_HISTORY_H
+
+gboolean open_history (gboolean read_only);
+void add_history_record (gint status, gint percentage);
+void query_history (gint hours);
+
+#endif
@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2011-2013 Colin Jones
+ * Copyright (C) 2014-2023 Valère Monseur
+ *
+ * Based on code by Matteo Marchesotti
+ * Copyright (C) 2007 Matteo Marchesotti <matteo.marchesotti@fsfe.org>
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cbatticon.h"
+#include "cbatticon-shm.h"
+#include "cbatticon-shm-writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+/*
+ * shared memory, $XDG_RUNTIME_DIR/cbatticon/shm, holding the state of the last update for the readers of cbatticon-shm.h
+ * the state is written under a sequence counter, the readers copy it without syscall nor lock
+ */
+
+static struct cbatticon_shm *shm_region       = NULL;
+static guint64               shm_publications = 0;
+
+G_STATIC_ASSERT (CBATTICON_SHM_STATUS_MISSING     == MISSING);
+G_STATIC_ASSERT (CBATTICON_SHM_STATUS_UNKNOWN     == UNKNOWN);
+G_STATIC_ASSERT (CBATTICON_SHM_STATUS_CHARGED     == CHARGED);
+G_STATIC_ASSERT (CBATTICON_SHM_STATUS_CHARGING    == CHARGING);
+G_STATIC_ASSERT (CBATTICON_SHM_STATUS_DISCHARGING == DISCHARGING);
+G_STATIC_ASSERT (CBATTICON_SHM_STATUS_NOTCHARGING == NOTCHARGING);
+
+/*
+ * shared memory functions
+ */
+
+gboolean create_shm_region (void)
+{
+    gchar *path, *directory;
+    gpointer region;
+    gint fd;
+
+    /* the file is kept across restarts, so the readers that mapped it keep reading the new states */
+
+    path = g_build_filename (g_get_user_runtime_dir (), CBATTICON_SHM_FILE, NULL);
+
+    directory = g_path_get_dirname (path);
+    g_mkdir_with_parents (directory, 0700);
+    g_free (directory);
+
+    fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        g_printerr (_("Cannot create shared memory: %s (%s)\n"), path, g_strerror (errno));
+        g_free (path);
+        return FALSE;
+    }
+
+    /* a single instance publishes its state, the lock is released when the process exits */
+
+    if (flock (fd, LOCK_EX | LOCK_NB) < 0) {
+        g_printerr (_("Shared memory is locked by another instance, the state is not published: %s\n"), path);
+
+        close (fd);
+        g_free (path);
+        return FALSE;
+    }
+
+    if (ftruncate (fd, sizeof (struct cbatticon_shm)) < 0) {
+        g_printerr (_("Cannot create shared memory: %s (%s)\n"), path, g_strerror (errno));
+
+        close (fd);
+        g_free (path);
+        return FALSE;
+    }
+
+    region = mmap (NULL, sizeof (struct cbatticon_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED) {
+        g_printerr (_("Cannot map shared memory: %s (%s)\n"), path, g_strerror (errno));
+
+        close (fd);
+        g_free (path);
+        return FALSE;
+    }
+
+    /* the descriptor is kept open to hold the lock */
+
+    shm_region = region;
+
+    /* a cbatticon killed while writing left the counter odd, the next write must start from an even one */
+
+    cbatticon_shm_write_begin (shm_region);
+
+    if ((shm_region->sequence & 1) == 0) {
+        shm_region->sequence++;
+    }
+
+    shm_region->magic   = CBATTICON_SHM_MAGIC;
+    shm_region->version = CBATTICON_SHM_VERSION;
+    shm_region->size    = sizeof (struct cbatticon_shm);
+    memset (&shm_region->state, 0, sizeof (shm_region->state));
+    shm_region->state.status     = CBATTICON_SHM_STATUS_NONE;
+    shm_region->state.percentage = -1;
+    shm_region->state.time       = -1;
+
+    cbatticon_shm_write_end (shm_region);
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("shm: publishing in %s\n", path);
+    }
+
+    g_free (path);
+
+    return TRUE;
+}
+
+void publish_shm_state (gint status, gint percentage, gint time, gboolean stale)
+{
+    struct cbatticon_shm_state state;
+    gboolean sampled, discharging;
+
+    if (shm_region == NULL) {
+        return;
+    }
+
+    /* the state is built aside, the region is only held odd for the copy */
+
+    sampled     = status == CHARGING || status == DISCHARGING || status == NOTCHARGING;
+    discharging = status == DISCHARGING || status == NOTCHARGING;
+
+    memset (&state, 0, sizeof (state));
+    state.serial             = shm_region->state.serial + 1;
+    state.update_time        = g_get_real_time ();
+    state.status             = status;
+    state.percentage         = percentage;
+    state.time               = time;
+    state.full_capacity      = sampled == TRUE ? last_full_capacity : -1;
+    state.remaining_capacity = sampled == TRUE ? last_remaining_capacity : -1;
+    state.rate               = sampled == TRUE ? last_current_rate : -1;
+    state.confidence         = sampled == TRUE ? last_time_confidence : 0;
+
+    if (discharging == TRUE && percentage <= configuration.low_level)
+        state.flags |= CBATTICON_SHM_LOW;
+    if (discharging == TRUE && percentage <= configuration.critical_level)
+        state.flags |= CBATTICON_SHM_CRITICAL;
+    if (time >= 0 && last_time_confidence < ESTIMATOR_LOW_CONFIDENCE)
+        state.flags |= CBATTICON_SHM_ROUGH_ESTIMATE;
+    if (last_capacity_unit == CAPACITY_CHARGE)
+        state.flags |= CBATTICON_SHM_CHARGE_UNIT;
+    if (last_capacity_unit == CAPACITY_SCALED)
+        state.flags |= CBATTICON_SHM_SCALED_UNIT;
+    if (stale == TRUE)
+        state.flags |= CBATTICON_SHM_STALE;
+
+    cbatticon_shm_write_begin (shm_region);
+    shm_region->state = state;
+    cbatticon_shm_write_end (shm_region);
+
+    shm_publications++;
+}
+
+void append_shm_stats (GString *report)
+{
+    if (shm_region != NULL) {
+        g_string_append_printf (report, "stats: %" G_GUINT64_FORMAT " shared memory publications\n", shm_publications);
+    }
+}
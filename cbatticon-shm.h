@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2011-2013 Colin Jones
+ * Copyright (C) 2014-2023 Valère Monseur
+ *
+ * Based on code by Matteo Marchesotti
+ * Copyright (C) 2007 Matteo Marchesotti <matteo.marchesotti@fsfe.org>
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * battery status published by cbatticon --shm in $XDG_RUNTIME_DIR/cbatticon/shm
+ *
+ * the file is mapped by the readers, a read is a copy of the state between two loads of
+ * the sequence counter, without any syscall nor any lock: the counter is odd while cbatticon
+ * writes the state, and a copy is consistent when the counter is even and did not change
+ *
+ *   struct cbatticon_shm *shm = cbatticon_shm_map (NULL);
+ *   struct cbatticon_shm_state state;
+ *
+ *   if (shm != NULL && cbatticon_shm_read (shm, &state) == 1)
+ *       printf ("%d%%\n", state.percentage);
+ *
+ * the header only depends on the libc, and on the __atomic builtins of gcc and clang
+ */
+
+#ifndef CBATTICON_SHM_H
+#define CBATTICON_SHM_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CBATTICON_SHM_FILE    "cbatticon/shm" /* relative to $XDG_RUNTIME_DIR */
+#define CBATTICON_SHM_MAGIC   0x4d534243      /* "CBSM" */
+#define CBATTICON_SHM_VERSION 1
+#define CBATTICON_SHM_RETRIES 1000            /* reads of a state that is being written before giving up */
+
+/* status of the battery, the values of cbatticon */
+
+#define CBATTICON_SHM_STATUS_NONE         -1 /* no battery (AC only), or not sampled yet */
+#define CBATTICON_SHM_STATUS_MISSING      0
+#define CBATTICON_SHM_STATUS_UNKNOWN      1
+#define CBATTICON_SHM_STATUS_CHARGED      2
+#define CBATTICON_SHM_STATUS_CHARGING     3
+#define CBATTICON_SHM_STATUS_DISCHARGING  4
+#define CBATTICON_SHM_STATUS_NOTCHARGING  5
+
+#define CBATTICON_SHM_LOW            (1 << 0) /* discharging at or below the low level */
+#define CBATTICON_SHM_CRITICAL       (1 << 1) /* discharging at or below the critical level */
+#define CBATTICON_SHM_ROUGH_ESTIMATE (1 << 2) /* low confidence of the estimator in the time */
+#define CBATTICON_SHM_CHARGE_UNIT    (1 << 3) /* capacities in Ah and rate in A, Wh and W otherwise */
+#define CBATTICON_SHM_SCALED_UNIT    (1 << 4) /* batteries with mixed units, each one scaled to a capacity of 100 */
+#define CBATTICON_SHM_STALE          (1 << 5) /* the power supplies were still being read, the state is the one of a previous sample */
+
+struct cbatticon_shm_state {
+    uint64_t serial;               /* number of the update, incremented by each one */
+    int64_t  update_time;          /* microseconds since the epoch */
+    int32_t  status;               /* CBATTICON_SHM_STATUS_* */
+    int32_t  percentage;           /* -1 when unknown */
+    int32_t  time;                 /* minutes remaining or until charged, -1 when unknown */
+    uint32_t flags;                /* CBATTICON_SHM_* */
+    double   full_capacity;        /* -1 when not sampled by the update */
+    double   remaining_capacity;   /* -1 when not sampled by the update */
+    double   rate;                 /* rate estimated from the samples per hour, -1 when unknown */
+    double   confidence;           /* of the estimated rate, between 0 and 1 */
+};
+
+struct cbatticon_shm {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;                 /* of struct cbatticon_shm */
+    uint32_t sequence;             /* odd while the state is written */
+    struct cbatticon_shm_state state;
+};
+
+/*
+ * writer functions, used by cbatticon (a single writer)
+ */
+
+static inline void cbatticon_shm_write_begin (struct cbatticon_shm *shm)
+{
+    __atomic_store_n (&shm->sequence, shm->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+}
+
+static inline void cbatticon_shm_write_end (struct cbatticon_shm *shm)
+{
+    __atomic_store_n (&shm->sequence, shm->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * reader functions
+ */
+
+/* 1: consistent copy, 0: the state was being written during all the retries, -1: not a cbatticon region */
+
+static inline int cbatticon_shm_read (const struct cbatticon_shm *shm, struct cbatticon_shm_state *state)
+{
+    uint32_t begin, end;
+    int retries;
+
+    if (shm->magic != CBATTICON_SHM_MAGIC || shm->version != CBATTICON_SHM_VERSION ||
+        shm->size != sizeof (struct cbatticon_shm)) {
+        return -1;
+    }
+
+    for (retries = 0; retries < CBATTICON_SHM_RETRIES; retries++) {
+        begin = __atomic_load_n (&shm->sequence, __ATOMIC_ACQUIRE);
+
+        if ((begin & 1) != 0) {
+            continue;
+        }
+
+        memcpy (state, (const void *)&shm->state, sizeof (*state));
+
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);
+        end = __atomic_load_n (&shm->sequence, __ATOMIC_RELAXED);
+
+        if (begin == end) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* path NULL for $XDG_RUNTIME_DIR/cbatticon/shm, the region stays valid when cbatticon restarts */
+
+static inline struct cbatticon_shm* cbatticon_shm_map (const char *path)
+{
+    struct cbatticon_shm *shm;
+    char default_path[4096];
+    struct stat info;
+    int fd;
+
+    if (path == NULL) {
+        if (getenv ("XDG_RUNTIME_DIR") == NULL) {
+            return NULL;
+        }
+
+        snprintf (default_path, sizeof (default_path), "%s/%s", getenv ("XDG_RUNTIME_DIR"), CBATTICON_SHM_FILE);
+        path = default_path;
+    }
+
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat (fd, &info) < 0 || info.st_size < (off_t)sizeof (struct cbatticon_shm)) {
+        close (fd);
+        return NULL;
+    }
+
+    shm = mmap (NULL, sizeof (struct cbatticon_shm), PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+
+    return shm != MAP_FAILED ? shm : NULL;
+}
+
+static inline void cbatticon_shm_unmap (struct cbatticon_shm *shm)
+{
+    munmap (shm, sizeof (struct cbatticon_shm));
+}
+
+#endif
@@ -0,0 +1,468 @@
+/*
+ * Copyright (C) 2011-2013 Colin Jones
+ * Copyright (C) 2014-2023 Valère Monseur
+ *
+ * Based on code by Matteo Marchesotti
+ * Copyright (C) 2007 Matteo Marchesotti <matteo.marchesotti@fsfe.org>
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cbatticon.h"
+#include "cbatticon-socket.h"
+
+#include <glib-unix.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SOCKET_FILE        "socket"
+#define SOCKET_MAX_CLIENTS 64
+#define SOCKET_INPUT_LTH   256   /* longest command line of a client */
+#define SOCKET_OUTPUT_LTH  16384 /* pending output of a client, a client that does not read it is disconnected */
+
+struct socket_status {
+    guint    serial;
+    gint     status;     /* -1 when unknown or AC only */
+    gint     percentage; /* -1 when unknown */
+    gint     time;       /* minutes, -1 when unknown */
+    gboolean low;
+    gboolean critical;
+};
+
+struct socket_client {
+    gint                 fd;
+    guint                source;
+    GIOCondition         condition;
+    gchar                input[SOCKET_INPUT_LTH];
+    gsize                input_length;
+    GString             *output;
+    gboolean             subscribed;
+    gboolean             stale; /* a change was not pushed while the output was pending */
+    struct socket_status sent;  /* last status pushed to the subscriber */
+};
+
+/*
+ * local socket, $XDG_RUNTIME_DIR/cbatticon/socket, serving the status of the last update to other tools
+ * the queries are answered from the cached status line and never sample the power supplies
+ */
+
+static gint                 socket_fd          = -1;
+static gchar               *socket_path        = NULL;
+static GPtrArray           *socket_clients     = NULL;
+static struct socket_status socket_status      = { 0, -1, -1, -1, FALSE, FALSE };
+static gchar               *socket_status_line = NULL;
+static guint64              socket_queries     = 0;
+
+static gboolean on_socket_accept (gint fd, GIOCondition condition, gpointer user_data);
+static gboolean on_socket_client (gint fd, GIOCondition condition, struct socket_client *client);
+static void handle_socket_command (struct socket_client *client, const gchar *command);
+static gboolean queue_socket_output (struct socket_client *client, const gchar *output);
+static gboolean flush_socket_client (struct socket_client *client);
+static void close_socket_client (struct socket_client *client);
+static void append_socket_status (GString *string, const struct socket_status *status, const struct socket_status *previous);
+
+/*
+ * socket functions
+ */
+
+gboolean create_socket_server (void)
+{
+    struct sockaddr_un address;
+    gchar *directory;
+    gint fd;
+
+    socket_path = g_build_filename (g_get_user_runtime_dir (), CBATTICON_STRING, SOCKET_FILE, NULL);
+
+    memset (&address, 0, sizeof (address));
+    address.sun_family = AF_UNIX;
+
+    if (strlen (socket_path) >= sizeof (address.sun_path)) {
+        g_printerr (_("Socket path is too long: %s\n"), socket_path);
+        return FALSE;
+    }
+
+    g_strlcpy (address.sun_path, socket_path, sizeof (address.sun_path));
+
+    directory = g_path_get_dirname (socket_path);
+    g_mkdir_with_parents (directory, 0700);
+    g_free (directory);
+
+    fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        g_printerr (_("Cannot create socket: %s\n"), g_strerror (errno));
+        return FALSE;
+    }
+
+    /* a socket left by a cbatticon that was killed is replaced, the one of a running cbatticon is not */
+
+    if (connect (fd, (struct sockaddr *)&address, sizeof (address)) == 0 || errno == EAGAIN) {
+        g_printerr (_("Socket is already served by another cbatticon: %s\n"), socket_path);
+        close (fd);
+        return FALSE;
+    }
+
+    close (fd);
+    unlink (socket_path);
+
+    fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0 || bind (fd, (struct sockaddr *)&address, sizeof (address)) < 0 || listen (fd, SOMAXCONN) < 0) {
+        g_printerr (_("Cannot listen on socket: %s (%s)\n"), socket_path, g_strerror (errno));
+
+        if (fd >= 0) {
+            close (fd);
+        }
+
+        return FALSE;
+    }
+
+    socket_fd      = fd;
+    socket_clients = g_ptr_array_new ();
+
+    g_unix_fd_add (socket_fd, G_IO_IN, on_socket_accept, NULL);
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("socket: listening on %s\n", socket_path);
+    }
+
+    return TRUE;
+}
+
+static gboolean on_socket_accept (gint fd, GIOCondition condition, gpointer user_data)
+{
+    struct socket_client *client;
+    gint client_fd;
+
+    for (;;) {
+        client_fd = accept4 (fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+        if (client_fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        if (socket_clients->len >= SOCKET_MAX_CLIENTS) {
+            if (configuration.debug_output == TRUE) {
+                g_printf ("socket: too many clients, connection refused\n");
+            }
+
+            close (client_fd);
+            continue;
+        }
+
+        client = g_new0 (struct socket_client, 1);
+        client->fd        = client_fd;
+        client->condition = G_IO_IN;
+        client->output    = g_string_sized_new (STR_LTH);
+        client->source    = g_unix_fd_add (client_fd, client->condition, (GUnixFDSourceFunc)on_socket_client, (gpointer)client);
+        g_ptr_array_add (socket_clients, client);
+
+        if (configuration.debug_output == TRUE) {
+            g_printf ("socket: client %d connected (%u clients)\n", client_fd, socket_clients->len);
+        }
+    }
+
+    return TRUE;
+}
+
+static gboolean on_socket_client (gint fd, GIOCondition condition, struct socket_client *client)
+{
+    gssize length;
+    gchar *line, *end;
+
+    if ((condition & G_IO_OUT) != 0 && flush_socket_client (client) == FALSE) {
+        return FALSE;
+    }
+
+    if ((condition & (G_IO_IN | G_IO_HUP | G_IO_ERR)) == 0) {
+        return TRUE;
+    }
+
+    length = recv (fd, client->input + client->input_length, SOCKET_INPUT_LTH - 1 - client->input_length, 0);
+
+    if (length < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return TRUE;
+    }
+
+    if (length <= 0) {
+        close_socket_client (client);
+        return FALSE;
+    }
+
+    client->input_length += length;
+    client->input[client->input_length] = '\0';
+
+    /* one command per line, a line longer than the input buffer closes the connection */
+
+    for (line = client->input; (end = strchr (line, '\n')) != NULL; line = end + 1) {
+        *end = '\0';
+        g_strchomp (line);
+
+        handle_socket_command (client, line);
+
+        if (client->fd < 0) {
+            close_socket_client (client);
+            return FALSE;
+        }
+    }
+
+    client->input_length -= line - client->input;
+    memmove (client->input, line, client->input_length);
+
+    if (client->input_length == SOCKET_INPUT_LTH - 1) {
+        close_socket_client (client);
+        return FALSE;
+    }
+
+    if (flush_socket_client (client) == FALSE) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void handle_socket_command (struct socket_client *client, const gchar *command)
+{
+    gboolean queued = TRUE;
+
+    socket_queries++;
+
+    /*
+     * status: the status of the last update, as one JSON object per line
+     * subscribe: the status, then the fields that changed each time the status changes
+     * unsubscribe: no more changes
+     */
+
+    if (g_strcmp0 (command, "status") == 0) {
+        queued = queue_socket_output (client, socket_status_line);
+    } else if (g_strcmp0 (command, "subscribe") == 0) {
+        client->subscribed = TRUE;
+        client->stale      = FALSE;
+        client->sent       = socket_status;
+        queued = queue_socket_output (client, socket_status_line);
+    } else if (g_strcmp0 (command, "unsubscribe") == 0) {
+        client->subscribed = FALSE;
+    } else if (*command != '\0') {
+        queued = queue_socket_output (client, "{\"error\":\"unknown command\"}\n");
+    }
+
+    /* the caller closes the connection of a client that does not read its answers */
+
+    if (queued == FALSE) {
+        close (client->fd);
+        client->fd = -1;
+    }
+}
+
+static gboolean queue_socket_output (struct socket_client *client, const gchar *output)
+{
+    if (output == NULL) {
+        return TRUE;
+    }
+
+    if (client->output->len + strlen (output) > SOCKET_OUTPUT_LTH) {
+        if (configuration.debug_output == TRUE) {
+            g_printf ("socket: client %d does not read, disconnected\n", client->fd);
+        }
+
+        return FALSE;
+    }
+
+    g_string_append (client->output, output);
+
+    return TRUE;
+}
+
+static gboolean flush_socket_client (struct socket_client *client)
+{
+    GIOCondition condition;
+    gssize length;
+
+    /* the output is sent as far as the socket accepts it, the rest waits for G_IO_OUT */
+
+    while (client->output->len > 0) {
+        length = send (client->fd, client->output->str, client->output->len, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (length < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                break;
+            }
+
+            close_socket_client (client);
+            return FALSE;
+        }
+
+        g_string_erase (client->output, 0, length);
+    }
+
+    /* a subscriber whose output was pending gets the changes it missed at once */
+
+    if (client->output->len == 0 && client->stale == TRUE) {
+        GString *delta = g_string_new (NULL);
+
+        client->stale = FALSE;
+        append_socket_status (delta, &socket_status, &client->sent);
+        client->sent = socket_status;
+
+        g_string_append (client->output, delta->str);
+        g_string_free (delta, TRUE);
+
+        return flush_socket_client (client);
+    }
+
+    condition = client->output->len > 0 ? G_IO_IN | G_IO_OUT : G_IO_IN;
+
+    if (condition != client->condition) {
+        g_source_remove (client->source);
+        client->condition = condition;
+        client->source    = g_unix_fd_add (client->fd, condition, (GUnixFDSourceFunc)on_socket_client, (gpointer)client);
+    }
+
+    return TRUE;
+}
+
+static void close_socket_client (struct socket_client *client)
+{
+    if (configuration.debug_output == TRUE) {
+        g_printf ("socket: client %d disconnected (%u clients)\n", client->fd, socket_clients->len - 1);
+    }
+
+    g_source_remove (client->source);
+
+    if (client->fd >= 0) {
+        close (client->fd);
+    }
+
+    g_ptr_array_remove_fast (socket_clients, client);
+    g_string_free (client->output, TRUE);
+    g_free (client);
+}
+
+void publish_socket_status (gint state, gint percentage, gint time)
+{
+    struct socket_status status;
+    GString *line;
+    guint i;
+
+    if (socket_fd < 0) {
+        return;
+    }
+
+    status.serial     = socket_status.serial;
+    status.status     = state;
+    status.percentage = percentage;
+    status.time       = time;
+    status.low        = (state == DISCHARGING || state == NOTCHARGING) && percentage <= configuration.low_level;
+    status.critical   = (state == DISCHARGING || state == NOTCHARGING) && percentage <= configuration.critical_level;
+
+    /* the status line is only formatted when the status changes, every query reuses it */
+
+    if (socket_status_line != NULL && memcmp (&status, &socket_status, sizeof (status)) == 0) {
+        return;
+    }
+
+    status.serial++;
+
+    line = g_string_new (NULL);
+    append_socket_status (line, &status, NULL);
+
+    g_free (socket_status_line);
+    socket_status_line = g_string_free (line, FALSE);
+
+    /* the subscribers get the fields that changed since the last status they were sent */
+
+    for (i = socket_clients->len; i > 0; i--) {
+        struct socket_client *client = g_ptr_array_index (socket_clients, i - 1);
+        GString *delta;
+
+        if (client->subscribed == FALSE) {
+            continue;
+        }
+
+        if (client->output->len > 0) {
+            client->stale = TRUE;
+            continue;
+        }
+
+        delta = g_string_new (NULL);
+        append_socket_status (delta, &status, &client->sent);
+        client->sent = status;
+
+        queue_socket_output (client, delta->str);
+        g_string_free (delta, TRUE);
+
+        flush_socket_client (client);
+    }
+
+    socket_status = status;
+}
+
+static void append_socket_status (GString *string, const struct socket_status *status, const struct socket_status *previous)
+{
+    g_string_append_printf (string, "{\"serial\":%u", status->serial);
+
+    if (previous == NULL || status->status != previous->status) {
+        g_string_append_printf (string, ",\"state\":\"%s\"", get_state_string (status->status));
+    }
+
+    if (previous == NULL || status->percentage != previous->percentage) {
+        if (status->percentage >= 0)
+            g_string_append_printf (string, ",\"percentage\":%d", status->percentage);
+        else
+            g_string_append (string, ",\"percentage\":null");
+    }
+
+    if (previous == NULL || status->time != previous->time) {
+        if (status->time >= 0)
+            g_string_append_printf (string, ",\"time\":%d", status->time);
+        else
+            g_string_append (string, ",\"time\":null");
+    }
+
+    if (previous == NULL || status->low != previous->low) {
+        g_string_append_printf (string, ",\"low\":%s", status->low == TRUE ? "true" : "false");
+    }
+
+    if (previous == NULL || status->critical != previous->critical) {
+        g_string_append_printf (string, ",\"critical\":%s", status->critical == TRUE ? "true" : "false");
+    }
+
+    g_string_append (string, "}\n");
+}
+
+void close_socket_server (void)
+{
+    if (socket_fd >= 0) {
+        unlink (socket_path);
+    }
+}
+
+void append_socket_stats (GString *report)
+{
+    if (socket_fd >= 0) {
+        g_string_append_printf (report, "stats: %" G_GUINT64_FORMAT " socket queries, %u clients\n", socket_queries, socket_clients->len);
+    }
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2011-2013 Colin Jones
+ * Copyright (C) 2014-2023 Valère Monseur
+ *
+ * Based on code by Matteo Marchesotti
+ * Copyright (C) 2007 Matteo Marchesotti <matteo.marchesotti@fsfe.org>
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * local socket (--socket), $XDG_RUNTIME_DIR/cbatticon/socket, serving the status of the last update to other tools
+ */
+
+#ifndef CBATTICON_SOCKET_H
+#define CBATTICON_SOCKET_H
+
+gboolean create_socket_server (void);
+void publish_socket_status (gint state, gint percentage, gint time);
+void close_socket_server (void);
+void append_socket_stats (GString *report);
+
+#endif
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2011-2013 Colin Jones
+ * Copyright (C) 2014-2023 Valère Monseur
+ *
+ * Based on code by Matteo Marchesotti
+ * Copyright (C) 2007 Matteo Marchesotti <matteo.marchesotti@fsfe.org>
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cbatticon.h"
+#include "cbatticon-shm-writer.h"
+#include "cbatticon-socket.h"
+#include "cbatticon-stats.h"
+
+#include <glib-unix.h>
+
+#include <malloc.h>
+#include <signal.h>
+
+static const gchar *stats_histogram_names[STATS_HISTOGRAM_COUNT] = {
+    "sysfs read",
+    "theme load",
+    "notification",
+    "tick"
+};
+
+/*
+ * the main loop polls through poll_stats to count the wakeups and measure the stalls
+ */
+
+static GPollFunc stats_poll_func = NULL;
+
+static gint poll_stats (GPollFD *fds, guint nfds, gint timeout);
+static gboolean on_stats_signal (gpointer user_data);
+
+/*
+ * stats functions
+ */
+
+void add_stats_latency (gint histogram, gint64 start)
+{
+    add_stats_histogram_latency (&stats.histograms[histogram], get_stats_time () - start);
+}
+
+void add_stats_histogram_latency (struct stats_histogram *histogram, guint64 latency)
+{
+    gint bucket;
+
+    latency = MAX (latency, 1);
+
+    /* bucket i holds the latencies in [2^i, 2^(i+1)) nanoseconds */
+
+    bucket = latency >= (G_GUINT64_CONSTANT (1) << (STATS_BUCKETS - 1)) ? STATS_BUCKETS - 1 : (gint)g_bit_storage ((gulong)latency) - 1;
+
+    histogram->count++;
+    histogram->sum += latency;
+    histogram->max = MAX (histogram->max, latency);
+    histogram->buckets[bucket]++;
+}
+
+void add_stats_histogram (struct stats_histogram *histogram, const struct stats_histogram *other)
+{
+    gint bucket;
+
+    histogram->count += other->count;
+    histogram->sum   += other->sum;
+    histogram->max    = MAX (histogram->max, other->max);
+
+    for (bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+        histogram->buckets[bucket] += other->buckets[bucket];
+    }
+}
+
+void create_stats_monitor (void)
+{
+    stats_poll_func = g_main_context_get_poll_func (NULL);
+    g_main_context_set_poll_func (NULL, poll_stats);
+
+    g_unix_signal_add (SIGUSR1, on_stats_signal, NULL);
+}
+
+static gint poll_stats (GPollFD *fds, guint nfds, gint timeout)
+{
+    gint64 now = get_stats_time ();
+    gint ret;
+
+    /* the time between two polls is spent dispatching the sources, the main loop is stalled */
+
+    if (stats.poll_return != 0) {
+        stats.stall_max = MAX (stats.stall_max, now - stats.poll_return);
+    }
+
+    ret = stats_poll_func (fds, nfds, timeout);
+
+    stats.poll_return = get_stats_time ();
+
+    if (timeout != 0) {
+        stats.wakeups++;
+    }
+
+    return ret;
+}
+
+void dump_stats (void)
+{
+    GString *report = g_string_new (NULL);
+    gint histogram, bucket;
+
+    g_string_append_printf (report, "stats: uptime %.1f s\n", (g_get_monotonic_time () - startup_time) / (gdouble)G_USEC_PER_SEC);
+    g_string_append_printf (report, "stats: %" G_GUINT64_FORMAT " ticks, %" G_GUINT64_FORMAT " wakeups\n", stats.ticks, stats.wakeups);
+    g_string_append_printf (report, "stats: %" G_GUINT64_FORMAT " files opened, %" G_GUINT64_FORMAT " bytes read\n", stats.files_opened, stats.bytes_read);
+    g_string_append_printf (report, "stats: %" G_GUINT64_FORMAT " resumes from suspend\n", stats.suspends);
+
+#ifdef WITH_SOCKET
+    append_socket_stats (report);
+#endif
+
+#ifdef WITH_SHM
+    append_shm_stats (report);
+#endif
+
+    append_update_stats (report);
+
+    g_string_append (report, "stats: longest main loop stall ");
+    append_stats_latency (report, stats.stall_max);
+    g_string_append_c (report, '\n');
+
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ (2, 33)
+    {
+        struct mallinfo2 heap = mallinfo2 ();
+
+        g_string_append_printf (report, "stats: heap %" G_GSIZE_FORMAT " bytes in use, %" G_GSIZE_FORMAT " bytes mapped\n",
+            (gsize)(heap.uordblks + heap.hblkhd), (gsize)(heap.arena + heap.hblkhd));
+    }
+#endif
+#endif
+
+    for (histogram = 0; histogram < STATS_HISTOGRAM_COUNT; histogram++) {
+        struct stats_histogram *stats_histogram = &stats.histograms[histogram];
+
+        if (stats_histogram->count == 0) {
+            continue;
+        }
+
+        g_string_append_printf (report, "stats: %s: %" G_GUINT64_FORMAT " samples, mean ", stats_histogram_names[histogram], stats_histogram->count);
+        append_stats_latency (report, stats_histogram->sum / stats_histogram->count);
+        g_string_append (report, ", max ");
+        append_stats_latency (report, stats_histogram->max);
+        g_string_append_c (report, '\n');
+
+        for (bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+            if (stats_histogram->buckets[bucket] == 0) {
+                continue;
+            }
+
+            g_string_append (report, "stats:   < ");
+            append_stats_latency (report, G_GUINT64_CONSTANT (1) << (bucket + 1));
+            g_string_append_printf (report, ": %" G_GUINT64_FORMAT "\n", stats_histogram->buckets[bucket]);
+        }
+    }
+
+    /* headless, the standard output belongs to the status bar */
+
+    if (configuration.headless == TRUE) {
+        g_printerr ("%s", report->str);
+    } else {
+        g_printf ("%s", report->str);
+    }
+
+    g_string_free (report, TRUE);
+}
+
+static gboolean on_stats_signal (gpointer user_data)
+{
+    dump_stats ();
+
+    return TRUE;
+}
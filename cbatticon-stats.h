@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2011-2013 Colin Jones
+ * Copyright (C) 2014-2023 Valère Monseur
+ *
+ * Based on code by Matteo Marchesotti
+ * Copyright (C) 2007 Matteo Marchesotti <matteo.marchesotti@fsfe.org>
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * runtime statistics (--stats), latency histograms and main loop stalls, dumped on SIGUSR1 and at exit
+ */
+
+#ifndef CBATTICON_STATS_H
+#define CBATTICON_STATS_H
+
+#ifdef WITH_STATS
+#define start_stats_latency() get_stats_time ()
+
+void add_stats_latency (gint histogram, gint64 start);
+void add_stats_histogram_latency (struct stats_histogram *histogram, guint64 latency);
+void add_stats_histogram (struct stats_histogram *histogram, const struct stats_histogram *other);
+void create_stats_monitor (void);
+void dump_stats (void);
+
+/*
+ * functions of cbatticon.c called by the statistics
+ */
+
+void append_update_stats (GString *report);
+#else
+/*
+ * built without the statistics, the latencies are neither measured nor recorded
+ */
+
+#define start_stats_latency()                           G_GINT64_CONSTANT (0)
+#define add_stats_latency(histogram, start)             ((void)(start))
+#define add_stats_histogram_latency(histogram, latency) ((void)(latency))
+#define add_stats_histogram(histogram, other)           ((void)(other))
+#endif
+
+#endif
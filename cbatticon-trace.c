@@ -0,0 +1,620 @@
+/*
+ * Copyright (C) 2011-2013 Colin Jones
+ * Copyright (C) 2014-2023 Valère Monseur
+ *
+ * Based on code by Matteo Marchesotti
+ * Copyright (C) 2007 Matteo Marchesotti <matteo.marchesotti@fsfe.org>
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cbatticon.h"
+#include "cbatticon-trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define TRACE_MAGIC        "CBATRACE"
+#define TRACE_VERSION      1
+#define TRACE_MATCH_WINDOW 1000000 /* microseconds, a recorded update this close to a replayed timer is the one it fired */
+
+#define TRACE_TICK_UEVENTS         (1 << 0) /* the power supplies were monitored by uevents */
+#define TRACE_TICK_BATTERY_CHANGES (1 << 1) /* the battery driver emitted change events */
+#define TRACE_TICK_STALE           (1 << 2) /* the update rendered a stale sample of the sampler thread */
+
+static const gchar *trace_scan_attribute_names[TRACE_ATTRIBUTE_COUNT - SYSATTR_UEVENT] = {
+    "type",
+    "scope",
+    "model_name"
+};
+
+struct trace_supply {
+    gchar *name;
+    gchar *values[TRACE_ATTRIBUTE_COUNT]; /* last recorded or replayed value, NULL when not available */
+    guint  mask;                          /* attributes with a value in the trace */
+};
+
+struct replay_timer {
+    guint       id;
+    gint64      deadline; /* virtual time */
+    gint64      interval; /* microseconds */
+    GSourceFunc function;
+    gpointer    data;
+};
+
+/*
+ * trace of the raw attribute reads, recorded by --record and replayed by --replay
+ * the trace holds the ticks and the values that changed, the replay serves every read from it
+ * and runs the timers of the updates, grace periods and devices on a virtual clock
+ */
+
+static GPtrArray *trace_supplies = NULL;
+gint              trace_fd       = -1;
+GString          *trace_buffer   = NULL;
+static gint64     trace_time     = 0;
+
+gchar            *replay_data                   = NULL;
+static gsize      replay_length                 = 0;
+static gsize      replay_position               = 0;
+static gint64     replay_clock                  = 0;  /* virtual monotonic time */
+static gint64     replay_start                  = 0;
+static gint64     replay_next_tick              = -1; /* time of the next recorded update, -1 at the end of the trace */
+static gint64     replay_suspend_offset         = -1;
+static guint      replay_flags                  = 0;
+static gint64     replay_tick_offset            = -1; /* suspend offset and event sources of the next recorded update */
+static guint      replay_tick_flags             = 0;
+static guint      replay_ticks                  = 0;
+static GArray    *replay_scan                   = NULL;
+static gboolean   replay_power_supplies_changed = FALSE;
+static GPtrArray *replay_timers                 = NULL;
+static guint      replay_timer_id               = 0;
+static guint      replay_firing                 = 0;  /* timer being run, 0 once it removed itself */
+
+static gboolean get_replay_varint (guint64 *value);
+static gboolean apply_replay_record (void);
+
+/*
+ * trace functions
+ */
+
+gint64 get_monotonic_time (void)
+{
+    /* the replay runs on the virtual clock of the trace */
+
+    if (replay_data != NULL) {
+        return replay_clock;
+    }
+
+    return g_get_monotonic_time ();
+}
+
+guint add_timeout (guint interval, GSourceFunc function, gpointer data)
+{
+    struct replay_timer *timer;
+
+    if (replay_data == NULL) {
+        return g_timeout_add (interval, function, data);
+    }
+
+    timer = g_new0 (struct replay_timer, 1);
+    timer->id       = ++replay_timer_id;
+    timer->interval = (gint64)interval * 1000;
+    timer->deadline = replay_clock + timer->interval;
+    timer->function = function;
+    timer->data     = data;
+    g_ptr_array_add (replay_timers, timer);
+
+    return timer->id;
+}
+
+guint add_timeout_seconds (guint interval, GSourceFunc function, gpointer data)
+{
+    if (replay_data == NULL) {
+        return g_timeout_add_seconds (interval, function, data);
+    }
+
+    return add_timeout (interval * 1000, function, data);
+}
+
+void remove_timeout (guint source)
+{
+    guint i;
+
+    if (replay_data == NULL) {
+        g_source_remove (source);
+        return;
+    }
+
+    if (source == replay_firing) {
+        replay_firing = 0;
+    }
+
+    for (i = 0; i < replay_timers->len; i++) {
+        if (((struct replay_timer *)g_ptr_array_index (replay_timers, i))->id == source) {
+            g_ptr_array_remove_index_fast (replay_timers, i);
+            return;
+        }
+    }
+}
+
+gint get_trace_supply (const gchar *path)
+{
+    struct trace_supply *supply;
+    gchar *name;
+    guint i;
+
+    /* the power supplies are identified by their name, the trace does not depend on the sysfs root */
+
+    name = g_path_get_basename (path);
+
+    for (i = 0; i < trace_supplies->len; i++) {
+        if (g_strcmp0 (((struct trace_supply *)g_ptr_array_index (trace_supplies, i))->name, name) == 0) {
+            g_free (name);
+            return i;
+        }
+    }
+
+    if (replay_data != NULL) {
+        g_free (name);
+        return -1;
+    }
+
+    supply = g_new0 (struct trace_supply, 1);
+    supply->name = name;
+    g_ptr_array_add (trace_supplies, supply);
+
+    g_string_append_c (trace_buffer, TRACE_SUPPLY);
+    add_trace_varint (strlen (name));
+    g_string_append (trace_buffer, name);
+
+    return trace_supplies->len - 1;
+}
+
+gint get_trace_attribute (const gchar *attribute)
+{
+    gint i;
+
+    for (i = 0; i < SYSATTR_UEVENT; i++) {
+        if (g_strcmp0 (sysattr_names[i], attribute) == 0) {
+            return i;
+        }
+    }
+
+    for (i = SYSATTR_UEVENT; i < TRACE_ATTRIBUTE_COUNT; i++) {
+        if (g_strcmp0 (trace_scan_attribute_names[i - SYSATTR_UEVENT], attribute) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+gboolean open_trace (const gchar *path)
+{
+    trace_fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        g_printerr (_("Cannot create trace file: %s (%s)\n"), path, g_strerror (errno));
+        return FALSE;
+    }
+
+    trace_supplies = g_ptr_array_new ();
+    trace_buffer   = g_string_new (TRACE_MAGIC);
+    add_trace_varint (TRACE_VERSION);
+
+    return TRUE;
+}
+
+void add_trace_varint (guint64 value)
+{
+    /* seven bits per byte, the high bit is set on all the bytes but the last one */
+
+    while (value >= 0x80) {
+        g_string_append_c (trace_buffer, (gchar)((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+
+    g_string_append_c (trace_buffer, (gchar)value);
+}
+
+void add_trace_tick (gint64 suspend_offset, gboolean uevents, gboolean battery_changes, gboolean stale)
+{
+    gint64 now = g_get_monotonic_time ();
+    guint flags = 0;
+
+    if (uevents == TRUE) {
+        flags |= TRACE_TICK_UEVENTS;
+    }
+
+    if (battery_changes == TRUE) {
+        flags |= TRACE_TICK_BATTERY_CHANGES;
+    }
+
+    if (stale == TRUE) {
+        flags |= TRACE_TICK_STALE;
+    }
+
+    /* the time is a delta from the previous update, the suspend offset is -1 when it is unknown */
+
+    g_string_append_c (trace_buffer, TRACE_TICK);
+    add_trace_varint (now - trace_time);
+    add_trace_varint (suspend_offset + 1);
+    add_trace_varint (flags);
+
+    trace_time = now;
+}
+
+void add_trace_scan (GArray *supplies)
+{
+    guint i;
+
+    g_string_append_c (trace_buffer, TRACE_SCAN);
+    add_trace_varint (supplies->len);
+
+    for (i = 0; i < supplies->len; i++) {
+        add_trace_varint (g_array_index (supplies, gint, i));
+    }
+}
+
+void add_trace_value (gint supply, gint attribute, const gchar *value)
+{
+    struct trace_supply *trace_supply;
+
+    if (supply < 0 || attribute < 0 || attribute >= TRACE_ATTRIBUTE_COUNT) {
+        return;
+    }
+
+    /* only the changes are recorded, a value holds until the next one */
+
+    trace_supply = g_ptr_array_index (trace_supplies, supply);
+
+    if ((trace_supply->mask & (1 << attribute)) != 0 && g_strcmp0 (trace_supply->values[attribute], value) == 0) {
+        return;
+    }
+
+    g_free (trace_supply->values[attribute]);
+    trace_supply->values[attribute] = g_strdup (value);
+    trace_supply->mask |= 1 << attribute;
+
+    g_string_append_c (trace_buffer, TRACE_VALUE);
+    add_trace_varint (supply);
+    add_trace_varint (attribute);
+    add_trace_varint (value != NULL ? strlen (value) + 1 : 0);
+
+    if (value != NULL) {
+        g_string_append (trace_buffer, value);
+    }
+}
+
+void flush_trace (void)
+{
+    gsize written = 0;
+    gssize length;
+
+    /* the records are written once per update */
+
+    while (written < trace_buffer->len) {
+        length = write (trace_fd, trace_buffer->str + written, trace_buffer->len - written);
+
+        if (length < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (length < 0) {
+            g_printerr (_("Cannot write trace file: %s\n"), g_strerror (errno));
+
+            close (trace_fd);
+            trace_fd = -1;
+            break;
+        }
+
+        written += length;
+    }
+
+    g_string_truncate (trace_buffer, 0);
+}
+
+gboolean open_replay (const gchar *path)
+{
+    GError *error = NULL;
+    guint64 version;
+
+    if (g_file_get_contents (path, &replay_data, &replay_length, &error) == FALSE) {
+        g_printerr (_("Cannot read trace file: %s\n"), error->message);
+        g_error_free (error); error = NULL;
+
+        return FALSE;
+    }
+
+    replay_position = strlen (TRACE_MAGIC);
+
+    if (replay_length < replay_position || memcmp (replay_data, TRACE_MAGIC, replay_position) != 0 ||
+        get_replay_varint (&version) == FALSE || version != TRACE_VERSION) {
+        g_printerr (_("Invalid trace file: %s\n"), path);
+        g_free (replay_data); replay_data = NULL;
+
+        return FALSE;
+    }
+
+    trace_supplies = g_ptr_array_new ();
+    replay_timers  = g_ptr_array_new_with_free_func (g_free);
+
+    /* the records of the startup, up to the first update which starts the virtual clock */
+
+    while (apply_replay_record () == TRUE);
+
+    replay_clock          = MAX (replay_next_tick, 0);
+    replay_start          = replay_clock;
+    replay_suspend_offset = replay_tick_offset;
+
+    return TRUE;
+}
+
+static gboolean get_replay_varint (guint64 *value)
+{
+    guint shift;
+    guchar byte;
+
+    *value = 0;
+
+    for (shift = 0; shift < 64 && replay_position < replay_length; shift += 7) {
+        byte = (guchar)replay_data[replay_position++];
+        *value |= (guint64)(byte & 0x7f) << shift;
+
+        if ((byte & 0x80) == 0) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static gboolean apply_replay_record (void)
+{
+    struct trace_supply *supply;
+    guint64 a, b, c, i;
+    gint id;
+
+    if (replay_position >= replay_length) {
+        replay_next_tick = -1;
+        return FALSE;
+    }
+
+    /* TRUE for a record that was applied, FALSE at the next update or at the end of the trace */
+
+    switch (replay_data[replay_position++]) {
+        case TRACE_TICK:
+            if (get_replay_varint (&a) == FALSE || get_replay_varint (&b) == FALSE || get_replay_varint (&c) == FALSE) {
+                break;
+            }
+
+            trace_time        += a;
+            replay_next_tick   = trace_time;
+            replay_tick_offset = (gint64)b - 1;
+            replay_tick_flags  = (guint)c;
+            return FALSE;
+
+        case TRACE_SUPPLY:
+            if (get_replay_varint (&a) == FALSE || a > replay_length - replay_position) {
+                break;
+            }
+
+            supply = g_new0 (struct trace_supply, 1);
+            supply->name = g_strndup (replay_data + replay_position, a);
+            g_ptr_array_add (trace_supplies, supply);
+
+            replay_position += a;
+            return TRUE;
+
+        case TRACE_SCAN:
+            if (get_replay_varint (&a) == FALSE) {
+                break;
+            }
+
+            if (replay_scan == NULL) {
+                replay_scan = g_array_new (FALSE, FALSE, sizeof (gint));
+            } else {
+                g_array_set_size (replay_scan, 0);
+            }
+
+            for (i = 0; i < a && get_replay_varint (&b) == TRUE && b < trace_supplies->len; i++) {
+                id = (gint)b;
+                g_array_append_val (replay_scan, id);
+            }
+
+            if (i < a) {
+                break;
+            }
+
+            replay_power_supplies_changed = TRUE;
+            return TRUE;
+
+        case TRACE_VALUE:
+            if (get_replay_varint (&a) == FALSE || a >= trace_supplies->len ||
+                get_replay_varint (&b) == FALSE || b >= TRACE_ATTRIBUTE_COUNT ||
+                get_replay_varint (&c) == FALSE || c > replay_length - replay_position + 1) {
+                break;
+            }
+
+            supply = g_ptr_array_index (trace_supplies, a);
+            g_free (supply->values[b]);
+            supply->values[b] = c > 0 ? g_strndup (replay_data + replay_position, c - 1) : NULL;
+            supply->mask |= 1 << b;
+
+            replay_position += c > 0 ? c - 1 : 0;
+            return TRUE;
+    }
+
+    /* an unknown or truncated record, such as the last one of a recording that was killed */
+
+    g_printerr (_("Invalid trace record at offset %lu, replay stopped\n"), (gulong)replay_position);
+
+    replay_position  = replay_length;
+    replay_next_tick = -1;
+
+    return FALSE;
+}
+
+void apply_replay_ticks (gboolean *battery_changes, gboolean *stale)
+{
+    /* the recorded updates up to the virtual time, a timer matches the update it fired up to the window after it */
+
+    while (replay_next_tick >= 0 && replay_next_tick <= replay_clock + TRACE_MATCH_WINDOW) {
+        replay_clock           = MAX (replay_clock, replay_next_tick);
+        replay_suspend_offset  = replay_tick_offset;
+        replay_flags           = replay_tick_flags;
+        *battery_changes       = (replay_flags & TRACE_TICK_BATTERY_CHANGES) != 0;
+        *stale                 = (replay_flags & TRACE_TICK_STALE) != 0;
+        replay_ticks++;
+
+        while (apply_replay_record () == TRUE);
+    }
+}
+
+gboolean get_replay_value (gint supply, gint attribute, gchar *value, gsize size)
+{
+    struct trace_supply *trace_supply;
+
+    if (supply < 0 || supply >= trace_supplies->len || attribute < 0 || attribute >= TRACE_ATTRIBUTE_COUNT) {
+        return FALSE;
+    }
+
+    trace_supply = g_ptr_array_index (trace_supplies, supply);
+
+    if (trace_supply->values[attribute] == NULL) {
+        return FALSE;
+    }
+
+    g_strlcpy (value, trace_supply->values[attribute], size);
+
+    return TRUE;
+}
+
+gboolean get_replay_power_supplies_changed (void)
+{
+    gboolean changed = replay_power_supplies_changed;
+
+    replay_power_supplies_changed = FALSE;
+
+    return changed;
+}
+
+const gchar* get_replay_scan_supply (guint index)
+{
+    /* the power supplies of the last scan of the trace */
+
+    if (replay_scan == NULL || index >= replay_scan->len) {
+        return NULL;
+    }
+
+    return ((struct trace_supply *)g_ptr_array_index (trace_supplies, g_array_index (replay_scan, gint, index)))->name;
+}
+
+gint64 get_replay_suspend_offset (void)
+{
+    return replay_suspend_offset;
+}
+
+gboolean get_replay_uevents (void)
+{
+    return (replay_flags & TRACE_TICK_UEVENTS) != 0;
+}
+
+void log_replay_event (const gchar *message)
+{
+    gint64 elapsed = (replay_clock - replay_start) / 1000;
+
+    /* the events are written with their virtual time to the standard output */
+
+    g_print ("%3" G_GINT64_FORMAT ":%02d:%02d.%03d %s\n", elapsed / 3600000, (gint)(elapsed / 60000 % 60),
+        (gint)(elapsed / 1000 % 60), (gint)(elapsed % 1000), message);
+}
+
+void log_replay_update (gint status, gint percentage, gint time)
+{
+    static gint last_status = -2, last_percentage = -2, last_time = -2;
+
+    /* the status, percentage and time of the tray icon, when one of them changes */
+
+    if (status == last_status && percentage == last_percentage && time == last_time) {
+        return;
+    }
+
+    last_status     = status;
+    last_percentage = percentage;
+    last_time       = time;
+
+    if (time >= 0) {
+        log_event (LOG_INFO, "%s %d%% %d:%02d", get_state_string (status), percentage, time / 60, time % 60);
+    } else {
+        log_event (LOG_INFO, "%s %d%%", get_state_string (status), percentage);
+    }
+}
+
+void run_replay (GSourceFunc update, gpointer data)
+{
+    struct replay_timer *timer;
+    gint64 start = get_stats_time ();
+    guint i;
+
+    while (replay_next_tick >= 0) {
+        timer = NULL;
+
+        for (i = 0; i < replay_timers->len; i++) {
+            struct replay_timer *candidate = g_ptr_array_index (replay_timers, i);
+
+            if (timer == NULL || candidate->deadline < timer->deadline ||
+                (candidate->deadline == timer->deadline && candidate->id < timer->id)) {
+                timer = candidate;
+            }
+        }
+
+        /* an update recorded before the next timer was triggered by an event: uevent, resume... */
+
+        if (timer == NULL || replay_next_tick < timer->deadline) {
+            replay_clock = MAX (replay_clock, replay_next_tick);
+            update (data);
+            continue;
+        }
+
+        /* the timer may remove itself or add other timers, it is kept as long as it returns TRUE */
+
+        replay_clock  = MAX (replay_clock, timer->deadline);
+        replay_firing = timer->id;
+
+        if (timer->function (timer->data) == TRUE && replay_firing != 0) {
+            timer->deadline = replay_clock + timer->interval;
+        } else if (replay_firing != 0) {
+            remove_timeout (replay_firing);
+        }
+
+        replay_firing = 0;
+    }
+
+    g_printerr ("replay: %u recorded updates, %" G_GUINT64_FORMAT " updates, %.2f hours replayed in %.3f ms\n",
+        replay_ticks, stats.ticks, (replay_clock - replay_start) / 3600e6, (get_stats_time () - start) / 1e6);
+}
+
+void close_trace (void)
+{
+    if (trace_fd >= 0) {
+        flush_trace ();
+        close (trace_fd);
+        trace_fd = -1;
+    }
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2011-2013 Colin Jones
+ * Copyright (C) 2014-2023 Valère Monseur
+ *
+ * Based on code by Matteo Marchesotti
+ * Copyright (C) 2007 Matteo Marchesotti <matteo.marchesotti@fsfe.org>
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * trace of the attribute reads (--record) and its replay on a virtual clock (--replay)
+ */
+
+#ifndef CBATTICON_TRACE_H
+#define CBATTICON_TRACE_H
+
+/* attributes of the trace: the sysattrs, then the attributes read once by the scan of the power supplies */
+
+enum {
+    TRACE_ATTRIBUTE_TYPE = SYSATTR_UEVENT,
+    TRACE_ATTRIBUTE_SCOPE,
+    TRACE_ATTRIBUTE_MODEL_NAME,
+    TRACE_ATTRIBUTE_COUNT
+};
+
+/* records of the trace, also written by the benchmark */
+
+enum {
+    TRACE_TICK = 1, /* start of an update: time, suspend offset and event sources */
+    TRACE_SUPPLY,   /* next power supply id: its name */
+    TRACE_SCAN,     /* power supplies listed by a scan: their ids */
+    TRACE_VALUE     /* attribute of a power supply that changed: its value, or not available */
+};
+
+#ifdef WITH_TRACE
+extern gint     trace_fd;     /* -1 when not recording */
+extern GString *trace_buffer; /* records of the current update */
+extern gchar   *replay_data;  /* NULL when not replaying */
+
+gint64 get_monotonic_time (void);
+guint add_timeout (guint interval, GSourceFunc function, gpointer data);
+guint add_timeout_seconds (guint interval, GSourceFunc function, gpointer data);
+void remove_timeout (guint source);
+
+gint get_trace_supply (const gchar *path);
+gint get_trace_attribute (const gchar *attribute);
+gboolean open_trace (const gchar *path);
+void add_trace_varint (guint64 value);
+void add_trace_tick (gint64 suspend_offset, gboolean uevents, gboolean battery_changes, gboolean stale);
+void add_trace_scan (GArray *supplies);
+void add_trace_value (gint supply, gint attribute, const gchar *value);
+void flush_trace (void);
+void close_trace (void);
+
+gboolean open_replay (const gchar *path);
+void apply_replay_ticks (gboolean *battery_changes, gboolean *stale);
+gboolean get_replay_value (gint supply, gint attribute, gchar *value, gsize size);
+gboolean get_replay_power_supplies_changed (void);
+const gchar* get_replay_scan_supply (guint index);
+gint64 get_replay_suspend_offset (void);
+gboolean get_replay_uevents (void);
+void log_replay_event (const gchar *message);
+void log_replay_update (gint status, gint percentage, gint time);
+void run_replay (GSourceFunc update, gpointer data);
+#else
+/* built without the trace, cbatticon never replays and its timers run on the clock of the main loop */
+
+#define replay_data         NULL
+#define get_monotonic_time  g_get_monotonic_time
+#define add_timeout         g_timeout_add
+#define add_timeout_seconds g_timeout_add_seconds
+#define remove_timeout      g_source_remove
+#endif
+
+#endif
@@ -0,0 +1,318 @@
+/*
+ * Copyright (C) 2011-2013 Colin Jones
+ * Copyright (C) 2014-2023 Valère Monseur
+ *
+ * Based on code by Matteo Marchesotti
+ * Copyright (C) 2007 Matteo Marchesotti <matteo.marchesotti@fsfe.org>
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cbatticon.h"
+#include "cbatticon-upower.h"
+
+#define UPOWER_NAME             "org.freedesktop.UPower"
+#define UPOWER_PATH             "/org/freedesktop/UPower"
+#define UPOWER_INTERFACE        "org.freedesktop.UPower"
+#define UPOWER_DEVICE_INTERFACE "org.freedesktop.UPower.Device"
+#define UPOWER_TYPE_LINE_POWER  1
+#define UPOWER_TYPE_BATTERY     2
+#define UPOWER_STATE_EMPTY      3
+
+static const gchar *upower_type_names[] = {
+    "Unknown", "Mains", "Battery", "UPS", "Monitor", "Mouse", "Keyboard", "PDA", "Phone", "Media player",
+    "Tablet", "Computer", "Gaming input", "Pen", "Touchpad", "Modem", "Network", "Headset", "Speakers",
+    "Headphones", "Video", "Audio", "Remote control", "Printer", "Scanner", "Camera", "Wearable", "Toy", "Bluetooth"
+};
+
+/*
+ * UPower backend, the power supplies are the UPower devices whose properties are cached by their proxy
+ * and kept up to date by the PropertiesChanged signals of upowerd, the same hardware is not polled twice
+ */
+
+static GDBusProxy *upower_proxy                  = NULL;
+static gboolean    upower_power_supplies_changed = TRUE;
+
+static void on_upower_signal (GDBusProxy *proxy, gchar *sender_name, gchar *signal_name, GVariant *parameters, gpointer user_data);
+static void on_upower_properties_changed (GDBusProxy *proxy, GVariant *changed_properties, GStrv invalidated_properties, gpointer user_data);
+static void on_upower_name_owner (GObject *object, GParamSpec *pspec, gpointer user_data);
+
+/*
+ * upower functions
+ */
+
+gboolean open_upower (void)
+{
+    GError *error = NULL;
+    gchar *name_owner;
+
+    if (upower_proxy == NULL) {
+        upower_proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SYSTEM,
+                                                      G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START | G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
+                                                      NULL,
+                                                      UPOWER_NAME,
+                                                      UPOWER_PATH,
+                                                      UPOWER_INTERFACE,
+                                                      NULL,
+                                                      &error);
+
+        if (upower_proxy == NULL) {
+            g_printerr (_("Cannot connect to UPower, falling back to sysfs: %s\n"), error->message);
+            g_error_free (error); error = NULL;
+
+            return FALSE;
+        }
+    }
+
+    /* upowerd is not started for cbatticon, it is only used when it already polls the hardware */
+
+    name_owner = g_dbus_proxy_get_name_owner (upower_proxy);
+    if (name_owner == NULL) {
+        g_printerr (_("UPower is not running, falling back to sysfs\n"));
+
+        return FALSE;
+    }
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("upower: using %s\n", name_owner);
+    }
+
+    g_free (name_owner);
+
+    return TRUE;
+}
+
+void get_upower_power_supplies (void)
+{
+    GError *error = NULL;
+
+    GVariant *devices, *property;
+    GVariantIter *iterator;
+    const gchar *object_path;
+    GDBusProxy *proxy;
+    guint32 type;
+    gboolean power_supply;
+
+    devices = g_dbus_proxy_call_sync (upower_proxy, "EnumerateDevices", NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+    if (devices == NULL) {
+        g_printerr (_("Cannot enumerate UPower devices: %s\n"), error->message);
+        g_error_free (error); error = NULL;
+        return;
+    }
+
+    g_variant_get (devices, "(ao)", &iterator);
+    while (g_variant_iter_next (iterator, "&o", &object_path) == TRUE) {
+        proxy = g_dbus_proxy_new_sync (g_dbus_proxy_get_connection (upower_proxy),
+                                       G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
+                                       NULL,
+                                       UPOWER_NAME,
+                                       object_path,
+                                       UPOWER_DEVICE_INTERFACE,
+                                       NULL,
+                                       &error);
+
+        if (proxy == NULL) {
+            if (configuration.debug_output == TRUE) {
+                g_printf ("upower: cannot get device %s (%s)\n", object_path, error->message);
+            }
+
+            g_error_free (error); error = NULL;
+            continue;
+        }
+
+        type = 0;
+        property = g_dbus_proxy_get_cached_property (proxy, "Type");
+        if (property != NULL) {
+            if (g_variant_is_of_type (property, G_VARIANT_TYPE_UINT32) == TRUE) {
+                type = g_variant_get_uint32 (property);
+            }
+            g_variant_unref (property);
+        }
+
+        /* like the scope of sysfs, a device powers the system unless upowerd tells otherwise */
+
+        power_supply = TRUE;
+        property = g_dbus_proxy_get_cached_property (proxy, "PowerSupply");
+        if (property != NULL) {
+            if (g_variant_is_of_type (property, G_VARIANT_TYPE_BOOLEAN) == TRUE) {
+                power_supply = g_variant_get_boolean (property);
+            }
+            g_variant_unref (property);
+        }
+
+        /* the batteries and adapters of the peripherals (mouse, keyboard, dock...) do not power the system */
+
+        g_signal_connect (G_OBJECT (proxy), "g-properties-changed", G_CALLBACK (on_upower_properties_changed), NULL);
+
+        if ((type == UPOWER_TYPE_LINE_POWER || type == UPOWER_TYPE_BATTERY) && power_supply == TRUE) {
+            add_upower_device (object_path, proxy, type == UPOWER_TYPE_BATTERY ? "Battery" : "Mains", NULL);
+        } else {
+            gchar *model = NULL;
+
+            property = g_dbus_proxy_get_cached_property (proxy, "Model");
+            if (property != NULL) {
+                if (g_variant_is_of_type (property, G_VARIANT_TYPE_STRING) == TRUE && *g_variant_get_string (property, NULL) != '\0') {
+                    model = g_variant_dup_string (property, NULL);
+                }
+                g_variant_unref (property);
+            }
+
+            if (model == NULL) {
+                model = g_path_get_basename (object_path);
+            }
+
+            add_upower_device (object_path, proxy, type < G_N_ELEMENTS (upower_type_names) ? upower_type_names[type] : "Device", model);
+            g_free (model);
+        }
+    }
+
+    g_variant_iter_free (iterator);
+    g_variant_unref (devices);
+}
+
+gboolean get_upower_sysattr (GDBusProxy *proxy, gint attribute, gchar *value, gsize size)
+{
+    static const gchar *property_names[SYSATTR_COUNT] = {
+        "IsPresent",  /* present */
+        "Online",     /* online */
+        "State",      /* status */
+        "EnergyFull", /* energy_full */
+        "Energy",     /* energy_now */
+        "EnergyRate", /* power_now */
+        NULL,         /* charge_full */
+        NULL,         /* charge_now */
+        NULL,         /* current_now */
+        "Percentage", /* capacity */
+        NULL          /* uevent */
+    };
+
+    /* UPower states: unknown, charging, discharging, empty, fully charged, pending charge, pending discharge,
+     * an empty battery is discharging at 0%, so the low and critical levels and their commands still apply */
+
+    static const gchar *status_names[] = {
+        "Unknown",
+        "Charging",
+        "Discharging",
+        "Discharging",
+        "Full",
+        "Not charging",
+        "Discharging"
+    };
+
+    GVariant *property;
+    gboolean ret = TRUE;
+
+    if (property_names[attribute] == NULL) {
+        return FALSE;
+    }
+
+    if (attribute == SYSATTR_ENERGY_NOW || attribute == SYSATTR_CAPACITY) {
+        property = g_dbus_proxy_get_cached_property (proxy, "State");
+
+        if (property != NULL && g_variant_is_of_type (property, G_VARIANT_TYPE_UINT32) == TRUE &&
+            g_variant_get_uint32 (property) == UPOWER_STATE_EMPTY) {
+            g_variant_unref (property);
+            g_strlcpy (value, "0", size);
+            return TRUE;
+        }
+
+        if (property != NULL) {
+            g_variant_unref (property);
+        }
+    }
+
+    property = g_dbus_proxy_get_cached_property (proxy, property_names[attribute]);
+    if (property == NULL) {
+        return FALSE;
+    }
+
+    /* the properties are translated to the sysfs values, in uWh and uW for the energies and the rate */
+
+    if (g_variant_is_of_type (property, G_VARIANT_TYPE_BOOLEAN) == TRUE) {
+        g_strlcpy (value, g_variant_get_boolean (property) == TRUE ? "1" : "0", size);
+    } else if (g_variant_is_of_type (property, G_VARIANT_TYPE_UINT32) == TRUE) {
+        guint32 state = g_variant_get_uint32 (property);
+        g_strlcpy (value, state < G_N_ELEMENTS (status_names) ? status_names[state] : "Unknown", size);
+    } else if (g_variant_is_of_type (property, G_VARIANT_TYPE_DOUBLE) == TRUE) {
+        gdouble double_value = g_variant_get_double (property);
+        g_snprintf (value, size, "%.0f", attribute == SYSATTR_CAPACITY ? double_value : double_value * 1000000.0);
+    } else {
+        ret = FALSE;
+    }
+
+    g_variant_unref (property);
+
+    return ret;
+}
+
+void create_upower_monitor (void)
+{
+    g_signal_connect (G_OBJECT (upower_proxy), "g-signal", G_CALLBACK (on_upower_signal), NULL);
+    g_signal_connect (G_OBJECT (upower_proxy), "notify::g-name-owner", G_CALLBACK (on_upower_name_owner), NULL);
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("upower: monitoring power supplies\n");
+    }
+}
+
+static void on_upower_signal (GDBusProxy *proxy, gchar *sender_name, gchar *signal_name, GVariant *parameters, gpointer user_data)
+{
+    if (g_strcmp0 (signal_name, "DeviceAdded") != 0 && g_strcmp0 (signal_name, "DeviceRemoved") != 0) {
+        return;
+    }
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("upower: %s\n", signal_name);
+    }
+
+    upower_power_supplies_changed = TRUE;
+    schedule_upower_update ();
+}
+
+static void on_upower_properties_changed (GDBusProxy *proxy, GVariant *changed_properties, GStrv invalidated_properties, gpointer user_data)
+{
+    const gchar *object_path = g_dbus_proxy_get_object_path (proxy);
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("upower: %s changed\n", object_path);
+    }
+
+    on_upower_device_changed (object_path);
+}
+
+static void on_upower_name_owner (GObject *object, GParamSpec *pspec, gpointer user_data)
+{
+    gchar *name_owner = g_dbus_proxy_get_name_owner (upower_proxy);
+
+    /* upowerd has stopped, the power supplies are read from sysfs from now on */
+
+    if (name_owner == NULL && configuration.backend == BACKEND_UPOWER) {
+        g_printerr (_("UPower has stopped, falling back to sysfs\n"));
+
+        on_upower_stopped ();
+    }
+
+    g_free (name_owner);
+}
+
+gboolean get_upower_power_supplies_changed (void)
+{
+    gboolean changed = upower_power_supplies_changed;
+
+    upower_power_supplies_changed = FALSE;
+
+    return changed;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2011-2013 Colin Jones
+ * Copyright (C) 2014-2023 Valère Monseur
+ *
+ * Based on code by Matteo Marchesotti
+ * Copyright (C) 2007 Matteo Marchesotti <matteo.marchesotti@fsfe.org>
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * UPower backend (--backend upower), the power supplies are the UPower devices
+ */
+
+#ifndef CBATTICON_UPOWER_H
+#define CBATTICON_UPOWER_H
+
+#include <gio/gio.h>
+
+gboolean open_upower (void);
+void get_upower_power_supplies (void);
+gboolean get_upower_sysattr (GDBusProxy *proxy, gint attribute, gchar *value, gsize size);
+void create_upower_monitor (void);
+gboolean get_upower_power_supplies_changed (void);
+
+/* functions of cbatticon.c called by the backend */
+
+void add_upower_device (const gchar *object_path, GDBusProxy *proxy, const gchar *type, const gchar *model);
+void on_upower_device_changed (const gchar *object_path);
+void on_upower_stopped (void);
+void schedule_upower_update (void);
+
+#endif
@@ -21,118 +21,463 @@
  * with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
-#define CBATTICON_VERSION_NUMBER 1.6.13
-#define CBATTICON_VERSION_STRING "1.6.13"
-#define CBATTICON_STRING         "cbatticon"
-
 #include <glib.h>
 #include <glib/gi18n.h>
 #include <glib/gprintf.h>
 #include <glib/gstdio.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
 #include <gtk/gtk.h>
 #ifdef WITH_NOTIFY
 #include <libnotify/notify.h>
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
 #include <libintl.h>
 #include <locale.h>
 #include <math.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <syslog.h>
-
-#define SYSFS_PATH "/sys/class/power_supply"
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <linux/netlink.h>
+
+#include "cbatticon.h"
+#include "cbatticon-history.h"
+#include "cbatticon-shm-writer.h"
+#include "cbatticon-socket.h"
+#include "cbatticon-stats.h"
+#include "cbatticon-trace.h"
+#include "cbatticon-upower.h"
+
+#define SYSFS_ROOT         "/sys"
+#define SYSFS_POWER_SUPPLY "class/power_supply"
+#define SYSFS_ROOT_ENV     "CBATTICON_SYSFS_ROOT"
+
+#define UEVENT_BUFFER_LTH      8192
+#define UEVENT_COALESCE_DELAY  20 /* milliseconds */
+#define UEVENT_FALLBACK_FACTOR 12 /* polling interval multiplier once uevents are seen */
 
 #define DEFAULT_UPDATE_INTERVAL 5
+#define DEFAULT_MIN_INTERVAL    1
+#define DEFAULT_MAX_INTERVAL    900
 #define DEFAULT_LOW_LEVEL       20
 #define DEFAULT_CRITICAL_LEVEL  5
+#define DEFAULT_DEVICE_LOW_LEVEL 10
+#define DEFAULT_SAMPLER_TIMEOUT 500 /* milliseconds an update waits for the sampler thread */
+
+#define SAMPLER_SUPPLIES 8     /* batteries and AC read by the sampler thread, the other batteries are read by the main loop */
+#define SAMPLER_SAMPLES  3     /* recycled samples: written by the thread, ready, read by the updates */
+#define SAMPLER_FRESH    0x100 /* flag of the ready sample index, set until the main loop adopts it */
+
+#define CACHE_TTL_MIN      60       /* seconds an attribute refreshed after a TTL is served from the cache */
+#define CACHE_TTL_MAX      600      /* seconds, the TTL doubles while the attribute does not change */
+#define CACHE_TTL_MAX_SLOW 3600     /* seconds, for an attribute whose reads are slow */
+#define CACHE_SLOW_READ    10000000 /* nanoseconds, mean read latency of a slow attribute */
+
+#define DEVICE_MIN_INTERVAL 60   /* seconds between two samples of a device that changes */
+#define DEVICE_MAX_INTERVAL 1800 /* seconds between two samples of a device that does not change */
+
+#define SCHEDULER_CHARGING_FACTOR 6 /* polling interval multiplier while charging */
+
+#define SUSPEND_GAP_MIN        2 /* seconds the boot time may run ahead of the monotonic time between two updates */
+#define SUSPEND_WATCHDOG_SLACK 2 /* seconds past the update deadline before the watchdog fires */
+
+#define ICON_TYPES_CACHE_FILE "icon-types"
+
+#define CONFIGURATION_FILE         "config"
+#define CONFIGURATION_GROUP        "cbatticon"
+#define CONFIGURATION_RELOAD_DELAY 200 /* milliseconds, an editor saving the file emits several events */
+
+#define ESTIMATOR_SAMPLES        32   /* samples in the regression window */
+#define ESTIMATOR_EWMA_PERIOD    120  /* seconds, time constant of the moving average */
+
+#define NOTIFY_TIMEOUT    5000 /* milliseconds the notification daemon has to answer, the notification in flight is then dropped */
+#define NOTIFY_RATE_LIMIT 1000 /* minimum milliseconds between two notifications of the same category */
+
+#define LOW_LEVEL_GRACE_PERIOD      5  /* seconds before spawning the low level command */
+#define CRITICAL_LEVEL_GRACE_PERIOD 30 /* seconds before spawning the critical level command */
+
+#define DEFAULT_OUTPUT_TEMPLATE "%s %p%% %t"
+
+#define STRING_TABLE_HOURS 48 /* the plural forms of the hours are cached up to this number of hours */
+
+#define ICON_NAME_LTH  48
+#define SYSATTR_LTH    64
+#define SYSUEVENT_LTH  4096
+
+enum {
+    ICON_STATE_MISSING = 0, /* missing or unknown */
+    ICON_STATE_DISCHARGING,
+    ICON_STATE_CHARGING,
+    ICON_STATE_CHARGED,
+    ICON_STATE_COUNT
+};
+
+/* upper bound of each percentage bucket of the icons */
+
+#define ICON_BUCKETS 5
+
+static const gint icon_bucket_levels[ICON_BUCKETS] = { 20, 40, 60, 80, 100 };
+
+/* every icon name of the string tables of an icon type, and the AC adapter icon (the notifications have no icon) */
+
+#define ICON_CACHE_SIZE (ICON_STATE_COUNT * ICON_BUCKETS + 1)
+
+const gchar *sysattr_names[SYSATTR_COUNT] = {
+    "present",
+    "online",
+    "status",
+    "energy_full",
+    "energy_now",
+    "power_now",
+    "charge_full",
+    "charge_now",
+    "current_now",
+    "capacity",
+    "uevent"
+};
 
-#define STR_LTH 256
+/* refresh of the attributes read from their files: every tick, on the uevents of the power supply, or after a TTL */
 
 enum {
-    UNKNOWN_ICON = 0,
-    BATTERY_ICON_STANDARD,
-    BATTERY_ICON_SYMBOLIC,
-    BATTERY_ICON_NOTIFICATION
+    CACHE_POLICY_TICK = 0,
+    CACHE_POLICY_EVENT, /* every tick without uevents */
+    CACHE_POLICY_TTL
+};
+
+static const gint sysattr_cache_policies[SYSATTR_COUNT] = {
+    CACHE_POLICY_EVENT, /* present */
+    CACHE_POLICY_EVENT, /* online */
+    CACHE_POLICY_TICK,  /* status */
+    CACHE_POLICY_TTL,   /* energy_full */
+    CACHE_POLICY_TICK,  /* energy_now */
+    CACHE_POLICY_TICK,  /* power_now */
+    CACHE_POLICY_TTL,   /* charge_full */
+    CACHE_POLICY_TICK,  /* charge_now */
+    CACHE_POLICY_TICK,  /* current_now */
+    CACHE_POLICY_TICK,  /* capacity */
+    CACHE_POLICY_TICK   /* uevent */
 };
 
+/* options that can also be set by the configuration file */
+
 enum {
-    MISSING = 0,
-    UNKNOWN,
-    CHARGED,
-    CHARGING,
-    DISCHARGING,
-    NOTCHARGING,
-    LOW_LEVEL,
-    CRITICAL_LEVEL
+    OPTION_UPDATE_INTERVAL        = 1 << 0,
+    OPTION_MIN_INTERVAL           = 1 << 1,
+    OPTION_MAX_INTERVAL           = 1 << 2,
+    OPTION_LOW_LEVEL              = 1 << 3,
+    OPTION_CRITICAL_LEVEL         = 1 << 4,
+    OPTION_COMMAND_LOW_LEVEL      = 1 << 5,
+    OPTION_COMMAND_CRITICAL_LEVEL = 1 << 6,
+    OPTION_COMMAND_LEFT_CLICK     = 1 << 7,
+    OPTION_HIDE_NOTIFICATION      = 1 << 8,
+    OPTION_ICON_TYPE              = 1 << 9,
+    OPTION_ESTIMATOR              = 1 << 10,
+    OPTION_DEVICE_LEVELS          = 1 << 11
 };
 
-struct configuration {
-    gboolean display_version;
-    gboolean debug_output;
-    gint     update_interval;
-    gint     icon_type;
-    gint     low_level;
-    gint     critical_level;
-    gchar   *command_low_level;
-    gchar   *command_critical_level;
-    gchar   *command_left_click;
-#ifdef WITH_NOTIFY
-    gboolean hide_notification;
-#endif
-    gboolean list_icon_types;
-    gboolean list_power_supplies;
-} configuration = {
-    FALSE,
-    FALSE,
-    DEFAULT_UPDATE_INTERVAL,
-    UNKNOWN_ICON,
-    DEFAULT_LOW_LEVEL,
-    DEFAULT_CRITICAL_LEVEL,
-    NULL,
-    NULL,
-#ifdef WITH_NOTIFY
-    FALSE,
+struct sysattr_cache {
+    guint  tick;    /* of the read, 0 when never read */
+    gint   epoch;   /* of the read, see sysattr_cache_epoch */
+    gint64 expiry;  /* monotonic time the TTL runs out */
+    gint64 ttl;     /* microseconds */
+    gint64 latency; /* moving average of the reads, nanoseconds */
+    gchar  value[SYSATTR_LTH];
+};
+
+struct sysattr_cache_counters {
+    guint64 hits;
+    guint64 reads;
+    guint64 latency; /* sum of the reads, nanoseconds */
+};
+
+struct sysattrs {
+    gint                  fds[SYSATTR_COUNT];
+    guint                 sample_tick;
+    guint                 sample_mask;
+    gchar                 sample_values[SYSATTR_COUNT][SYSATTR_LTH];
+    GDBusProxy           *proxy;        /* UPower device, the attributes are its cached properties */
+    gint                  trace_supply; /* id of the power supply in the trace, -1 when not recording nor replaying */
+    gint                  sample_index; /* power supply in the samples of the sampler thread, -1 when read by the main loop */
+    struct sysattr_cache *caches;       /* SYSATTR_COUNT entries for the batteries and AC, NULL for the devices */
+};
+
+struct battery {
+    gchar          *path;
+    struct sysattrs sysattrs;
+};
+
+struct device {
+    gchar          *path;
+    gchar          *name;        /* model name, or id of the power supply */
+    gchar          *type;
+    struct sysattrs sysattrs;
+    gint            low_level;   /* 0 when the low level is not notified */
+    gint            percentage;  /* -1 when unknown */
+    gint            status;      /* -1 when unknown */
+    gboolean        online;
+    gboolean        low;
+    gint            interval;    /* seconds between two samples, doubled while the device does not change */
+    gint64          next_sample; /* monotonic time */
+};
+
+struct configuration configuration = {
+    .update_interval = DEFAULT_UPDATE_INTERVAL,
+    .min_interval    = DEFAULT_MIN_INTERVAL,
+    .max_interval    = DEFAULT_MAX_INTERVAL,
+    .icon_type       = UNKNOWN_ICON,
+    .low_level       = DEFAULT_LOW_LEVEL,
+    .critical_level  = DEFAULT_CRITICAL_LEVEL,
+    .sampler         = SAMPLER_UEVENT,
+    .sampler_timeout = DEFAULT_SAMPLER_TIMEOUT,
+    .estimator       = ESTIMATOR_HYBRID,
+#ifdef WITH_HISTORY
+    .history_hours   = -1,
 #endif
-    FALSE,
-    FALSE
+    .output          = OUTPUT_TEMPLATE,
+    .output_template = DEFAULT_OUTPUT_TEMPLATE,
+    .backend         = BACKEND_SYSFS
+};
+
+struct estimator_sample {
+    gdouble  time;     /* seconds, relative to the time origin */
+    gdouble  capacity; /* relative to the capacity origin */
+    gboolean has_rate;
+};
+
+struct estimator {
+    struct estimator_sample samples[ESTIMATOR_SAMPLES];
+    guint   head;
+    guint   count;
+    gdouble time_origin;
+    gdouble capacity_origin;
+    gdouble elapsed;
+
+    /* running sums of the samples for the least-squares slope */
+    gdouble sum_t, sum_c, sum_tt, sum_tc, sum_cc;
+
+    /* moving average of the rate (in capacity per hour) and of its variance */
+    gboolean ewma_valid;
+    gdouble  ewma_rate;
+    gdouble  ewma_variance;
+};
+
+struct sample_supply {
+    guint mask;
+    gchar values[SYSATTR_COUNT][SYSATTR_LTH];
+};
+
+struct sample {
+    guint                         generation;  /* of the job it was taken from */
+    guint                         request;     /* serial of the last request it answers */
+    gboolean                      invalidated; /* a power supply was removed */
+    gint64                        duration;    /* nanoseconds */
+    guint                         slow_reads;  /* reads longer than the sampler timeout */
+    guint64                       bytes_read;
+    struct stats_histogram        reads;
+    struct sysattr_cache_counters cache_counters[SYSATTR_COUNT];
+    guint                         count;
+    struct sample_supply          supplies[SAMPLER_SUPPLIES];
+};
+
+struct sampler_job {
+    guint    generation;
+    gboolean uevent;              /* uevent sampler */
+    gboolean events;              /* the power supplies are monitored by uevents */
+    gint64   timeout;             /* nanoseconds */
+    guint    tick;                /* samples taken */
+    gint     epoch;               /* of the caches, sysattr_cache_epoch of the request */
+    guint    count;               /* the batteries, then the AC */
+    gint   (*fds)[SYSATTR_COUNT]; /* duplicates of the handles of the main loop */
+    struct sysattr_cache (*caches)[SYSATTR_COUNT]; /* of the thread, emptied by each job */
 };
 
 struct icon {
     GtkStatusIcon *gtk_icon;
     gchar *name;
     gint size;
+    gint scale;
+    gchar *tooltip;
 };
 
-static gint get_options (int argc, char **argv);
-static gboolean changed_power_supplies (void);
-static void get_power_supplies (void);
+struct view {
+    gint state;          /* state of the battery string, LOW_LEVEL/CRITICAL_LEVEL on the update that reaches them */
+    gint icon_state;
+    gint percentage;
+    gint time;           /* minutes, -1 when unknown */
+    gint rough_estimate;
+};
 
-static gboolean get_sysattr_string (gchar *path, gchar *attribute, gchar **value);
-static gboolean get_sysattr_double (gchar *path, gchar *attribute, gdouble *value);
+struct string_table {
+    const gchar *battery[CRITICAL_LEVEL + 1];           /* battery strings, indexed by state */
+    const gchar *minutes_remaining[60];                 /* "%d minutes remaining" */
+    const gchar *minutes[60];                           /* "%d minutes" */
+    const gchar *hours_remaining[STRING_TABLE_HOURS];   /* "%d hours, %s remaining" */
+    const gchar *rough_estimate;
+};
 
-static gboolean get_ac_online (gchar *path, gboolean *online);
-static gboolean get_battery_present (gchar *path, gboolean *present);
+struct icon_cache_entry {
+    gchar     *name;
+    gint       size;
+    gint       scale;
+    GdkPixbuf *pixbuf;
+    guint      last_use;
+};
 
-static gboolean get_battery_status (gint *status);
+struct grace_period {
+    gint         level;
+    gint         duration;
+    guint        source;
+    gint64       deadline;
+    gint64       dispatch_time;
+    struct icon *tray_icon;
+    gboolean     expired; /* the command waits for the update of a sample read after the deadline */
+    guint        request; /* sample request of that update, with the sampler thread */
+};
 
-static gboolean get_battery_full_capacity (gboolean *use_charge, gdouble *capacity);
-static gboolean get_battery_remaining_capacity (gboolean use_charge, gdouble *capacity);
-static gboolean get_battery_remaining_capacity_pct (gdouble *capacity);
-static gboolean get_battery_current_rate (gboolean use_charge, gdouble *rate);
+static gint get_options (int argc, char **argv);
+static void check_configuration (void);
+static void check_icon_type (void);
+static gboolean load_configuration_file (void);
+static gchar** get_key_file_string_list (GKeyFile *key_file, const gchar *group, const gchar *key, GError **error);
+static void reload_configuration (struct icon *tray_icon);
+static void create_configuration_monitor (struct icon *tray_icon);
+static void on_configuration_changed (GFileMonitor *monitor, GFile *file, GFile *other_file, GFileMonitorEvent event, struct icon *tray_icon);
+static gboolean on_configuration_timeout (struct icon *tray_icon);
+static gint get_icon_types (void);
+static void append_icon_types_cache_key (GString *key, const gchar *path);
+static void append_icon_theme_cache_key (GString *key, const gchar *directory);
+static gchar* get_icon_types_cache_key (void);
+static void profile_startup (const gchar *phase);
+static gboolean on_startup_idle (gpointer user_data);
+static gboolean changed_power_supplies (void);
+static void get_power_supplies (void);
+static void add_power_supply (const gchar *path, const gchar *type, struct sysattrs *sysattrs);
+static void free_battery (struct battery *battery);
+static gboolean is_battery_name (const gchar *name);
+
+static void add_device (const gchar *path, const gchar *name, const gchar *type, struct sysattrs *sysattrs);
+static void free_device (struct device *device);
+static gint get_device_low_level (const gchar *path);
+static gboolean parse_device_level (const gchar *device_level, gchar **id, gint *level);
+static void sample_device (struct device *device, gint64 now);
+static void schedule_device_update (void);
+static gboolean on_device_timeout (gpointer user_data);
+static gboolean mark_device_changed (const gchar *name);
+static gchar* get_device_string (struct device *device);
+static void on_tray_icon_popup_menu (GtkStatusIcon *gtk_icon, guint button, guint activate_time, struct icon *tray_icon);
+
+static gboolean create_uevent_monitor (struct icon *tray_icon);
+static gboolean on_uevent (gint fd, GIOCondition condition, struct icon *tray_icon);
+static gboolean on_uevent_timeout (struct icon *tray_icon);
+static gboolean parse_uevent (gchar *buffer, gssize length);
+
+static void scan_power_supply (const gchar *file, GArray *trace_scan);
+static void open_sysattrs (const gchar *path, struct sysattrs *sysattrs);
+static void close_sysattrs (struct sysattrs *sysattrs);
+static void clear_sysattrs (struct sysattrs *sysattrs);
+static gboolean read_sysfile (const gchar *path, const gchar *attribute, gchar *value, gsize size);
+static gboolean sample_sysattrs (struct sysattrs *sysattrs);
+static void parse_uevent_sample (gchar *buffer, gchar values[][SYSATTR_LTH], guint *mask);
+static gboolean get_sysattr_string (struct sysattrs *sysattrs, gint attribute, gchar *value, gsize size);
+static gboolean read_sysattr_string (struct sysattrs *sysattrs, gint attribute, gchar *value, gsize size);
+static gboolean get_sysattr_double (struct sysattrs *sysattrs, gint attribute, gdouble *value);
+
+static gint get_sysattr_cache_policy (gint attribute, gboolean events);
+static gboolean get_cached_sysattr (struct sysattr_cache *cache, gint attribute, guint tick, gint epoch, gboolean events, gint64 now, gchar *value, gsize size, struct sysattr_cache_counters *counters);
+static void set_cached_sysattr (struct sysattr_cache *cache, guint tick, gint epoch, gint64 now, gint64 latency, const gchar *value, struct sysattr_cache_counters *counters);
+static void invalidate_sysattr_caches (void);
+static void add_sysattr_cache_counters (struct sysattr_cache_counters *counters, const struct sysattr_cache_counters *other);
+static void append_sysattr_cache_counters (GString *report, const gchar *prefix, const gchar *separator);
+
+static gboolean get_ac_online (struct sysattrs *sysattrs, gboolean *online);
+static gboolean get_battery_present (struct sysattrs *sysattrs, gboolean *present);
+
+static gboolean get_battery_status (struct sysattrs *sysattrs, gint *status);
+
+static gboolean get_battery_full_capacity (struct sysattrs *sysattrs, gboolean *use_charge, gdouble *capacity);
+static gboolean get_battery_remaining_capacity (struct sysattrs *sysattrs, gboolean use_charge, gdouble *capacity);
+static gboolean get_battery_remaining_capacity_pct (struct sysattrs *sysattrs, gdouble *capacity);
+static gboolean get_battery_current_rate (struct sysattrs *sysattrs, gboolean use_charge, gdouble *rate);
+
+static gboolean get_batteries_present (gboolean *present);
+static gboolean get_batteries_status (gint *status);
 
 static gboolean get_battery_charge (gboolean remaining, gint *percentage, gint *time);
-static gboolean get_battery_time_estimation (gdouble remaining_capacity, gdouble y, gint *time);
+static void add_estimator_sample (gdouble capacity, gboolean has_rate, gdouble rate);
+static void add_estimator_sums (struct estimator_sample *sample, gdouble sign);
+static void rebase_estimator (void);
+static gboolean get_estimator_rate (gdouble *rate, gdouble *confidence);
+static gboolean get_estimator_ewma_rate (gdouble *rate, gdouble *confidence);
+static gboolean get_estimator_regression_rate (gdouble *rate, gdouble *confidence);
 static void reset_battery_time_estimation (void);
 
-static void create_tray_icon (void);
+static gint64 get_suspend_offset (void);
+static gboolean check_suspend (void);
+static void create_suspend_watchdog (struct icon *tray_icon);
+static void arm_suspend_watchdog (gdouble interval);
+static gboolean on_suspend_watchdog (gint fd, GIOCondition condition, struct icon *tray_icon);
+
+static void create_sampler_thread (void);
+static void set_sampler_job (void);
+static void free_sampler_job (struct sampler_job *job);
+static gpointer run_sampler_thread (gpointer data);
+static void take_sample (struct sampler_job *job, struct sample *sample);
+static gssize read_sample_fd (struct sample *sample, struct sampler_job *job, gint fd, gchar *buffer, gsize size, gint64 *latency);
+static gboolean request_sample (struct icon *tray_icon);
+static gboolean on_sample_ready (gint fd, GIOCondition condition, gpointer user_data);
+static gboolean on_sampler_timeout (gpointer user_data);
+
+static gboolean on_exit_signal (gpointer user_data);
+
+static struct icon* create_tray_icon (void);
 static void set_tray_icon (struct icon *tray_icon, const gchar *name);
+static void set_tray_icon_tooltip (struct icon *tray_icon, const gchar *tooltip);
+static void set_tray_icon_view (struct icon *tray_icon, gint state, gint icon_state, gint percentage, gint time);
+static void reset_tray_icon_view (void);
+static gint get_tray_icon_scale (void);
+static GdkPixbuf* get_icon_pixbuf (const gchar *name, gint size, gint scale);
+static void prewarm_icon_cache (gint size, gint scale);
+static void flush_icon_cache (void);
+static void on_icon_theme_changed (GtkIconTheme *icon_theme, struct icon *tray_icon);
 static gboolean resize_tray_icon (GtkStatusIcon *gtk_icon, gint size, struct icon *tray_icon);
 static gboolean update_tray_icon (struct icon *tray_icon);
+static gboolean on_update_timeout (struct icon *tray_icon);
+static void schedule_tray_icon_update (struct icon *tray_icon);
+static gdouble get_threshold_forecast (gint percentage);
 static void update_tray_icon_status (struct icon *tray_icon);
 static void on_tray_icon_click (struct icon *tray_icon, gpointer user_data);
 
+static void start_grace_period (struct grace_period *grace_period, struct icon *tray_icon);
+static void cancel_grace_periods (gboolean removed);
+static gboolean on_grace_period_timeout (struct grace_period *grace_period);
+static void complete_grace_periods (void);
+static void spawn_level_command (gint level);
+
 #ifdef WITH_NOTIFY
+struct pending_notification {
+    NotifyNotification **notification; /* category of the notification, its last message supersedes the others */
+    gchar               *summary;
+    gchar               *body;
+    gint                 timeout;
+    NotifyUrgency        urgency;
+    gint64               queue_time;
+    gint64               dispatch_time;
+};
+
 static void notify_message (NotifyNotification **notification, gchar *summary, gchar *body, gint timeout, NotifyUrgency urgency);
+static void dispatch_notifications (guint delay);
+static gboolean on_notification_dispatch (gpointer user_data);
+static void on_notification_bus (GObject *source_object, GAsyncResult *result, gpointer user_data);
+static void on_notification_shown (GObject *source_object, GAsyncResult *result, gpointer user_data);
+static void free_pending_notification (struct pending_notification *pending);
 #define NOTIFY_MESSAGE(...) notify_message(__VA_ARGS__)
 #else
 #define NOTIFY_MESSAGE(...)
@@ -141,21 +486,217 @@ static void notify_message (NotifyNotification **notification, gchar *summary, g
 static gchar* get_tooltip_string (gchar *battery, gchar *time);
 static gchar* get_battery_string (gint state, gint percentage);
 static gchar* get_time_string (gint minutes);
-static gchar* get_icon_name (gint state, gint percentage);
+static const gchar* get_icon_name (gint state, gint percentage);
+static void init_string_tables (void);
+static void init_icon_names (void);
+
+static void write_headless_status (struct icon *tray_icon);
+static gchar* get_output_string (const gchar *output_template, const gchar *state, gint percentage, gint time);
+static void append_json_string (GString *string, const gchar *value);
 
+static gchar *sysfs_path     = SYSFS_ROOT "/" SYSFS_POWER_SUPPLY;
 static gchar *battery_suffix = NULL;
 static gchar *battery_path   = NULL;
 static gchar *ac_path        = NULL;
 
 /*
- * workaround for limited/bugged batteries/drivers that don't provide current rate
- * the next 4 variables are used to calculate estimated time
+ * batteries that are displayed, battery_path is the path of the first one
+ * there is only one battery unless the batteries are aggregated
+ */
+
+static GPtrArray *batteries = NULL;
+
+/*
+ * peripheral and other power supplies (mice, keyboards, headsets, USB, UPS...) listed in the menu of the tray icon
+ * each device is sampled on its own cadence by one timer, never by the updates of the system battery
+ */
+
+static GPtrArray *devices       = NULL;
+static guint      device_source = 0;
+#ifdef WITH_NOTIFY
+static GHashTable *device_notifications = NULL; /* path => notification, kept across rescans as one may be in flight */
+#endif
+
+/*
+ * attribute handles of the batteries and AC, opened once when the power supplies are resolved
+ * and reread with pread, a handle is -1 when the attribute is not available
+ * with the uevent sampler, the attributes of a tick are all served from one read of the uevent file
+ */
+
+static struct sysattrs ac_sysattrs;
+static gboolean        sysattrs_invalidated = FALSE;
+static guint           sampler_tick         = 1;
+
+/*
+ * cache of the attributes read from their files, each attribute is refreshed by its policy: every tick (status, rates
+ * and remaining capacities), on the uevents of its power supply (present, online) or after a TTL (full capacities)
+ * that doubles while the attribute does not change, up to a longer TTL for the attributes whose reads are slow
+ * the epoch is bumped by the change uevents, the lost uevents and the resumes, the sampler thread gets it with each
+ * request and never reads the caches of the main loop, nor the main loop those of the thread
+ */
+
+static gint                          sysattr_cache_epoch = 0;
+static struct sysattr_cache_counters sysattr_cache_counters[SYSATTR_COUNT];
+
+/*
+ * sampler thread, the reads of the batteries and AC are made off the main loop so a slow embedded controller
+ * never freezes the tray icon: an update requests a sample and runs once it is ready, or after the sampler timeout
+ * on the previous sample, marked stale
+ * the job (the handles to read) is handed to the thread under the mutex, each sample back through an atomic exchange
+ * of the index of the ready sample, the samples are recycled between the thread and the main loop without any allocation
+ */
+
+static GThread            *sampler_thread         = NULL;
+static GMutex              sampler_mutex;
+static GCond               sampler_cond;
+static guint               sampler_requests       = 0;     /* under sampler_mutex, serial of the last request */
+static gint                sampler_epoch          = 0;     /* under sampler_mutex, sysattr_cache_epoch of the last request */
+static struct sampler_job *sampler_next_job       = NULL;  /* under sampler_mutex */
+static struct sample       sampler_samples[SAMPLER_SAMPLES];
+static guint               sampler_ready          = 1;     /* index of the ready sample, with SAMPLER_FRESH until it is adopted */
+static guint               sampler_current        = 2;     /* index of the sample owned by the main loop */
+static gint                sampler_event_fd       = -1;    /* written by the thread each time a sample is ready */
+static guint               sampler_generation     = 0;
+static guint               sampler_timeout_source = 0;
+static struct icon        *sampler_icon           = NULL;
+static struct sample      *current_sample         = NULL;  /* sample read by the updates */
+static gboolean            sample_delivered       = FALSE; /* the next update runs on current_sample */
+static gboolean            sample_stale           = FALSE; /* current_sample is older than the last request */
+static guint               stale_updates          = 0;
+static guint               slow_reads             = 0;
+
+/*
+ * time estimator, fed with one sample of the remaining capacity (and of the current rate
+ * when the battery provides it) per update, the rate is smoothed so the time does not jump
+ * estimation_needed is the workaround for limited/bugged batteries/drivers that don't provide current rate
+ */
+
+static gboolean         estimation_needed = FALSE;
+static struct estimator estimator;
+
+/*
+ * last charge computed by get_battery_charge, used to forecast the threshold crossings
+ * (the current rate is in capacity per hour, -1 when it is unknown)
+ */
+
+gdouble last_full_capacity      = -1;
+gdouble last_remaining_capacity = -1;
+gdouble last_current_rate       = -1;
+gdouble last_time_confidence    = 0;
+gint    last_capacity_unit      = CAPACITY_ENERGY;
+
+/*
+ * uevent monitoring of the power_supply subsystem
+ * the periodic update falls back to a slow interval once the battery driver emits change events
+ */
+
+static guint    uevent_source                 = 0;
+static guint    uevent_timeout_source         = 0;
+static gboolean uevent_power_supplies_changed = TRUE;
+static gboolean uevent_battery_changes        = FALSE;
+
+#ifdef WITH_UPOWER
+/*
+ * UPower backend (cbatticon-upower.c), its signals update this tray icon
+ */
+
+static struct icon *upower_tray_icon = NULL;
+#endif
+
+/*
+ * adaptive scheduler of the updates, planned from the battery status and percentage of the last update
+ */
+
+static guint update_source        = 0;
+static gint  scheduler_status     = -1;
+static gint  scheduler_percentage = -1;
+static gint  scheduler_time       = -1;
+
+/*
+ * suspend detection, the boot time keeps running while the system is suspended and the monotonic time
+ * (hence the main loop timers and the estimator) does not, the watchdog is a boot time timer armed past
+ * each update deadline that only fires when a suspend froze the update timer
+ */
+
+static gint   suspend_watchdog_fd = -1;
+static gint64 suspend_offset      = -1;
+
+/*
+ * grace periods before spawning the low/critical level commands, driven by main loop timers
+ * and cancelled by the regular updates as soon as the battery is no longer discharging
+ */
+
+static struct grace_period low_grace_period      = { LOW_LEVEL     , LOW_LEVEL_GRACE_PERIOD     , 0, 0, 0, NULL, FALSE, 0 };
+static struct grace_period critical_grace_period = { CRITICAL_LEVEL, CRITICAL_LEVEL_GRACE_PERIOD, 0, 0, 0, NULL, FALSE, 0 };
+static gint64              grace_period_latency  = 0;
+
+/*
+ * view of the tray icon rendered by the last update, the strings are only formatted and the tray icon
+ * only updated when the view changes, the serial is incremented each time the tray icon is updated
+ */
+
+static struct view tray_icon_view        = { -1, -1, -1, -1, -1 };
+static guint       tray_icon_view_serial = 0;
+static guint       tray_icon_view_ticks  = 0;
+static guint       tray_icon_view_hits   = 0;
+
+/*
+ * icon names of every icon type, state and percentage bucket, and translated strings,
+ * resolved once at startup as neither the icon types nor the locale change at runtime
+ */
+
+static gchar               icon_names[ICON_TYPE_COUNT][ICON_STATE_COUNT][ICON_BUCKETS][ICON_NAME_LTH];
+static struct string_table string_table;
+static gboolean            string_tables_ready = FALSE;
+
+/*
+ * least recently used cache of the decoded tray icons, it owns a reference on each pixbuf
+ */
+
+static struct icon_cache_entry icon_cache[ICON_CACHE_SIZE];
+static guint                   icon_cache_clock = 0;
+
+#ifdef WITH_NOTIFY
+/*
+ * notifications, queued and sent one at a time by the main loop with an asynchronous D-Bus call to the
+ * notification daemon, the libnotify notifications are only created and updated by the main loop
+ * the queue holds at most one message per category, a new message supersedes the queued one
+ */
+
+static GQueue           notification_queue           = G_QUEUE_INIT;
+static GHashTable      *notification_times           = NULL; /* category => time of its last notification */
+static GDBusConnection *notification_bus             = NULL;
+static gboolean         notification_in_flight       = FALSE;
+static guint            notification_dispatch_source = 0;
+static guint            notification_dropped         = 0;
+static guint            notification_stalls          = 0;
+#endif
+
+/*
+ * configuration file, $XDG_CONFIG_HOME/cbatticon/config, watched and reloaded at the start of the next update
+ * the options of the command line take precedence over the file, the defaults apply to the keys it does not set
+ */
+
+static struct configuration default_configuration;
+static guint                command_line_options  = 0; /* OPTION_* given on the command line, whatever their value */
+static gchar               *configuration_path    = NULL;
+static GFileMonitor        *configuration_monitor = NULL;
+static guint                configuration_source  = 0;
+static gboolean             configuration_changed = FALSE;
+
+/*
+ * start of the process, the startup profile displays the duration of each phase from this time
+ */
+
+gint64 startup_time = 0;
+
+/*
+ * runtime statistics, the counters are only updated by the main thread and need no locking
+ * built with the statistics, they are dumped on SIGUSR1 and, with --stats, when cbatticon exits
  */
 
-static gboolean estimation_needed             = FALSE;
-static gdouble  estimation_remaining_capacity = -1;
-static gint     estimation_time               = -1;
-static GTimer  *estimation_timer              = NULL;
+struct stats        stats;
+static GMainLoop   *main_loop = NULL;
 
 /*
  * command line options function
@@ -166,14 +707,26 @@ static gint get_options (int argc, char **argv)
     GError *error = NULL;
 
     gchar *icon_type_string = NULL;
+    gchar *sampler_string = NULL;
+    gchar *estimator_string = NULL;
+    gchar *output_string = NULL;
+    gchar *backend_string = NULL;
+
+    /* the integers that the configuration file can set are unset until parsed, an explicit default is an option */
+
+    gint update_interval = G_MININT, min_interval = G_MININT, max_interval = G_MININT;
+    gint low_level = G_MININT, critical_level = G_MININT;
+
     GOptionContext *option_context;
     GOptionEntry option_entries[] = {
         { "version"               , 'v', 0, G_OPTION_ARG_NONE  , &configuration.display_version       , N_("Display the version")                                      , NULL },
         { "debug"                 , 'd', 0, G_OPTION_ARG_NONE  , &configuration.debug_output          , N_("Display debug information")                                , NULL },
-        { "update-interval"       , 'u', 0, G_OPTION_ARG_INT   , &configuration.update_interval       , N_("Set update interval (in seconds)")                         , NULL },
+        { "update-interval"       , 'u', 0, G_OPTION_ARG_INT   , &update_interval                    , N_("Set update interval (in seconds)")                         , NULL },
+        { "min-interval"          , 0  , 0, G_OPTION_ARG_INT   , &min_interval                       , N_("Set minimum update interval (in seconds)")                 , NULL },
+        { "max-interval"          , 0  , 0, G_OPTION_ARG_INT   , &max_interval                       , N_("Set maximum update interval (in seconds)")                 , NULL },
         { "icon-type"             , 'i', 0, G_OPTION_ARG_STRING, &icon_type_string                    , N_("Set icon type ('standard', 'notification' or 'symbolic')") , NULL },
-        { "low-level"             , 'l', 0, G_OPTION_ARG_INT   , &configuration.low_level             , N_("Set low battery level (in percent)")                       , NULL },
-        { "critical-level"        , 'r', 0, G_OPTION_ARG_INT   , &configuration.critical_level        , N_("Set critical battery level (in percent)")                  , NULL },
+        { "low-level"             , 'l', 0, G_OPTION_ARG_INT   , &low_level                          , N_("Set low battery level (in percent)")                       , NULL },
+        { "critical-level"        , 'r', 0, G_OPTION_ARG_INT   , &critical_level                     , N_("Set critical battery level (in percent)")                  , NULL },
         { "command-low-level"     , 'o', 0, G_OPTION_ARG_STRING, &configuration.command_low_level     , N_("Command to execute when low battery level is reached")     , NULL },
         { "command-critical-level", 'c', 0, G_OPTION_ARG_STRING, &configuration.command_critical_level, N_("Command to execute when critical battery level is reached"), NULL },
         { "command-left-click"    , 'x', 0, G_OPTION_ARG_STRING, &configuration.command_left_click    , N_("Command to execute when left clicking on tray icon")       , NULL },
@@ -182,9 +735,41 @@ static gint get_options (int argc, char **argv)
 #endif
         { "list-icon-types"       , 't', 0, G_OPTION_ARG_NONE  , &configuration.list_icon_types       , N_("List available icon types")                                , NULL },
         { "list-power-supplies"   , 'p', 0, G_OPTION_ARG_NONE  , &configuration.list_power_supplies   , N_("List available power supplies (battery and AC)")           , NULL },
+        { "prewarm-icons"         , 0  , 0, G_OPTION_ARG_NONE  , &configuration.prewarm_icons         , N_("Load all the icons of the icon type at startup")           , NULL },
+        { "aggregate"             , 'a', 0, G_OPTION_ARG_NONE  , &configuration.aggregate_batteries   , N_("Aggregate all the batteries into one")                     , NULL },
+        { "sampler"               , 's', 0, G_OPTION_ARG_STRING, &sampler_string                      , N_("Set sysfs sampler ('uevent' or 'file')")                   , NULL },
+        { "sampler-timeout"       , 0  , 0, G_OPTION_ARG_INT   , &configuration.sampler_timeout       , N_("Set sampler thread timeout (in milliseconds, 0 for no thread)"), NULL },
+        { "estimator"             , 'e', 0, G_OPTION_ARG_STRING, &estimator_string                    , N_("Set time estimator ('hybrid', 'ewma' or 'regression')")    , NULL },
+#ifdef WITH_HISTORY
+        { "history"               , 0  , 0, G_OPTION_ARG_INT   , &configuration.history_hours         , N_("Display the battery history of the last hours (0 for all)"), NULL },
+        { "no-history"            , 0  , 0, G_OPTION_ARG_NONE  , &configuration.no_history            , N_("Do not record the battery history")                        , NULL },
+#endif
+        { "headless"              , 0  , 0, G_OPTION_ARG_NONE  , &configuration.headless              , N_("Write the battery status to the standard output, no tray icon"), NULL },
+        { "status"                , 0  , 0, G_OPTION_ARG_NONE  , &configuration.status_only           , N_("Write the battery status to the standard output and exit") , NULL },
+        { "output"                , 0  , 0, G_OPTION_ARG_STRING, &output_string                       , N_("Set headless output ('i3bar', 'waybar' or a text template)"), NULL },
+        { "startup-profile"       , 0  , 0, G_OPTION_ARG_NONE  , &configuration.startup_profile       , N_("Display the duration of the startup phases")               , NULL },
+        { "sysfs-root"            , 0  , 0, G_OPTION_ARG_FILENAME, &configuration.sysfs_root          , N_("Set sysfs root directory (for testing)")                   , NULL },
+#ifdef WITH_STATS
+        { "stats"                 , 0  , 0, G_OPTION_ARG_NONE  , &configuration.stats                 , N_("Display runtime statistics at exit")                       , NULL },
+#endif
+        { "backend"               , 0  , 0, G_OPTION_ARG_STRING, &backend_string                      , N_("Set power supplies backend ('sysfs' or 'upower')")         , NULL },
+        { "devices"               , 0  , 0, G_OPTION_ARG_NONE  , &configuration.devices               , N_("Show the peripheral and other power supplies in a menu")   , NULL },
+        { "device-level"          , 0  , 0, G_OPTION_ARG_STRING_ARRAY, &configuration.device_levels   , N_("Set low level of a device, ID=PERCENT (0 for no notification)"), NULL },
+#ifdef WITH_SOCKET
+        { "socket"                , 0  , 0, G_OPTION_ARG_NONE  , &configuration.socket                , N_("Serve the battery status on a local socket")               , NULL },
+#endif
+#ifdef WITH_SHM
+        { "shm"                   , 0  , 0, G_OPTION_ARG_NONE  , &configuration.shm                   , N_("Publish the battery status in shared memory")              , NULL },
+#endif
+#ifdef WITH_TRACE
+        { "record"                , 0  , 0, G_OPTION_ARG_FILENAME, &configuration.record_file         , N_("Record the attribute reads in a trace file")               , NULL },
+        { "replay"                , 0  , 0, G_OPTION_ARG_FILENAME, &configuration.replay_file         , N_("Replay a trace file on a virtual clock and exit")          , NULL },
+#endif
         { NULL }
     };
 
+    default_configuration = configuration;
+
     option_context = g_option_context_new (_("[BATTERY ID]"));
     g_option_context_add_main_entries (option_context, option_entries, CBATTICON_STRING);
 
@@ -197,6 +782,98 @@ static gint get_options (int argc, char **argv)
 
     g_option_context_free (option_context);
 
+    profile_startup ("options");
+
+    /* configuration file : the keys it sets apply to the options that are not on the command line */
+
+    #define SET_COMMAND_LINE_OPTION(OPTION,IS_SET)                                                               \
+                                                                                                                \
+            if (IS_SET) {                                                                                       \
+                command_line_options |= OPTION;                                                                 \
+            }
+
+    #define SET_COMMAND_LINE_INTEGER(OPTION,FIELD)                                                               \
+                                                                                                                \
+            if (FIELD != G_MININT) {                                                                            \
+                configuration.FIELD = FIELD;                                                                    \
+                command_line_options |= OPTION;                                                                 \
+            }
+
+    SET_COMMAND_LINE_INTEGER (OPTION_UPDATE_INTERVAL       , update_interval)
+    SET_COMMAND_LINE_INTEGER (OPTION_MIN_INTERVAL          , min_interval)
+    SET_COMMAND_LINE_INTEGER (OPTION_MAX_INTERVAL          , max_interval)
+    SET_COMMAND_LINE_INTEGER (OPTION_LOW_LEVEL             , low_level)
+    SET_COMMAND_LINE_INTEGER (OPTION_CRITICAL_LEVEL        , critical_level)
+    SET_COMMAND_LINE_OPTION  (OPTION_COMMAND_LOW_LEVEL     , configuration.command_low_level != NULL)
+    SET_COMMAND_LINE_OPTION  (OPTION_COMMAND_CRITICAL_LEVEL, configuration.command_critical_level != NULL)
+    SET_COMMAND_LINE_OPTION  (OPTION_COMMAND_LEFT_CLICK    , configuration.command_left_click != NULL)
+#ifdef WITH_NOTIFY
+    SET_COMMAND_LINE_OPTION  (OPTION_HIDE_NOTIFICATION     , configuration.hide_notification == TRUE)
+#endif
+    SET_COMMAND_LINE_OPTION  (OPTION_ICON_TYPE             , icon_type_string != NULL)
+    SET_COMMAND_LINE_OPTION  (OPTION_ESTIMATOR             , estimator_string != NULL)
+    SET_COMMAND_LINE_OPTION  (OPTION_DEVICE_LEVELS         , configuration.device_levels != NULL)
+
+    load_configuration_file ();
+
+    /* option : set sysfs root, the environment variable is used when the option is not set */
+
+    if (configuration.sysfs_root == NULL) {
+        configuration.sysfs_root = g_strdup (g_getenv (SYSFS_ROOT_ENV));
+    }
+
+    if (configuration.sysfs_root != NULL) {
+        sysfs_path = g_build_filename (configuration.sysfs_root, SYSFS_POWER_SUPPLY, NULL);
+    }
+
+    /* option : set power supplies backend, UPower falls back to sysfs when it is not running */
+
+    if (backend_string != NULL) {
+        if (g_strcmp0 (backend_string, "sysfs") == 0)
+            configuration.backend = BACKEND_SYSFS;
+#ifdef WITH_UPOWER
+        else if (g_strcmp0 (backend_string, "upower") == 0)
+            configuration.backend = BACKEND_UPOWER;
+#endif
+        else g_printerr (_("Unknown backend: %s\n"), backend_string);
+
+        g_free (backend_string);
+    }
+
+#ifdef WITH_TRACE
+    /* option : record or replay a trace of the attribute reads, both with the sysfs backend */
+
+    if (configuration.replay_file != NULL) {
+        if (open_replay (configuration.replay_file) == FALSE) {
+            return -1;
+        }
+
+        configuration.backend  = BACKEND_SYSFS;
+        configuration.headless = TRUE;
+    } else if (configuration.record_file != NULL) {
+        if (open_trace (configuration.record_file) == FALSE) {
+            return -1;
+        }
+
+        if (configuration.backend == BACKEND_UPOWER) {
+            g_printerr (_("The trace is recorded with the sysfs backend\n"));
+            configuration.backend = BACKEND_SYSFS;
+        }
+    }
+#endif
+
+    /* option : set low level of the devices, ID=PERCENT where ID is a suffix of the device path */
+
+    if ((command_line_options & OPTION_DEVICE_LEVELS) != 0) {
+        gchar **device_level;
+
+        for (device_level = configuration.device_levels; *device_level != NULL; device_level++) {
+            if (parse_device_level (*device_level, NULL, NULL) == FALSE) {
+                g_printerr (_("Invalid device level: %s\n"), *device_level);
+            }
+        }
+    }
+
     /* option : display the version */
 
     if (configuration.display_version == TRUE) {
@@ -215,47 +892,111 @@ static gint get_options (int argc, char **argv)
         return 0;
     }
 
-    /* option : list available icon types */
+    /* option : set sysfs sampler */
+
+    if (sampler_string != NULL) {
+        if (g_strcmp0 (sampler_string, "uevent") == 0)
+            configuration.sampler = SAMPLER_UEVENT;
+        else if (g_strcmp0 (sampler_string, "file") == 0)
+            configuration.sampler = SAMPLER_FILE;
+        else g_printerr (_("Unknown sampler: %s\n"), sampler_string);
+
+        g_free (sampler_string);
+    }
+
+    /* option : set time estimator */
+
+    if (estimator_string != NULL) {
+        if (g_strcmp0 (estimator_string, "hybrid") == 0)
+            configuration.estimator = ESTIMATOR_HYBRID;
+        else if (g_strcmp0 (estimator_string, "ewma") == 0)
+            configuration.estimator = ESTIMATOR_EWMA;
+        else if (g_strcmp0 (estimator_string, "regression") == 0)
+            configuration.estimator = ESTIMATOR_REGRESSION;
+        else g_printerr (_("Unknown estimator: %s\n"), estimator_string);
 
-    gtk_init (&argc, &argv); /* gtk is required as from this point */
+        g_free (estimator_string);
+    }
 
-    #define HAS_STANDARD_ICON_TYPE     gtk_icon_theme_has_icon (gtk_icon_theme_get_default (), "battery-full")
-    #define HAS_NOTIFICATION_ICON_TYPE gtk_icon_theme_has_icon (gtk_icon_theme_get_default (), "notification-battery-100")
-    #define HAS_SYMBOLIC_ICON_TYPE     gtk_icon_theme_has_icon (gtk_icon_theme_get_default (), "battery-full-symbolic")
+#ifdef WITH_HISTORY
+    /* option : display the battery history */
 
-    if (configuration.list_icon_types == TRUE) {
-        g_print (_("List of available icon types:\n"));
-        g_print ("standard\t%s\n"    , HAS_STANDARD_ICON_TYPE     == TRUE ? _("available") : _("unavailable"));
-        g_print ("notification\t%s\n", HAS_NOTIFICATION_ICON_TYPE == TRUE ? _("available") : _("unavailable"));
-        g_print ("symbolic\t%s\n"    , HAS_SYMBOLIC_ICON_TYPE     == TRUE ? _("available") : _("unavailable"));
+    if (configuration.history_hours >= 0) {
+        query_history (configuration.history_hours);
 
         return 0;
     }
+#endif
 
-    /* option : set icon type */
+    /* option : run headless, gtk is neither initialized nor used */
 
-    if (icon_type_string != NULL) {
-        if (g_strcmp0 (icon_type_string, "standard") == 0 && HAS_STANDARD_ICON_TYPE == TRUE)
-            configuration.icon_type = BATTERY_ICON_STANDARD;
-        else if (g_strcmp0 (icon_type_string, "notification") == 0 && HAS_NOTIFICATION_ICON_TYPE == TRUE)
-            configuration.icon_type = BATTERY_ICON_NOTIFICATION;
-        else if (g_strcmp0 (icon_type_string, "symbolic") == 0 && HAS_SYMBOLIC_ICON_TYPE == TRUE)
-            configuration.icon_type = BATTERY_ICON_SYMBOLIC;
-        else g_printerr (_("Unknown icon type: %s\n"), icon_type_string);
+    if (configuration.status_only == TRUE) {
+        configuration.headless = TRUE;
+#ifdef WITH_NOTIFY
+        configuration.hide_notification = TRUE;
+#endif
+    }
 
-        g_free (icon_type_string);
+    if (output_string != NULL) {
+        if (g_strcmp0 (output_string, "i3bar") == 0) {
+            configuration.output = OUTPUT_I3BAR;
+        } else if (g_strcmp0 (output_string, "waybar") == 0) {
+            configuration.output = OUTPUT_WAYBAR;
+        } else {
+            configuration.output = OUTPUT_TEMPLATE;
+            configuration.output_template = output_string;
+            output_string = NULL;
+        }
+
+        g_free (output_string);
     }
 
-    if (configuration.icon_type == UNKNOWN_ICON) {
-        if (HAS_STANDARD_ICON_TYPE == TRUE)
-            configuration.icon_type = BATTERY_ICON_STANDARD;
-        else if (HAS_NOTIFICATION_ICON_TYPE == TRUE)
-            configuration.icon_type = BATTERY_ICON_NOTIFICATION;
-        else if (HAS_SYMBOLIC_ICON_TYPE == TRUE)
-            configuration.icon_type = BATTERY_ICON_SYMBOLIC;
-        else g_printerr (_("No icon type found!\n"));
+    if (configuration.headless == FALSE || configuration.list_icon_types == TRUE) {
+        gtk_init (&argc, &argv); /* gtk is required as from this point */
+
+        profile_startup ("gtk init");
+
+        /* option : list available icon types */
+
+        #define HAS_STANDARD_ICON_TYPE     ((get_icon_types () & (1 << BATTERY_ICON_STANDARD)) != 0)
+        #define HAS_NOTIFICATION_ICON_TYPE ((get_icon_types () & (1 << BATTERY_ICON_NOTIFICATION)) != 0)
+        #define HAS_SYMBOLIC_ICON_TYPE     ((get_icon_types () & (1 << BATTERY_ICON_SYMBOLIC)) != 0)
+
+        if (configuration.list_icon_types == TRUE) {
+            g_print (_("List of available icon types:\n"));
+            g_print ("standard\t%s\n"    , HAS_STANDARD_ICON_TYPE     == TRUE ? _("available") : _("unavailable"));
+            g_print ("notification\t%s\n", HAS_NOTIFICATION_ICON_TYPE == TRUE ? _("available") : _("unavailable"));
+            g_print ("symbolic\t%s\n"    , HAS_SYMBOLIC_ICON_TYPE     == TRUE ? _("available") : _("unavailable"));
+
+            return 0;
+        }
+
+        /* option : set icon type */
+
+        if (icon_type_string != NULL) {
+            if (g_strcmp0 (icon_type_string, "standard") == 0 && HAS_STANDARD_ICON_TYPE == TRUE)
+                configuration.icon_type = BATTERY_ICON_STANDARD;
+            else if (g_strcmp0 (icon_type_string, "notification") == 0 && HAS_NOTIFICATION_ICON_TYPE == TRUE)
+                configuration.icon_type = BATTERY_ICON_NOTIFICATION;
+            else if (g_strcmp0 (icon_type_string, "symbolic") == 0 && HAS_SYMBOLIC_ICON_TYPE == TRUE)
+                configuration.icon_type = BATTERY_ICON_SYMBOLIC;
+            else g_printerr (_("Unknown icon type: %s\n"), icon_type_string);
+
+            g_free (icon_type_string);
+        }
+
+        check_icon_type ();
+
+        profile_startup ("icon types");
     }
 
+    check_configuration ();
+
+    return 1;
+}
+
+static void check_configuration (void)
+{
     /* option : update interval */
 
     if (configuration.update_interval <= 0) {
@@ -263,6 +1004,19 @@ static gint get_options (int argc, char **argv)
         g_printerr (_("Invalid update interval! It has been reset to default (%d seconds)\n"), DEFAULT_UPDATE_INTERVAL);
     }
 
+    /* option : minimum and maximum update intervals */
+
+    if (configuration.min_interval <= 0) {
+        configuration.min_interval = DEFAULT_MIN_INTERVAL;
+        g_printerr (_("Invalid minimum update interval! It has been reset to default (%d seconds)\n"), DEFAULT_MIN_INTERVAL);
+    }
+
+    if (configuration.max_interval < configuration.min_interval) {
+        configuration.min_interval = DEFAULT_MIN_INTERVAL;
+        configuration.max_interval = DEFAULT_MAX_INTERVAL;
+        g_printerr (_("Maximum update interval is lower than minimum update interval! They have been reset to default\n"));
+    }
+
     /* option : low and critical levels */
 
     if (configuration.low_level < 0 || configuration.low_level > 100) {
@@ -281,926 +1035,4336 @@ static gint get_options (int argc, char **argv)
         g_printerr (_("Critical level is higher than low level! They have been reset to default\n"));
     }
 
-    return 1;
+    /* option : sampler timeout */
+
+    if (configuration.sampler_timeout < 0) {
+        configuration.sampler_timeout = DEFAULT_SAMPLER_TIMEOUT;
+        g_printerr (_("Invalid sampler timeout! It has been reset to default (%d milliseconds)\n"), DEFAULT_SAMPLER_TIMEOUT);
+    }
+}
+
+static void check_icon_type (void)
+{
+    /* an icon type of the configuration file may not be available, the first available one is used instead */
+
+    if (configuration.icon_type != UNKNOWN_ICON && (get_icon_types () & (1 << configuration.icon_type)) == 0) {
+        g_printerr (_("Unavailable icon type in the configuration file\n"));
+        configuration.icon_type = UNKNOWN_ICON;
+    }
+
+    if (configuration.icon_type == UNKNOWN_ICON) {
+        if ((get_icon_types () & (1 << BATTERY_ICON_STANDARD)) != 0)
+            configuration.icon_type = BATTERY_ICON_STANDARD;
+        else if ((get_icon_types () & (1 << BATTERY_ICON_NOTIFICATION)) != 0)
+            configuration.icon_type = BATTERY_ICON_NOTIFICATION;
+        else if ((get_icon_types () & (1 << BATTERY_ICON_SYMBOLIC)) != 0)
+            configuration.icon_type = BATTERY_ICON_SYMBOLIC;
+        else g_printerr (_("No icon type found!\n"));
+    }
 }
 
 /*
- * sysfs functions
+ * configuration file functions
  */
 
-static gboolean changed_power_supplies (void)
+static gboolean load_configuration_file (void)
 {
-    GDir *directory;
-    const gchar *file;
+    GError *error = NULL;
+    GKeyFile *key_file;
+    gchar *value;
 
-    static gint old_num_ps = 0;
-    static gint old_total_ps = 0;
-    gint num_ps = 0;
-    gint total_ps = 0;
-    gboolean power_supplies_changed;
+    if (configuration_path == NULL) {
+        configuration_path = g_build_filename (g_get_user_config_dir (), CBATTICON_STRING, CONFIGURATION_FILE, NULL);
+    }
 
-    directory = g_dir_open (SYSFS_PATH, 0, NULL);
-    if (directory != NULL) {
-        file = g_dir_read_name (directory);
-        while (file != NULL) {
-            if (ac_path != NULL && g_str_has_suffix (ac_path, file) == TRUE) {
-                num_ps++;
-            }
+    /* a missing file is an empty configuration */
 
-            if (battery_path != NULL && g_str_has_suffix (battery_path, file) == TRUE) {
-                num_ps++;
+    key_file = g_key_file_new ();
+
+    if (g_key_file_load_from_file (key_file, configuration_path, G_KEY_FILE_NONE, &error) == FALSE) {
+        if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT) == FALSE) {
+            g_printerr (_("Cannot load configuration file: %s (%s)\n"), configuration_path, error->message);
+            g_error_free (error); error = NULL;
+            g_key_file_free (key_file);
+
+            return FALSE;
+        }
+
+        g_error_free (error); error = NULL;
+    }
+
+    /* the replaced strings are freed by the caller, which may still compare them */
+
+    #define SET_CONFIGURATION(KEY,OPTION,FIELD,GETTER)                                                           \
+                                                                                                                \
+            if ((command_line_options & OPTION) == 0) {                                                         \
+                configuration.FIELD = default_configuration.FIELD;                                              \
+                                                                                                                \
+                if (g_key_file_has_key (key_file, CONFIGURATION_GROUP, KEY, NULL) == TRUE) {                    \
+                    configuration.FIELD = GETTER (key_file, CONFIGURATION_GROUP, KEY, &error);                  \
+                                                                                                                \
+                    if (error != NULL) {                                                                        \
+                        g_printerr (_("Invalid %s in the configuration file: %s\n"), KEY, error->message);      \
+                        g_error_free (error); error = NULL;                                                     \
+                        configuration.FIELD = default_configuration.FIELD;                                      \
+                    }                                                                                           \
+                }                                                                                               \
             }
 
-            total_ps++;
+    SET_CONFIGURATION ("update-interval"       , OPTION_UPDATE_INTERVAL       , update_interval       , g_key_file_get_integer)
+    SET_CONFIGURATION ("min-interval"          , OPTION_MIN_INTERVAL          , min_interval          , g_key_file_get_integer)
+    SET_CONFIGURATION ("max-interval"          , OPTION_MAX_INTERVAL          , max_interval          , g_key_file_get_integer)
+    SET_CONFIGURATION ("low-level"             , OPTION_LOW_LEVEL             , low_level             , g_key_file_get_integer)
+    SET_CONFIGURATION ("critical-level"        , OPTION_CRITICAL_LEVEL        , critical_level        , g_key_file_get_integer)
+    SET_CONFIGURATION ("command-low-level"     , OPTION_COMMAND_LOW_LEVEL     , command_low_level     , g_key_file_get_string)
+    SET_CONFIGURATION ("command-critical-level", OPTION_COMMAND_CRITICAL_LEVEL, command_critical_level, g_key_file_get_string)
+    SET_CONFIGURATION ("command-left-click"    , OPTION_COMMAND_LEFT_CLICK    , command_left_click    , g_key_file_get_string)
+#ifdef WITH_NOTIFY
+    SET_CONFIGURATION ("hide-notification"     , OPTION_HIDE_NOTIFICATION     , hide_notification     , g_key_file_get_boolean)
+#endif
+    SET_CONFIGURATION ("device-level"          , OPTION_DEVICE_LEVELS         , device_levels         , get_key_file_string_list)
 
-            file = g_dir_read_name (directory);
+    if ((command_line_options & OPTION_DEVICE_LEVELS) == 0 && configuration.device_levels != NULL) {
+        gchar **device_level;
+
+        for (device_level = configuration.device_levels; *device_level != NULL; device_level++) {
+            if (parse_device_level (*device_level, NULL, NULL) == FALSE) {
+                g_printerr (_("Invalid %s in the configuration file: %s\n"), "device-level", *device_level);
+            }
         }
+    }
 
-        g_dir_close (directory);
+    if ((command_line_options & OPTION_ICON_TYPE) == 0) {
+        configuration.icon_type = default_configuration.icon_type;
+
+        value = g_key_file_get_string (key_file, CONFIGURATION_GROUP, "icon-type", NULL);
+        if (value != NULL) {
+            if (g_strcmp0 (value, "standard") == 0)
+                configuration.icon_type = BATTERY_ICON_STANDARD;
+            else if (g_strcmp0 (value, "notification") == 0)
+                configuration.icon_type = BATTERY_ICON_NOTIFICATION;
+            else if (g_strcmp0 (value, "symbolic") == 0)
+                configuration.icon_type = BATTERY_ICON_SYMBOLIC;
+            else g_printerr (_("Unknown icon type: %s\n"), value);
+
+            g_free (value);
+        }
     }
 
-    power_supplies_changed = (num_ps != old_num_ps) || (total_ps != old_total_ps);
+    if ((command_line_options & OPTION_ESTIMATOR) == 0) {
+        configuration.estimator = default_configuration.estimator;
 
-    if (configuration.debug_output == TRUE && power_supplies_changed == TRUE) {
-        g_printf ("power supplies changed: old total/num ps=%d/%d, new total/num ps=%d/%d\n",
-            old_total_ps, old_num_ps, total_ps, num_ps);
+        value = g_key_file_get_string (key_file, CONFIGURATION_GROUP, "estimator", NULL);
+        if (value != NULL) {
+            if (g_strcmp0 (value, "hybrid") == 0)
+                configuration.estimator = ESTIMATOR_HYBRID;
+            else if (g_strcmp0 (value, "ewma") == 0)
+                configuration.estimator = ESTIMATOR_EWMA;
+            else if (g_strcmp0 (value, "regression") == 0)
+                configuration.estimator = ESTIMATOR_REGRESSION;
+            else g_printerr (_("Unknown estimator: %s\n"), value);
+
+            g_free (value);
+        }
     }
 
-    old_num_ps = num_ps;
-    old_total_ps = total_ps;
+    g_key_file_free (key_file);
 
-    return power_supplies_changed;
+    if (configuration.debug_output == TRUE) {
+        g_printf ("configuration: loaded %s\n", configuration_path);
+    }
+
+    return TRUE;
 }
 
-static void get_power_supplies (void)
+static gchar** get_key_file_string_list (GKeyFile *key_file, const gchar *group, const gchar *key, GError **error)
 {
-    GError *error = NULL;
+    return g_key_file_get_string_list (key_file, group, key, NULL, error);
+}
 
-    GDir *directory;
-    const gchar *file;
-    gchar *path;
-    gchar *sysattr_value;
-    gboolean sysattr_status;
+static void reload_configuration (struct icon *tray_icon)
+{
+    struct configuration old_configuration = configuration;
+    GString *changes = g_string_new (NULL);
+    gint64 start = get_stats_time ();
+    guint i;
 
-    /* reset power supplies information */
+    configuration_changed = FALSE;
 
-    g_free (battery_path); battery_path = NULL;
-    g_free (ac_path); ac_path = NULL;
+    /* a file that cannot be parsed keeps the running configuration */
 
-    estimation_needed             = FALSE;
-    estimation_remaining_capacity = -1;
-    estimation_time               = -1;
-    if (estimation_timer != NULL) {
-        g_timer_stop (estimation_timer);
-        g_timer_destroy (estimation_timer);
-        estimation_timer = NULL;
+    if (load_configuration_file () == FALSE) {
+        g_string_free (changes, TRUE);
+        return;
     }
 
-    /* retrieve power supplies information */
+    check_configuration ();
 
-    directory = g_dir_open (SYSFS_PATH, 0, &error);
-    if (directory != NULL) {
-        file = g_dir_read_name (directory);
-        while (file != NULL) {
-            path = g_build_filename (SYSFS_PATH, file, NULL);
-            sysattr_status = get_sysattr_string (path, "type", &sysattr_value);
-            if (sysattr_status == TRUE) {
-
-                /* process battery */
-
-                if (g_str_has_prefix (sysattr_value, "Battery") == TRUE &&
-                    get_battery_present (path, NULL) == TRUE) {
-                    if (configuration.list_power_supplies == TRUE) {
-                        gchar *power_supply_id = g_path_get_basename (path);
-                        g_print (_("type: %-*.*s\tid: %-*.*s\tpath: %s\n"), 12, 12, _("Battery"), 12, 12, power_supply_id, path);
-                        g_free (power_supply_id);
-                    }
-
-                    if (battery_path == NULL) {
-                        if (battery_suffix == NULL ||
-                            g_str_has_suffix (path, battery_suffix) == TRUE) {
-                            battery_path = g_strdup (path);
-
-                            /* workaround for limited/bugged batteries/drivers */
-                            /* that don't provide current rate                 */
-
-                            if (get_battery_current_rate (FALSE, NULL) == FALSE &&
-                                get_battery_current_rate (TRUE, NULL) == FALSE) {
-                                estimation_needed = TRUE;
-                                estimation_timer = g_timer_new ();
-
-                                if (configuration.debug_output == TRUE) {
-                                    g_printf ("workaround: current rate is not available, estimating rate\n");
-                                }
-                            }
-
-                            if (configuration.debug_output == TRUE) {
-                                g_printf ("battery path: %s\n", battery_path);
-                            }
-                        }
-                    }
-                }
+    if (tray_icon->gtk_icon != NULL) {
+        check_icon_type ();
+    }
 
-                /* process AC */
+    /* only what depends on a changed option is rebuilt, the estimator and the notifications are kept */
 
-                if (g_str_has_prefix (sysattr_value, "Mains") == TRUE &&
-                    get_ac_online (path, NULL) == TRUE) {
-                    if (configuration.list_power_supplies == TRUE) {
-                        gchar *power_supply_id = g_path_get_basename (path);
-                        g_print (_("type: %-*.*s\tid: %-*.*s\tpath: %s\n"), 12, 12, _("AC"), 12, 12, power_supply_id, path);
-                        g_free (power_supply_id);
-                    }
+    if (configuration.update_interval != old_configuration.update_interval ||
+        configuration.min_interval != old_configuration.min_interval ||
+        configuration.max_interval != old_configuration.max_interval) {
+        schedule_tray_icon_update (tray_icon);
 
-                    if (ac_path == NULL) {
-                        ac_path = g_strdup (path);
+        g_string_append (changes, " timer");
+    }
 
-                        if (configuration.debug_output == TRUE) {
-                            g_printf ("ac path: %s\n", ac_path);
-                        }
-                    }
-                }
+    if (configuration.low_level != old_configuration.low_level ||
+        configuration.critical_level != old_configuration.critical_level) {
+        g_string_append (changes, " levels");
+    }
 
-                g_free (sysattr_value);
-            }
+    if (g_strcmp0 (configuration.command_low_level, old_configuration.command_low_level) != 0 ||
+        g_strcmp0 (configuration.command_critical_level, old_configuration.command_critical_level) != 0 ||
+        g_strcmp0 (configuration.command_left_click, old_configuration.command_left_click) != 0) {
+        g_string_append (changes, " commands");
+    }
 
-            g_free (path);
-            file = g_dir_read_name (directory);
+    if (configuration.icon_type != old_configuration.icon_type) {
+        flush_icon_cache ();
+        reset_tray_icon_view ();
+
+        if (configuration.prewarm_icons == TRUE && tray_icon->size > 0) {
+            prewarm_icon_cache (tray_icon->size, tray_icon->scale);
         }
 
-        g_dir_close (directory);
-    } else {
-        g_printerr (_("Cannot open sysfs directory: %s (%s)\n"), SYSFS_PATH, error->message);
-        g_error_free (error); error = NULL;
-        return;
+        g_string_append (changes, " icons");
     }
 
-    if (configuration.list_power_supplies == FALSE && battery_path == NULL) {
-        if (battery_suffix != NULL) {
-            g_printerr (_("No battery with suffix %s found!\n"), battery_suffix);
-            return;
-        }
+    if (configuration.estimator != old_configuration.estimator) {
+        g_string_append (changes, " estimator");
+    }
 
-        if (ac_path == NULL) {
-            g_printerr (_("No battery nor AC power supply found!\n"));
-            return;
-        }
+#ifdef WITH_NOTIFY
+    if (configuration.hide_notification != old_configuration.hide_notification) {
+        g_string_append (changes, " notifications");
     }
-}
+#endif
 
-static gboolean get_sysattr_string (gchar *path, gchar *attribute, gchar **value)
-{
-    gchar *sysattr_filename;
-    gboolean sysattr_status;
+    for (i = 0; devices != NULL && i < devices->len; i++) {
+        struct device *device = g_ptr_array_index (devices, i);
+        gint low_level = get_device_low_level (device->path);
 
-    g_return_val_if_fail (path != NULL, FALSE);
-    g_return_val_if_fail (attribute != NULL, FALSE);
-    g_return_val_if_fail (value != NULL, FALSE);
+        if (device->low_level != low_level) {
+            device->low_level = low_level;
+            device->low       = FALSE;
 
-    sysattr_filename = g_build_filename (path, attribute, NULL);
-    sysattr_status = g_file_get_contents (sysattr_filename, value, NULL, NULL);
-    g_free (sysattr_filename);
+            if (strstr (changes->str, " devices") == NULL) {
+                g_string_append (changes, " devices");
+            }
+        }
+    }
 
-    return sysattr_status;
-}
+    /* the strings of the file replaced by this reload, the ones of the command line are never replaced */
 
-static gboolean get_sysattr_double (gchar *path, gchar *attribute, gdouble *value)
-{
-    gchar *sysattr_filename, *sysattr_value;
-    gboolean sysattr_status;
+    #define FREE_REPLACED_CONFIGURATION(FIELD,FREE)                                                              \
+                                                                                                                \
+            if (old_configuration.FIELD != configuration.FIELD) {                                               \
+                FREE (old_configuration.FIELD);                                                                 \
+            }
 
-    g_return_val_if_fail (path != NULL, FALSE);
-    g_return_val_if_fail (attribute != NULL, FALSE);
+    FREE_REPLACED_CONFIGURATION (command_low_level     , g_free)
+    FREE_REPLACED_CONFIGURATION (command_critical_level, g_free)
+    FREE_REPLACED_CONFIGURATION (command_left_click    , g_free)
+    FREE_REPLACED_CONFIGURATION (device_levels         , g_strfreev)
 
-    sysattr_filename = g_build_filename (path, attribute, NULL);
-    sysattr_status = g_file_get_contents (sysattr_filename, &sysattr_value, NULL, NULL);
-    g_free (sysattr_filename);
+    if (configuration.debug_output == TRUE) {
+        g_printf ("configuration: reloaded in %.1f us, rebuilt:%s\n", (get_stats_time () - start) / 1e3,
+            changes->len > 0 ? changes->str : " nothing");
+    }
 
-    if (sysattr_status == TRUE) {
-        gdouble double_value = g_ascii_strtod (sysattr_value, NULL);
+    g_string_free (changes, TRUE);
+}
 
-        if (errno != 0 || double_value < 0.01) {
-            sysattr_status = FALSE;
-        }
+static void create_configuration_monitor (struct icon *tray_icon)
+{
+    GError *error = NULL;
+    GFile *file;
 
-        if (value != NULL) {
-            *value = double_value;
+    file = g_file_new_for_path (configuration_path);
+    configuration_monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE, NULL, &error);
+    g_object_unref (file);
+
+    if (configuration_monitor == NULL) {
+        if (configuration.debug_output == TRUE) {
+            g_printf ("configuration: cannot monitor %s (%s)\n", configuration_path, error->message);
         }
 
-        g_free (sysattr_value);
+        g_error_free (error); error = NULL;
+        return;
     }
 
-    return sysattr_status;
+    g_signal_connect (G_OBJECT (configuration_monitor), "changed", G_CALLBACK (on_configuration_changed), (gpointer)tray_icon);
 }
 
-static gboolean get_ac_online (gchar *path, gboolean *online)
+static void on_configuration_changed (GFileMonitor *monitor, GFile *file, GFile *other_file, GFileMonitorEvent event, struct icon *tray_icon)
 {
-    gchar *sysattr_value;
-    gboolean sysattr_status;
-
-    if (path == NULL) {
-        return FALSE;
+    if (event != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+        event != G_FILE_MONITOR_EVENT_CREATED &&
+        event != G_FILE_MONITOR_EVENT_DELETED) {
+        return;
     }
 
-    sysattr_status = get_sysattr_string (path, "online", &sysattr_value);
-    if (sysattr_status == TRUE) {
-        if (online != NULL) {
-            *online = g_str_has_prefix (sysattr_value, "1") ? TRUE : FALSE;
-        }
+    /* the reload is applied at the start of an update, which is brought forward */
 
-        if (configuration.debug_output == TRUE) {
-            g_printf ("ac online: %s", sysattr_value);
-        }
+    configuration_changed = TRUE;
 
-        g_free (sysattr_value);
+    if (configuration_source == 0) {
+        configuration_source = g_timeout_add (CONFIGURATION_RELOAD_DELAY, (GSourceFunc)on_configuration_timeout, (gpointer)tray_icon);
     }
+}
 
-    return sysattr_status;
+static gboolean on_configuration_timeout (struct icon *tray_icon)
+{
+    configuration_source = 0;
+
+    update_tray_icon (tray_icon);
+
+    return FALSE;
 }
 
-static gboolean get_battery_present (gchar *path, gboolean *present)
+static gint get_icon_types (void)
 {
-    gchar *sysattr_value;
-    gboolean sysattr_status;
+    static gint icon_types = -1;
 
-    if (path == NULL) {
-        return FALSE;
+    GtkIconTheme *icon_theme;
+    gchar *path, *key, *contents, *cache;
+
+    if (icon_types >= 0) {
+        return icon_types;
     }
 
-    sysattr_status = get_sysattr_string (path, "present", &sysattr_value);
-    if (sysattr_status == TRUE) {
-        if (present != NULL) {
-            *present = g_str_has_prefix (sysattr_value, "1") ? TRUE : FALSE;
-        }
+    /*
+     * the icon types are probed once in the icon theme, and the result is cached on disk
+     * until the icon theme name, or the modification time of one of its directories or of their index files, changes
+     */
 
-        if (configuration.debug_output == TRUE) {
-            g_printf ("battery present: %s", sysattr_value);
+    key  = get_icon_types_cache_key ();
+    path = g_build_filename (g_get_user_cache_dir (), CBATTICON_STRING, ICON_TYPES_CACHE_FILE, NULL);
+
+    if (g_file_get_contents (path, &contents, NULL, NULL) == TRUE) {
+        gchar *value = strchr (contents, '\n');
+
+        if (value != NULL) {
+            *value++ = '\0';
+
+            if (g_strcmp0 (contents, key) == 0) {
+                icon_types = (gint)g_ascii_strtoll (value, NULL, 10);
+            }
         }
 
-        g_free (sysattr_value);
+        g_free (contents);
     }
 
-    return sysattr_status;
+    if (icon_types < 0) {
+        icon_theme = gtk_icon_theme_get_default ();
+        icon_types = 0;
+
+        if (gtk_icon_theme_has_icon (icon_theme, "battery-full") == TRUE)
+            icon_types |= 1 << BATTERY_ICON_STANDARD;
+        if (gtk_icon_theme_has_icon (icon_theme, "notification-battery-100") == TRUE)
+            icon_types |= 1 << BATTERY_ICON_NOTIFICATION;
+        if (gtk_icon_theme_has_icon (icon_theme, "battery-full-symbolic") == TRUE)
+            icon_types |= 1 << BATTERY_ICON_SYMBOLIC;
+
+        cache = g_path_get_dirname (path);
+        g_mkdir_with_parents (cache, 0700);
+        g_free (cache);
+
+        contents = g_strdup_printf ("%s\n%d\n", key, icon_types);
+        g_file_set_contents (path, contents, -1, NULL);
+        g_free (contents);
+    } else if (configuration.debug_output == TRUE) {
+        g_printf ("icon types: cached in %s\n", path);
+    }
+
+    g_free (key);
+    g_free (path);
+
+    return icon_types;
 }
 
-static gboolean get_battery_status (gint *status)
+static void append_icon_types_cache_key (GString *key, const gchar *path)
 {
-    gchar *sysattr_value;
-    gboolean sysattr_status;
+    GStatBuf status;
 
-    g_return_val_if_fail (status != NULL, FALSE);
+    if (g_stat (path, &status) == 0) {
+        g_string_append_printf (key, ":%s=%ld,%ld", path, (glong)status.st_mtime, (glong)status.st_size);
+    }
+}
 
-    sysattr_status = get_sysattr_string (battery_path, "status", &sysattr_value);
-    if (sysattr_status == TRUE) {
-        if (g_str_has_prefix (sysattr_value, "Charging") == TRUE)
-            *status = CHARGING;
-        else if (g_str_has_prefix (sysattr_value, "Discharging") == TRUE)
-            *status = DISCHARGING;
-        else if (g_str_has_prefix (sysattr_value, "Not charging") == TRUE)
-            *status = NOTCHARGING;
-        else if (g_str_has_prefix (sysattr_value, "Full") == TRUE)
-            *status = CHARGED;
-        else
-            *status = UNKNOWN;
+static void append_icon_theme_cache_key (GString *key, const gchar *directory)
+{
+    gchar *path;
 
-        if (configuration.debug_output == TRUE) {
-            g_printf ("battery status: %d - %s", *status, sysattr_value);
-        }
+    /* the icons installed in the subdirectories of a theme are indexed by its index.theme and icon-theme.cache */
 
-        g_free (sysattr_value);
-    }
+    append_icon_types_cache_key (key, directory);
 
-    return sysattr_status;
+    path = g_build_filename (directory, "index.theme", NULL);
+    append_icon_types_cache_key (key, path);
+    g_free (path);
+
+    path = g_build_filename (directory, "icon-theme.cache", NULL);
+    append_icon_types_cache_key (key, path);
+    g_free (path);
 }
 
-static gboolean get_battery_full_capacity (gboolean *use_charge, gdouble *capacity)
+static gchar* get_icon_types_cache_key (void)
 {
-    gboolean sysattr_status;
+    static const gchar *fallback_theme = "hicolor";
 
-    g_return_val_if_fail (use_charge != NULL, FALSE);
-    g_return_val_if_fail (capacity != NULL, FALSE);
+    GString *key;
+    gchar *theme_name = NULL, **search_path, *directory;
+    gint search_path_length, i;
 
-    sysattr_status = get_sysattr_double (battery_path, "energy_full", capacity);
-    *use_charge = FALSE;
+    g_object_get (gtk_settings_get_default (), "gtk-icon-theme-name", &theme_name, NULL);
+    gtk_icon_theme_get_search_path (gtk_icon_theme_get_default (), &search_path, &search_path_length);
 
-    if (sysattr_status == FALSE) {
-        sysattr_status = get_sysattr_double (battery_path, "charge_full", capacity);
-        *use_charge = TRUE;
+    key = g_string_new (theme_name);
+
+    /* a new theme changes the search path directories, new icons change the theme directories and their indexes */
+
+    for (i = 0; i < search_path_length; i++) {
+        append_icon_types_cache_key (key, search_path[i]);
+
+        if (theme_name != NULL) {
+            directory = g_build_filename (search_path[i], theme_name, NULL);
+            append_icon_theme_cache_key (key, directory);
+            g_free (directory);
+        }
+
+        directory = g_build_filename (search_path[i], fallback_theme, NULL);
+        append_icon_theme_cache_key (key, directory);
+        g_free (directory);
     }
 
-    return sysattr_status;
+    g_strfreev (search_path);
+    g_free (theme_name);
+
+    return g_string_free (key, FALSE);
 }
 
-static gboolean get_battery_remaining_capacity (gboolean use_charge, gdouble *capacity)
+static void profile_startup (const gchar *phase)
 {
-    g_return_val_if_fail (capacity != NULL, FALSE);
+    static gint64 last_time = 0;
+    gint64 now;
 
-    if (use_charge == FALSE) {
-        return get_sysattr_double (battery_path, "energy_now", capacity);
-    } else {
-        return get_sysattr_double (battery_path, "charge_now", capacity);
+    if (configuration.startup_profile == FALSE) {
+        return;
     }
-}
 
-static gboolean get_battery_remaining_capacity_pct (gdouble *capacity)
-{
-    g_return_val_if_fail (capacity != NULL, FALSE);
+    now = g_get_monotonic_time ();
+    if (last_time == 0) {
+        last_time = startup_time;
+    }
+
+    g_printf ("startup: %-16s %8.3f ms (+%.3f ms)\n", phase, (now - startup_time) / 1000.0, (now - last_time) / 1000.0);
 
-    return get_sysattr_double (battery_path, "capacity", capacity);
+    last_time = now;
 }
 
-static gboolean get_battery_current_rate (gboolean use_charge, gdouble *rate)
+static gboolean on_startup_idle (gpointer user_data)
 {
-    if (use_charge == FALSE) {
-        return get_sysattr_double (battery_path, "power_now", rate);
-    } else {
-        return get_sysattr_double (battery_path, "current_now", rate);
-    }
+    /* the idle sources run once the first icon is drawn */
+
+    profile_startup ("first icon");
+
+    return FALSE;
 }
 
 /*
- * computation functions
+ * sysfs functions
  */
 
-static gboolean get_battery_charge (gboolean remaining, gint *percentage, gint *time)
+static gboolean changed_power_supplies (void)
 {
-    gdouble full_capacity, remaining_capacity, current_rate;
-    gboolean use_charge;
+    GDir *directory;
+    const gchar *file;
 
-    g_return_val_if_fail (percentage != NULL, FALSE);
+    static gint old_num_ps = 0;
+    static gint old_total_ps = 0;
+    gint num_ps = 0;
+    gint total_ps = 0;
+    gboolean power_supplies_changed;
+
+    /* an attribute handle failed, the power supply has disappeared */
+
+    if (sysattrs_invalidated == TRUE) {
+        sysattrs_invalidated = FALSE;
 
-    if (get_battery_full_capacity (&use_charge, &full_capacity) == FALSE) {
         if (configuration.debug_output == TRUE) {
-            g_printf ("full capacity: %s\n", "unavailable");
+            g_printf ("power supplies changed: attribute handle invalidated\n");
         }
 
-        return FALSE;
+        return TRUE;
     }
 
-    if (get_battery_remaining_capacity (use_charge, &remaining_capacity) == FALSE) {
-        if (get_battery_remaining_capacity_pct (&remaining_capacity) == FALSE) {
-            if (configuration.debug_output == TRUE) {
-                g_printf ("remaining capacity: %s\n", "unavailable");
-            }
+#ifdef WITH_TRACE
+    /* replay, the power supplies change with each scan of the trace */
 
-            return FALSE;
+    if (replay_data != NULL) {
+        return get_replay_power_supplies_changed ();
+    }
+#endif
+
+#ifdef WITH_UPOWER
+    /* with UPower, only the DeviceAdded/DeviceRemoved signals can change the power supplies */
+
+    if (configuration.backend == BACKEND_UPOWER) {
+        power_supplies_changed = get_upower_power_supplies_changed ();
+
+        if (configuration.debug_output == TRUE && power_supplies_changed == TRUE) {
+            g_printf ("power supplies changed: upower\n");
         }
 
-        /* remaining capacity is percentage, compute the actual remaining capacity */
-        remaining_capacity *= full_capacity / 100.0;
+        return power_supplies_changed;
     }
+#endif
 
-    *percentage = (gint)fmin (floor (remaining_capacity / full_capacity * 100.0), 100.0);
+    /* with uevent monitoring, only add/remove events can change the power supplies */
 
-    if (time == NULL) {
-        return TRUE;
-    }
+    if (uevent_source != 0) {
+        power_supplies_changed = uevent_power_supplies_changed;
+        uevent_power_supplies_changed = FALSE;
 
-    if (estimation_needed == TRUE) {
-        if (remaining == TRUE) {
-            return get_battery_time_estimation (remaining_capacity, 0, time);
-        } else {
-            return get_battery_time_estimation (remaining_capacity, full_capacity, time);
+        if (configuration.debug_output == TRUE && power_supplies_changed == TRUE) {
+            g_printf ("power supplies changed: uevent\n");
         }
+
+        return power_supplies_changed;
     }
 
-    if (get_battery_current_rate (use_charge, &current_rate) == FALSE) {
-        if (configuration.debug_output == TRUE) {
-            g_printf ("current rate: %s\n", "unavailable");
+    directory = g_dir_open (sysfs_path, 0, NULL);
+    if (directory != NULL) {
+        stats.files_opened++;
+
+        file = g_dir_read_name (directory);
+        while (file != NULL) {
+            if (ac_path != NULL && g_str_has_suffix (ac_path, file) == TRUE) {
+                num_ps++;
+            }
+
+            if (is_battery_name (file) == TRUE) {
+                num_ps++;
+            }
+
+            total_ps++;
+
+            file = g_dir_read_name (directory);
         }
 
-        return FALSE;
+        g_dir_close (directory);
     }
 
-    if (remaining == TRUE) {
-        *time = (gint)(remaining_capacity / current_rate * 60.0);
-    } else {
-        *time = (gint)((full_capacity - remaining_capacity) / current_rate * 60.0);
+    power_supplies_changed = (num_ps != old_num_ps) || (total_ps != old_total_ps);
+
+    if (configuration.debug_output == TRUE && power_supplies_changed == TRUE) {
+        g_printf ("power supplies changed: old total/num ps=%d/%d, new total/num ps=%d/%d\n",
+            old_total_ps, old_num_ps, total_ps, num_ps);
     }
 
-    return TRUE;
+    old_num_ps = num_ps;
+    old_total_ps = total_ps;
+
+    return power_supplies_changed;
 }
 
-static gboolean get_battery_time_estimation (gdouble remaining_capacity, gdouble y, gint *time)
+static void get_power_supplies (void)
 {
-    if (estimation_remaining_capacity == -1) {
-        estimation_remaining_capacity = remaining_capacity;
-    }
+    GError *error = NULL;
 
-    /*
-     * y = mx + b ... x = (y - b) / m
-     * solving for when y = 0 (discharging) or full_capacity (charging)
-     */
+    GDir *directory;
+    const gchar *file;
+    GArray *trace_scan = NULL;
 
-    if (remaining_capacity != estimation_remaining_capacity) {
-        gdouble estimation_elapsed = g_timer_elapsed (estimation_timer, NULL);
-        gdouble estimation_current_rate = (remaining_capacity - estimation_remaining_capacity) / estimation_elapsed;
-        gdouble estimation_seconds = (y - remaining_capacity) / estimation_current_rate;
+    /* reset power supplies information */
 
-        *time = (gint)(estimation_seconds / 60.0);
+    if (batteries == NULL) {
+        batteries = g_ptr_array_new_with_free_func ((GDestroyNotify)free_battery);
+    } else {
+        g_ptr_array_set_size (batteries, 0);
+    }
 
-        estimation_remaining_capacity = remaining_capacity;
-        estimation_time               = *time;
-        g_timer_start (estimation_timer);
+    if (ac_path != NULL) {
+        close_sysattrs (&ac_sysattrs);
     } else {
-        *time = estimation_time;
+        clear_sysattrs (&ac_sysattrs);
+    }
+
+    g_free (battery_path); battery_path = NULL;
+    g_free (ac_path); ac_path = NULL;
+
+    if (devices == NULL) {
+        devices = g_ptr_array_new_with_free_func ((GDestroyNotify)free_device);
+    } else {
+        g_ptr_array_set_size (devices, 0);
+    }
+
+    estimation_needed = FALSE;
+    reset_battery_time_estimation ();
+
+    uevent_battery_changes = FALSE;
+
+    /* retrieve power supplies information */
+
+#ifdef WITH_UPOWER
+    if (configuration.backend == BACKEND_UPOWER && open_upower () == FALSE) {
+        configuration.backend = BACKEND_SYSFS;
+    }
+#endif
+
+    if (configuration.backend == BACKEND_UPOWER) {
+#ifdef WITH_UPOWER
+        get_upower_power_supplies ();
+#endif
+#ifdef WITH_TRACE
+    } else if (replay_data != NULL) {
+        const gchar *name;
+        guint i;
+
+        /* the power supplies of the last scan of the trace */
+
+        for (i = 0; (name = get_replay_scan_supply (i)) != NULL; i++) {
+            scan_power_supply (name, NULL);
+        }
+#endif
+    } else {
+        directory = g_dir_open (sysfs_path, 0, &error);
+        if (directory == NULL) {
+            g_printerr (_("Cannot open sysfs directory: %s (%s)\n"), sysfs_path, error->message);
+            g_error_free (error); error = NULL;
+            return;
+        }
+
+        stats.files_opened++;
+
+#ifdef WITH_TRACE
+        if (trace_fd >= 0) {
+            trace_scan = g_array_new (FALSE, FALSE, sizeof (gint));
+        }
+#endif
+
+        file = g_dir_read_name (directory);
+        while (file != NULL) {
+            scan_power_supply (file, trace_scan);
+            file = g_dir_read_name (directory);
+        }
+
+        g_dir_close (directory);
+
+#ifdef WITH_TRACE
+        if (trace_scan != NULL) {
+            add_trace_scan (trace_scan);
+            g_array_free (trace_scan, TRUE);
+        }
+#endif
+    }
+
+    /* workaround for limited/bugged batteries/drivers */
+    /* that don't provide current rate                 */
+
+    if (batteries->len > 0) {
+        gboolean current_rate = FALSE;
+        guint i;
+
+        for (i = 0; i < batteries->len; i++) {
+            struct battery *battery = g_ptr_array_index (batteries, i);
+
+            if (get_battery_current_rate (&battery->sysattrs, FALSE, NULL) == TRUE ||
+                get_battery_current_rate (&battery->sysattrs, TRUE, NULL) == TRUE) {
+                current_rate = TRUE;
+            }
+        }
+
+        if (current_rate == FALSE) {
+            estimation_needed = TRUE;
+
+            if (configuration.debug_output == TRUE) {
+                g_printf ("workaround: current rate is not available, estimating rate\n");
+            }
+        }
+    }
+
+    /* failures of the candidates handles above do not invalidate the new handles */
+
+    sysattrs_invalidated = FALSE;
+
+    /* the sampler thread reads the new handles from its next sample on */
+
+    if (sampler_thread != NULL) {
+        set_sampler_job ();
+    }
+
+    if (devices->len > 0) {
+        schedule_device_update ();
+    }
+
+    if (configuration.list_power_supplies == FALSE && battery_path == NULL) {
+        if (battery_suffix != NULL) {
+            g_printerr (_("No battery with suffix %s found!\n"), battery_suffix);
+            return;
+        }
+
+        if (ac_path == NULL) {
+            g_printerr (_("No battery nor AC power supply found!\n"));
+            return;
+        }
+    }
+}
+
+static void scan_power_supply (const gchar *file, GArray *trace_scan)
+{
+    gchar *path;
+    gchar sysattr_value[SYSATTR_LTH];
+    gchar scope_value[SYSATTR_LTH];
+    gchar model_value[SYSATTR_LTH];
+    struct sysattrs sysattrs;
+
+    path = g_build_filename (sysfs_path, file, NULL);
+
+#ifdef WITH_TRACE
+    if (trace_scan != NULL) {
+        gint supply = get_trace_supply (path);
+
+        g_array_append_val (trace_scan, supply);
+    }
+#endif
+
+    if (read_sysfile (path, "type", sysattr_value, SYSATTR_LTH) == TRUE) {
+        open_sysattrs (path, &sysattrs);
+
+        /* the batteries of the peripherals (scope Device), USB ports, UPS... do not power the system */
+
+        if ((g_str_has_prefix (sysattr_value, "Battery") == TRUE || g_str_has_prefix (sysattr_value, "Mains") == TRUE) &&
+            (read_sysfile (path, "scope", scope_value, SYSATTR_LTH) == FALSE || g_strcmp0 (scope_value, "Device") != 0)) {
+            add_power_supply (path, sysattr_value, &sysattrs);
+        } else {
+            if (read_sysfile (path, "model_name", model_value, SYSATTR_LTH) == FALSE || model_value[0] == '\0') {
+                g_strlcpy (model_value, file, SYSATTR_LTH);
+            }
+
+            add_device (path, model_value, g_str_has_prefix (sysattr_value, "Battery") == TRUE ? "Device" : sysattr_value, &sysattrs);
+        }
+
+        close_sysattrs (&sysattrs);
+    }
+
+    g_free (path);
+}
+
+static void add_power_supply (const gchar *path, const gchar *type, struct sysattrs *sysattrs)
+{
+    /* the power supply takes over the attribute handles when it is kept, they are cleared from sysattrs */
+
+    /* process battery */
+
+    if (g_str_has_prefix (type, "Battery") == TRUE &&
+        get_battery_present (sysattrs, NULL) == TRUE) {
+        if (configuration.list_power_supplies == TRUE) {
+            gchar *power_supply_id = g_path_get_basename (path);
+            g_print (_("type: %-*.*s\tid: %-*.*s\tpath: %s\n"), 12, 12, _("Battery"), 12, 12, power_supply_id, path);
+            g_free (power_supply_id);
+        }
+
+        if (battery_path == NULL || configuration.aggregate_batteries == TRUE) {
+            if (battery_suffix == NULL ||
+                g_str_has_suffix (path, battery_suffix) == TRUE) {
+                struct battery *battery = g_new0 (struct battery, 1);
+
+                battery->path = g_strdup (path);
+                battery->sysattrs = *sysattrs;
+                battery->sysattrs.caches = g_new0 (struct sysattr_cache, SYSATTR_COUNT);
+                clear_sysattrs (sysattrs);
+                g_ptr_array_add (batteries, battery);
+
+                if (battery_path == NULL) {
+                    battery_path = g_strdup (path);
+                }
+
+                if (configuration.debug_output == TRUE) {
+                    g_printf ("battery path: %s\n", battery->path);
+                }
+            }
+        }
+    }
+
+    /* process AC */
+
+    if (g_str_has_prefix (type, "Mains") == TRUE &&
+        get_ac_online (sysattrs, NULL) == TRUE) {
+        if (configuration.list_power_supplies == TRUE) {
+            gchar *power_supply_id = g_path_get_basename (path);
+            g_print (_("type: %-*.*s\tid: %-*.*s\tpath: %s\n"), 12, 12, _("AC"), 12, 12, power_supply_id, path);
+            g_free (power_supply_id);
+        }
+
+        if (ac_path == NULL) {
+            ac_path = g_strdup (path);
+            ac_sysattrs = *sysattrs;
+            ac_sysattrs.caches = g_new0 (struct sysattr_cache, SYSATTR_COUNT);
+            clear_sysattrs (sysattrs);
+
+            if (configuration.debug_output == TRUE) {
+                g_printf ("ac path: %s\n", ac_path);
+            }
+        }
+    }
+}
+
+static void free_battery (struct battery *battery)
+{
+    close_sysattrs (&battery->sysattrs);
+    g_free (battery->path);
+    g_free (battery);
+}
+
+static gboolean is_battery_name (const gchar *name)
+{
+    guint i;
+
+    if (batteries == NULL) {
+        return FALSE;
+    }
+
+    for (i = 0; i < batteries->len; i++) {
+        struct battery *battery = g_ptr_array_index (batteries, i);
+
+        if (g_str_has_suffix (battery->path, name) == TRUE) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/*
+ * attribute cache functions
+ */
+
+static gint get_sysattr_cache_policy (gint attribute, gboolean events)
+{
+    /* without uevents, nothing tells when an attribute refreshed on events changes */
+
+    if (sysattr_cache_policies[attribute] == CACHE_POLICY_EVENT && events == FALSE) {
+        return CACHE_POLICY_TICK;
+    }
+
+    return sysattr_cache_policies[attribute];
+}
+
+static gboolean get_cached_sysattr (struct sysattr_cache *cache, gint attribute, guint tick, gint epoch, gboolean events, gint64 now, gchar *value, gsize size, struct sysattr_cache_counters *counters)
+{
+    gboolean valid;
+
+    if (cache->tick == 0) {
+        return FALSE;
+    }
+
+    switch (get_sysattr_cache_policy (attribute, events)) {
+        case CACHE_POLICY_EVENT:
+            valid = cache->epoch == epoch;
+            break;
+
+        case CACHE_POLICY_TTL:
+            valid = cache->epoch == epoch && now < cache->expiry;
+            break;
+
+        default:
+            valid = FALSE;
+            break;
+    }
+
+    /* whatever its policy, an attribute is read once per tick */
+
+    if (valid == FALSE && cache->tick != tick) {
+        return FALSE;
+    }
+
+    g_strlcpy (value, cache->value, size);
+    counters->hits++;
+
+    return TRUE;
+}
+
+static void set_cached_sysattr (struct sysattr_cache *cache, guint tick, gint epoch, gint64 now, gint64 latency, const gchar *value, struct sysattr_cache_counters *counters)
+{
+    gint64 ttl_max;
+
+    counters->reads++;
+    counters->latency += latency;
+
+    cache->latency = cache->tick != 0 ? (cache->latency * 3 + latency) / 4 : latency;
+
+    /* an attribute that does not change is read less and less often, the slow ones even less */
+
+    if (cache->tick != 0 && g_strcmp0 (cache->value, value) == 0) {
+        ttl_max = (cache->latency >= CACHE_SLOW_READ ? CACHE_TTL_MAX_SLOW : CACHE_TTL_MAX) * G_USEC_PER_SEC;
+        cache->ttl = MIN (cache->ttl * 2, ttl_max);
+    } else {
+        cache->ttl = CACHE_TTL_MIN * G_USEC_PER_SEC;
+    }
+
+    cache->tick   = tick;
+    cache->epoch  = epoch;
+    cache->expiry = now + cache->ttl;
+    g_strlcpy (cache->value, value, SYSATTR_LTH);
+}
+
+static void invalidate_sysattr_caches (void)
+{
+    /* the attributes refreshed on events or after a TTL are read again by the next sample, on both sides of the sampler thread */
+
+    sysattr_cache_epoch++;
+}
+
+static void add_sysattr_cache_counters (struct sysattr_cache_counters *counters, const struct sysattr_cache_counters *other)
+{
+    gint attribute;
+
+    for (attribute = 0; attribute < SYSATTR_COUNT; attribute++) {
+        counters[attribute].hits    += other[attribute].hits;
+        counters[attribute].reads   += other[attribute].reads;
+        counters[attribute].latency += other[attribute].latency;
+    }
+}
+
+static void append_sysattr_cache_counters (GString *report, const gchar *prefix, const gchar *separator)
+{
+    struct sysattr_cache_counters *counters;
+    gboolean first = TRUE;
+    guint64 total;
+    gint attribute;
+
+    for (attribute = 0; attribute < SYSATTR_COUNT; attribute++) {
+        counters = &sysattr_cache_counters[attribute];
+        total    = counters->hits + counters->reads;
+
+        if (total == 0) {
+            continue;
+        }
+
+        g_string_append_printf (report, "%s%s%s: %.0f%% hits (%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT ")",
+            first == TRUE ? "" : separator, prefix, sysattr_names[attribute], counters->hits * 100.0 / total, counters->hits, total);
+
+        if (counters->reads > 0) {
+            g_string_append (report, ", mean read ");
+            append_stats_latency (report, counters->latency / counters->reads);
+        }
+
+        first = FALSE;
+    }
+}
+
+/*
+ * device functions
+ */
+
+static void add_device (const gchar *path, const gchar *name, const gchar *type, struct sysattrs *sysattrs)
+{
+    struct device *device;
+
+    /* the device takes over the attribute handles when it is kept, they are cleared from sysattrs */
+
+    if (configuration.list_power_supplies == TRUE) {
+        gchar *power_supply_id = g_path_get_basename (path);
+        g_print (_("type: %-*.*s\tid: %-*.*s\tpath: %s\n"), 12, 12, type, 12, 12, power_supply_id, path);
+        g_free (power_supply_id);
+        return;
+    }
+
+    if (configuration.devices == FALSE) {
+        return;
+    }
+
+    device = g_new0 (struct device, 1);
+    device->path        = g_strdup (path);
+    device->name        = g_strdup (name);
+    device->type        = g_strdup (type);
+    device->sysattrs    = *sysattrs;
+    device->low_level   = get_device_low_level (path);
+    device->percentage  = -1;
+    device->status      = -1;
+    device->interval    = DEVICE_MIN_INTERVAL;
+    device->next_sample = 0;
+    clear_sysattrs (sysattrs);
+    g_ptr_array_add (devices, device);
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("device path: %s (%s, %s, low level %d)\n", device->path, device->type, device->name, device->low_level);
+    }
+}
+
+static void free_device (struct device *device)
+{
+    close_sysattrs (&device->sysattrs);
+    g_free (device->path);
+    g_free (device->name);
+    g_free (device->type);
+    g_free (device);
+}
+
+static gint get_device_low_level (const gchar *path)
+{
+    gchar **device_level;
+    gint low_level = DEFAULT_DEVICE_LOW_LEVEL;
+
+    if (configuration.device_levels == NULL) {
+        return low_level;
+    }
+
+    /* the last matching ID=PERCENT wins, the invalid ones are reported by get_options */
+
+    for (device_level = configuration.device_levels; *device_level != NULL; device_level++) {
+        gchar *id;
+        gint level;
+
+        if (parse_device_level (*device_level, &id, &level) == FALSE) {
+            continue;
+        }
+
+        if (g_str_has_suffix (path, id) == TRUE) {
+            low_level = level;
+        }
+
+        g_free (id);
+    }
+
+    return low_level;
+}
+
+static gboolean parse_device_level (const gchar *device_level, gchar **id, gint *level)
+{
+    const gchar *percent = strchr (device_level, '=');
+    gchar *end;
+    gint64 value;
+
+    /* ID=PERCENT, the id is a suffix of the device path */
+
+    if (percent == NULL || percent == device_level || percent[1] == '\0') {
+        return FALSE;
+    }
+
+    value = g_ascii_strtoll (percent + 1, &end, 10);
+    if (*end != '\0' || value < 0 || value > 100) {
+        return FALSE;
+    }
+
+    if (id != NULL) {
+        *id = g_strndup (device_level, percent - device_level);
+    }
+
+    if (level != NULL) {
+        *level = (gint)value;
     }
 
     return TRUE;
 }
 
-static void reset_battery_time_estimation (void)
+static void sample_device (struct device *device, gint64 now)
+{
+    gint percentage = -1, status = -1;
+    gboolean online = FALSE, changed;
+    gdouble capacity;
+
+    /* a fresh sample of the device, it is not part of the sample of the system battery */
+
+    device->sysattrs.sample_tick = 0;
+
+    if (get_battery_remaining_capacity_pct (&device->sysattrs, &capacity) == TRUE) {
+        percentage = CLAMP ((gint)capacity, 0, 100);
+    }
+
+    if (get_battery_status (&device->sysattrs, &status) == FALSE) {
+        status = -1;
+    }
+
+    get_ac_online (&device->sysattrs, &online);
+
+    /* a device that does not change is sampled less and less often, its uevents or signals still wake it up */
+
+    changed = percentage != device->percentage || status != device->status || online != device->online;
+
+    device->interval    = changed == TRUE ? DEVICE_MIN_INTERVAL : MIN (device->interval * 2, DEVICE_MAX_INTERVAL);
+    device->next_sample = now + device->interval * G_USEC_PER_SEC;
+    device->percentage  = percentage;
+    device->status      = status;
+    device->online      = online;
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("device: %s, percentage %d, status %d, online %d, next sample in %d seconds\n",
+            device->name, percentage, status, online, device->interval);
+    }
+
+    if (percentage < 0 || device->low_level <= 0) {
+        return;
+    }
+
+    if (percentage > device->low_level || status == CHARGING || status == CHARGED) {
+        device->low = FALSE;
+    } else if (device->low == FALSE) {
+        device->low = TRUE;
+
+#ifdef WITH_NOTIFY
+        {
+            NotifyNotification **notification;
+            gchar *summary;
+
+            if (device_notifications == NULL) {
+                device_notifications = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+            }
+
+            notification = g_hash_table_lookup (device_notifications, device->path);
+            if (notification == NULL) {
+                notification = g_new0 (NotifyNotification *, 1);
+                g_hash_table_insert (device_notifications, g_strdup (device->path), notification);
+            }
+
+            summary = g_strdup_printf (_("%s: low battery level (%d%%)"), device->name, percentage);
+            NOTIFY_MESSAGE (notification, summary, NULL, NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_NORMAL);
+            g_free (summary);
+        }
+#endif
+    }
+}
+
+static void schedule_device_update (void)
+{
+    gint64 now = get_monotonic_time ();
+    gint64 next_sample = G_MAXINT64;
+    guint i;
+
+    for (i = 0; i < devices->len; i++) {
+        struct device *device = g_ptr_array_index (devices, i);
+        next_sample = MIN (next_sample, device->next_sample);
+    }
+
+    if (device_source != 0) {
+        remove_timeout (device_source);
+        device_source = 0;
+    }
+
+    if (next_sample == G_MAXINT64) {
+        return;
+    }
+
+    /* the due devices are sampled together, the events of a change are coalesced and the rest is grouped with other wakeups */
+
+    if (next_sample <= now) {
+        device_source = add_timeout (UEVENT_COALESCE_DELAY, on_device_timeout, NULL);
+    } else {
+        device_source = add_timeout_seconds ((guint)((next_sample - now + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC), on_device_timeout, NULL);
+    }
+}
+
+static gboolean on_device_timeout (gpointer user_data)
+{
+    gint64 now = get_monotonic_time ();
+    guint i;
+
+    device_source = 0;
+
+    /* the timer of g_timeout_add_seconds may fire up to one second early */
+
+    for (i = 0; i < devices->len; i++) {
+        struct device *device = g_ptr_array_index (devices, i);
+
+        if (device->next_sample <= now + G_USEC_PER_SEC) {
+            sample_device (device, now);
+        }
+    }
+
+    schedule_device_update ();
+
+    return FALSE;
+}
+
+static gboolean mark_device_changed (const gchar *name)
+{
+    gsize length = strlen (name);
+    gboolean found = FALSE;
+    guint i;
+
+    if (devices == NULL) {
+        return FALSE;
+    }
+
+    /* name is the id of a sysfs power supply or the object path of a UPower device */
+
+    for (i = 0; i < devices->len; i++) {
+        struct device *device = g_ptr_array_index (devices, i);
+        gsize path_length = strlen (device->path);
+
+        if (g_str_has_suffix (device->path, name) == TRUE &&
+            (path_length == length || device->path[path_length - length - 1] == '/')) {
+            device->interval    = DEVICE_MIN_INTERVAL;
+            device->next_sample = 0;
+            found = TRUE;
+        }
+    }
+
+    if (found == TRUE) {
+        schedule_device_update ();
+    }
+
+    return found;
+}
+
+static gchar* get_device_string (struct device *device)
+{
+    if (device->percentage >= 0 && device->status == CHARGING)
+        return g_strdup_printf (_("%s: %d%%, charging"), device->name, device->percentage);
+    else if (device->percentage >= 0)
+        return g_strdup_printf (_("%s: %d%%"), device->name, device->percentage);
+    else if (device->sysattrs.fds[SYSATTR_ONLINE] >= 0 || device->sysattrs.proxy != NULL)
+        return g_strdup_printf (device->online == TRUE ? _("%s: online") : _("%s: offline"), device->name);
+    else
+        return g_strdup_printf (_("%s: unknown"), device->name);
+}
+
+static void on_tray_icon_popup_menu (GtkStatusIcon *gtk_icon, guint button, guint activate_time, struct icon *tray_icon)
+{
+    static GtkWidget *menu = NULL;
+    GtkWidget *item;
+    gchar *label;
+    guint i;
+
+    /* the menu is built from the last sample of each device when it is opened */
+
+    if (menu != NULL) {
+        gtk_widget_destroy (menu);
+    }
+
+    menu = gtk_menu_new ();
+
+    for (i = 0; devices != NULL && i < devices->len; i++) {
+        struct device *device = g_ptr_array_index (devices, i);
+
+        label = get_device_string (device);
+        item  = gtk_menu_item_new_with_label (label);
+        gtk_menu_shell_append (GTK_MENU_SHELL (menu), item);
+        g_free (label);
+    }
+
+    if (devices == NULL || devices->len == 0) {
+        item = gtk_menu_item_new_with_label (_("No device"));
+        gtk_widget_set_sensitive (item, FALSE);
+        gtk_menu_shell_append (GTK_MENU_SHELL (menu), item);
+    }
+
+    gtk_widget_show_all (menu);
+    gtk_menu_popup (GTK_MENU (menu), NULL, NULL, gtk_status_icon_position_menu, gtk_icon, button, activate_time);
+}
+
+static void open_sysattrs (const gchar *path, struct sysattrs *sysattrs)
+{
+    gint attribute;
+
+    clear_sysattrs (sysattrs);
+
+#ifdef WITH_TRACE
+    /* the replayed power supplies are read from the trace only */
+
+    if (trace_fd >= 0 || replay_data != NULL) {
+        sysattrs->trace_supply = get_trace_supply (path);
+    }
+
+    if (replay_data != NULL) {
+        return;
+    }
+#endif
+
+    for (attribute = 0; attribute < SYSATTR_COUNT; attribute++) {
+        gchar *sysattr_filename = g_build_filename (path, sysattr_names[attribute], NULL);
+        sysattrs->fds[attribute] = open (sysattr_filename, O_RDONLY | O_CLOEXEC);
+        g_free (sysattr_filename);
+
+        if (sysattrs->fds[attribute] >= 0) {
+            stats.files_opened++;
+        }
+    }
+}
+
+static void close_sysattrs (struct sysattrs *sysattrs)
+{
+    gint attribute;
+
+    for (attribute = 0; attribute < SYSATTR_COUNT; attribute++) {
+        if (sysattrs->fds[attribute] >= 0) {
+            close (sysattrs->fds[attribute]);
+        }
+    }
+
+    if (sysattrs->proxy != NULL) {
+        g_object_unref (sysattrs->proxy);
+    }
+
+    g_free (sysattrs->caches);
+    clear_sysattrs (sysattrs);
+}
+
+static void clear_sysattrs (struct sysattrs *sysattrs)
+{
+    gint attribute;
+
+    for (attribute = 0; attribute < SYSATTR_COUNT; attribute++) {
+        sysattrs->fds[attribute] = -1;
+    }
+
+    sysattrs->sample_tick  = 0;
+    sysattrs->sample_mask  = 0;
+    sysattrs->proxy        = NULL;
+    sysattrs->trace_supply = -1;
+    sysattrs->sample_index = -1;
+    sysattrs->caches       = NULL;
+}
+
+static gboolean read_sysfile (const gchar *path, const gchar *attribute, gchar *value, gsize size)
+{
+    gchar *sysattr_filename;
+    gssize length;
+    gint64 start;
+    gint fd;
+
+    g_return_val_if_fail (path != NULL, FALSE);
+    g_return_val_if_fail (attribute != NULL, FALSE);
+    g_return_val_if_fail (value != NULL, FALSE);
+
+#ifdef WITH_TRACE
+    if (replay_data != NULL) {
+        return get_replay_value (get_trace_supply (path), get_trace_attribute (attribute), value, size);
+    }
+#endif
+
+    sysattr_filename = g_build_filename (path, attribute, NULL);
+    fd = open (sysattr_filename, O_RDONLY | O_CLOEXEC);
+    g_free (sysattr_filename);
+
+    if (fd < 0) {
+#ifdef WITH_TRACE
+        if (trace_fd >= 0) {
+            add_trace_value (get_trace_supply (path), get_trace_attribute (attribute), NULL);
+        }
+#endif
+
+        return FALSE;
+    }
+
+    stats.files_opened++;
+
+    start = start_stats_latency ();
+    length = read (fd, value, size - 1);
+    add_stats_latency (STATS_SYSFS_READ, start);
+    close (fd);
+
+    if (length >= 0) {
+        stats.bytes_read += length;
+
+        value[length] = '\0';
+        g_strchomp (value);
+    }
+
+#ifdef WITH_TRACE
+    if (trace_fd >= 0) {
+        add_trace_value (get_trace_supply (path), get_trace_attribute (attribute), length >= 0 ? value : NULL);
+    }
+#endif
+
+    return length >= 0;
+}
+
+static gboolean sample_sysattrs (struct sysattrs *sysattrs)
+{
+    gchar buffer[SYSUEVENT_LTH];
+    gssize length;
+    gint64 start;
+
+    /* one read of the uevent file holds every POWER_SUPPLY_* attribute at the same point in time */
+
+    start = start_stats_latency ();
+    length = pread (sysattrs->fds[SYSATTR_UEVENT], buffer, SYSUEVENT_LTH - 1, 0);
+    add_stats_latency (STATS_SYSFS_READ, start);
+
+    if (length < 0) {
+        if (errno == ENODEV || errno == ENOENT) {
+            sysattrs_invalidated = TRUE;
+            return FALSE;
+        }
+
+        /* unreadable uevent file, fall back to the attribute files */
+
+        close (sysattrs->fds[SYSATTR_UEVENT]);
+        sysattrs->fds[SYSATTR_UEVENT] = -1;
+        return FALSE;
+    }
+
+    buffer[length] = '\0';
+    stats.bytes_read += length;
+
+    sysattrs->sample_tick = sampler_tick;
+    parse_uevent_sample (buffer, sysattrs->sample_values, &sysattrs->sample_mask);
+
+    return TRUE;
+}
+
+static void parse_uevent_sample (gchar *buffer, gchar values[][SYSATTR_LTH], guint *mask)
+{
+    gchar *line, *next, *value;
+    gint attribute;
+
+    *mask = 0;
+
+    for (line = buffer; line != NULL && *line != '\0'; line = next) {
+        next = strchr (line, '\n');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+
+        if (g_str_has_prefix (line, "POWER_SUPPLY_") == FALSE) {
+            continue;
+        }
+
+        line += strlen ("POWER_SUPPLY_");
+
+        value = strchr (line, '=');
+        if (value == NULL) {
+            continue;
+        }
+
+        *value++ = '\0';
+
+        for (attribute = 0; attribute < SYSATTR_UEVENT; attribute++) {
+            if (g_ascii_strcasecmp (line, sysattr_names[attribute]) == 0) {
+                g_strlcpy (values[attribute], value, SYSATTR_LTH);
+                *mask |= 1 << attribute;
+                break;
+            }
+        }
+    }
+}
+
+static gboolean get_sysattr_string (struct sysattrs *sysattrs, gint attribute, gchar *value, gsize size)
+{
+    gboolean available;
+
+    g_return_val_if_fail (sysattrs != NULL, FALSE);
+    g_return_val_if_fail (value != NULL, FALSE);
+
+#ifdef WITH_TRACE
+    if (replay_data != NULL) {
+        return get_replay_value (sysattrs->trace_supply, attribute, value, size);
+    }
+#endif
+
+    available = read_sysattr_string (sysattrs, attribute, value, size);
+
+#ifdef WITH_TRACE
+    /* the values are recorded after sampling, as the computations get them from either sampler */
+
+    if (trace_fd >= 0 && sysattrs->trace_supply >= 0) {
+        add_trace_value (sysattrs->trace_supply, attribute, available == TRUE ? value : NULL);
+    }
+#endif
+
+    return available;
+}
+
+static gboolean read_sysattr_string (struct sysattrs *sysattrs, gint attribute, gchar *value, gsize size)
+{
+    gssize length;
+    gint64 start, latency, now = 0;
+
+#ifdef WITH_UPOWER
+    /* UPower backend: the properties cached by the proxy, without any I/O */
+
+    if (sysattrs->proxy != NULL) {
+        return get_upower_sysattr (sysattrs->proxy, attribute, value, size);
+    }
+#endif
+
+    /* sampler thread: the sample of the update, the power supplies of a new scan are read here until the next one */
+
+    if (current_sample != NULL && sysattrs->sample_index >= 0 && current_sample->generation == sampler_generation) {
+        struct sample_supply *supply = &current_sample->supplies[sysattrs->sample_index];
+
+        if ((supply->mask & (1 << attribute)) == 0) {
+            return FALSE;
+        }
+
+        g_strlcpy (value, supply->values[attribute], size);
+
+        return TRUE;
+    }
+
+    /* uevent sampler: the first read of a tick samples the power supply, the next ones are served from the sample */
+    /* the driver reports every attribute at each read of the uevent file, the cache only applies to the attribute files */
+
+    if (configuration.sampler == SAMPLER_UEVENT && sysattrs->fds[SYSATTR_UEVENT] >= 0) {
+        if (sysattrs->sample_tick == sampler_tick || sample_sysattrs (sysattrs) == TRUE) {
+            if ((sysattrs->sample_mask & (1 << attribute)) == 0) {
+                return FALSE;
+            }
+
+            g_strlcpy (value, sysattrs->sample_values[attribute], size);
+
+            return TRUE;
+        }
+
+        if (sysattrs_invalidated == TRUE) {
+            return FALSE;
+        }
+    }
+
+    if (sysattrs->fds[attribute] < 0) {
+        return FALSE;
+    }
+
+    if (sysattrs->caches != NULL) {
+        now = g_get_monotonic_time ();
+
+        if (get_cached_sysattr (&sysattrs->caches[attribute], attribute, sampler_tick, sysattr_cache_epoch, uevent_source != 0, now, value, size,
+                &sysattr_cache_counters[attribute]) == TRUE) {
+            return TRUE;
+        }
+    }
+
+    start   = get_stats_time ();
+    length  = pread (sysattrs->fds[attribute], value, size - 1, 0);
+    latency = get_stats_time () - start;
+    add_stats_histogram_latency (&stats.histograms[STATS_SYSFS_READ], latency);
+
+    if (length < 0) {
+        /* the power supply has been removed from under the handle */
+
+        if (errno == ENODEV || errno == ENOENT) {
+            sysattrs_invalidated = TRUE;
+        }
+
+        return FALSE;
+    }
+
+    value[length] = '\0';
+    g_strchomp (value);
+    stats.bytes_read += length;
+
+    if (sysattrs->caches != NULL) {
+        set_cached_sysattr (&sysattrs->caches[attribute], sampler_tick, sysattr_cache_epoch, now, latency, value, &sysattr_cache_counters[attribute]);
+    }
+
+    return TRUE;
+}
+
+static gboolean get_sysattr_double (struct sysattrs *sysattrs, gint attribute, gdouble *value)
+{
+    gchar sysattr_value[SYSATTR_LTH];
+    gchar *sysattr_end;
+    gdouble double_value;
+
+    if (get_sysattr_string (sysattrs, attribute, sysattr_value, SYSATTR_LTH) == FALSE) {
+        return FALSE;
+    }
+
+    errno = 0;
+    double_value = g_ascii_strtod (sysattr_value, &sysattr_end);
+
+    if (value != NULL) {
+        *value = double_value;
+    }
+
+    if (sysattr_end == sysattr_value || errno != 0 || double_value < 0.01) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean get_ac_online (struct sysattrs *sysattrs, gboolean *online)
+{
+    gchar sysattr_value[SYSATTR_LTH];
+
+    if (get_sysattr_string (sysattrs, SYSATTR_ONLINE, sysattr_value, SYSATTR_LTH) == FALSE) {
+        return FALSE;
+    }
+
+    if (online != NULL) {
+        *online = g_str_has_prefix (sysattr_value, "1") ? TRUE : FALSE;
+    }
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("ac online: %s\n", sysattr_value);
+    }
+
+    return TRUE;
+}
+
+static gboolean get_battery_present (struct sysattrs *sysattrs, gboolean *present)
+{
+    gchar sysattr_value[SYSATTR_LTH];
+
+    if (get_sysattr_string (sysattrs, SYSATTR_PRESENT, sysattr_value, SYSATTR_LTH) == FALSE) {
+        return FALSE;
+    }
+
+    if (present != NULL) {
+        *present = g_str_has_prefix (sysattr_value, "1") ? TRUE : FALSE;
+    }
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("battery present: %s\n", sysattr_value);
+    }
+
+    return TRUE;
+}
+
+static gboolean get_battery_status (struct sysattrs *sysattrs, gint *status)
+{
+    gchar sysattr_value[SYSATTR_LTH];
+
+    g_return_val_if_fail (status != NULL, FALSE);
+
+    if (get_sysattr_string (sysattrs, SYSATTR_STATUS, sysattr_value, SYSATTR_LTH) == FALSE) {
+        return FALSE;
+    }
+
+    if (g_str_has_prefix (sysattr_value, "Charging") == TRUE)
+        *status = CHARGING;
+    else if (g_str_has_prefix (sysattr_value, "Discharging") == TRUE)
+        *status = DISCHARGING;
+    else if (g_str_has_prefix (sysattr_value, "Not charging") == TRUE)
+        *status = NOTCHARGING;
+    else if (g_str_has_prefix (sysattr_value, "Full") == TRUE)
+        *status = CHARGED;
+    else
+        *status = UNKNOWN;
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("battery status: %d - %s\n", *status, sysattr_value);
+    }
+
+    return TRUE;
+}
+
+static gboolean get_battery_full_capacity (struct sysattrs *sysattrs, gboolean *use_charge, gdouble *capacity)
+{
+    gboolean sysattr_status;
+
+    g_return_val_if_fail (use_charge != NULL, FALSE);
+    g_return_val_if_fail (capacity != NULL, FALSE);
+
+    sysattr_status = get_sysattr_double (sysattrs, SYSATTR_ENERGY_FULL, capacity);
+    *use_charge = FALSE;
+
+    if (sysattr_status == FALSE) {
+        sysattr_status = get_sysattr_double (sysattrs, SYSATTR_CHARGE_FULL, capacity);
+        *use_charge = TRUE;
+    }
+
+    return sysattr_status;
+}
+
+static gboolean get_battery_remaining_capacity (struct sysattrs *sysattrs, gboolean use_charge, gdouble *capacity)
+{
+    g_return_val_if_fail (capacity != NULL, FALSE);
+
+    if (use_charge == FALSE) {
+        return get_sysattr_double (sysattrs, SYSATTR_ENERGY_NOW, capacity);
+    } else {
+        return get_sysattr_double (sysattrs, SYSATTR_CHARGE_NOW, capacity);
+    }
+}
+
+static gboolean get_battery_remaining_capacity_pct (struct sysattrs *sysattrs, gdouble *capacity)
+{
+    g_return_val_if_fail (capacity != NULL, FALSE);
+
+    return get_sysattr_double (sysattrs, SYSATTR_CAPACITY, capacity);
+}
+
+static gboolean get_battery_current_rate (struct sysattrs *sysattrs, gboolean use_charge, gdouble *rate)
+{
+    if (use_charge == FALSE) {
+        return get_sysattr_double (sysattrs, SYSATTR_POWER_NOW, rate);
+    } else {
+        return get_sysattr_double (sysattrs, SYSATTR_CURRENT_NOW, rate);
+    }
+}
+
+static gboolean get_batteries_present (gboolean *present)
+{
+    gboolean battery_present, status = FALSE;
+    guint i;
+
+    g_return_val_if_fail (present != NULL, FALSE);
+
+    *present = FALSE;
+
+    for (i = 0; i < batteries->len; i++) {
+        struct battery *battery = g_ptr_array_index (batteries, i);
+
+        if (get_battery_present (&battery->sysattrs, &battery_present) == TRUE) {
+            status = TRUE;
+
+            if (battery_present == TRUE) {
+                *present = TRUE;
+            }
+        }
+    }
+
+    return status;
+}
+
+static gboolean get_batteries_status (gint *status)
+{
+    gint battery_status;
+    gboolean present, charging = FALSE, notcharging = FALSE, charged = TRUE, status_available = FALSE;
+    guint i;
+
+    g_return_val_if_fail (status != NULL, FALSE);
+
+    if (batteries->len == 1) {
+        struct battery *battery = g_ptr_array_index (batteries, 0);
+
+        return get_battery_status (&battery->sysattrs, status);
+    }
+
+    /*
+     * the firmware usually charges and discharges the batteries one after the other,
+     * the idle ones report not charging, full or unknown while another one is in use
+     */
+
+    for (i = 0; i < batteries->len; i++) {
+        struct battery *battery = g_ptr_array_index (batteries, i);
+
+        if (get_battery_present (&battery->sysattrs, &present) == FALSE || present == FALSE ||
+            get_battery_status (&battery->sysattrs, &battery_status) == FALSE) {
+            continue;
+        }
+
+        status_available = TRUE;
+
+        if (battery_status == DISCHARGING) {
+            *status = DISCHARGING;
+            return TRUE;
+        }
+
+        if (battery_status == CHARGING)
+            charging = TRUE;
+        else if (battery_status == NOTCHARGING)
+            notcharging = TRUE;
+
+        if (battery_status != CHARGED)
+            charged = FALSE;
+    }
+
+    if (status_available == FALSE)
+        return FALSE;
+
+    if (charging == TRUE)
+        *status = CHARGING;
+    else if (notcharging == TRUE)
+        *status = NOTCHARGING;
+    else if (charged == TRUE)
+        *status = CHARGED;
+    else
+        *status = UNKNOWN;
+
+    return TRUE;
+}
+
+/*
+ * uevent functions
+ */
+
+static gboolean create_uevent_monitor (struct icon *tray_icon)
+{
+    struct sockaddr_nl address;
+    gint fd;
+
+    memset (&address, 0, sizeof (address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = 1; /* kernel uevents */
+
+    fd = socket (AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) {
+        if (configuration.debug_output == TRUE) {
+            g_printf ("uevent: cannot create netlink socket (%s), polling only\n", g_strerror (errno));
+        }
+
+        return FALSE;
+    }
+
+    if (bind (fd, (struct sockaddr *)&address, sizeof (address)) < 0) {
+        if (configuration.debug_output == TRUE) {
+            g_printf ("uevent: cannot bind netlink socket (%s), polling only\n", g_strerror (errno));
+        }
+
+        close (fd);
+        return FALSE;
+    }
+
+    uevent_source = g_unix_fd_add (fd, G_IO_IN, (GUnixFDSourceFunc)on_uevent, (gpointer)tray_icon);
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("uevent: monitoring power supplies\n");
+    }
+
+    return TRUE;
+}
+
+static gboolean on_uevent (gint fd, GIOCondition condition, struct icon *tray_icon)
+{
+    gchar buffer[UEVENT_BUFFER_LTH];
+    struct sockaddr_nl sender;
+    socklen_t sender_length;
+    gssize length;
+    gboolean power_supply_event = FALSE;
+
+    for (;;) {
+        sender_length = sizeof (sender);
+        length = recvfrom (fd, buffer, sizeof (buffer) - 1, 0, (struct sockaddr *)&sender, &sender_length);
+
+        if (length < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            /* events were lost, the power supplies must be rescanned */
+
+            if (errno == ENOBUFS) {
+                invalidate_sysattr_caches ();
+                uevent_power_supplies_changed = TRUE;
+                power_supply_event = TRUE;
+                continue;
+            }
+
+            break;
+        }
+
+        /* only trust messages sent by the kernel */
+
+        if (sender_length != sizeof (sender) || sender.nl_pid != 0) {
+            continue;
+        }
+
+        buffer[length] = '\0';
+        if (parse_uevent (buffer, length) == TRUE) {
+            power_supply_event = TRUE;
+        }
+    }
+
+    /* coalesce bursts of events (AC and battery usually change together) into one update */
+
+    if (power_supply_event == TRUE && uevent_timeout_source == 0) {
+        uevent_timeout_source = g_timeout_add (UEVENT_COALESCE_DELAY, (GSourceFunc)on_uevent_timeout, (gpointer)tray_icon);
+    }
+
+    return TRUE;
+}
+
+static gboolean on_uevent_timeout (struct icon *tray_icon)
+{
+    uevent_timeout_source = 0;
+
+    update_tray_icon (tray_icon);
+
+    return FALSE;
+}
+
+static gboolean parse_uevent (gchar *buffer, gssize length)
+{
+    gchar *action = NULL, *devpath = NULL, *subsystem = NULL;
+    gchar *name;
+    gssize offset;
+
+    /* message format: action@devpath\0KEY=VALUE\0KEY=VALUE\0... */
+
+    for (offset = strlen (buffer) + 1; offset < length; offset += strlen (buffer + offset) + 1) {
+        gchar *line = buffer + offset;
+
+        if (g_str_has_prefix (line, "ACTION=") == TRUE)
+            action = line + strlen ("ACTION=");
+        else if (g_str_has_prefix (line, "DEVPATH=") == TRUE)
+            devpath = line + strlen ("DEVPATH=");
+        else if (g_str_has_prefix (line, "SUBSYSTEM=") == TRUE)
+            subsystem = line + strlen ("SUBSYSTEM=");
+    }
+
+    if (action == NULL || devpath == NULL || g_strcmp0 (subsystem, "power_supply") != 0) {
+        return FALSE;
+    }
+
+    name = g_strrstr (devpath, "/");
+    name = (name != NULL) ? name + 1 : devpath;
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("uevent: %s %s\n", action, name);
+    }
+
+    if (g_strcmp0 (action, "add") == 0 || g_strcmp0 (action, "remove") == 0) {
+        uevent_power_supplies_changed = TRUE;
+    } else if (g_strcmp0 (action, "change") == 0) {
+        /* a device is sampled on its own, the system battery is not updated */
+
+        if (mark_device_changed (name) == TRUE) {
+            return FALSE;
+        }
+
+        invalidate_sysattr_caches ();
+
+        if (is_battery_name (name) == TRUE) {
+            uevent_battery_changes = TRUE;
+        }
+    }
+
+    return TRUE;
+}
+
+#ifdef WITH_UPOWER
+/*
+ * upower functions
+ */
+
+void add_upower_device (const gchar *object_path, GDBusProxy *proxy, const gchar *type, const gchar *model)
+{
+    struct sysattrs sysattrs;
+
+    /* the proxy is released with sysattrs unless the power supply or the device takes it over */
+
+    clear_sysattrs (&sysattrs);
+    sysattrs.proxy = proxy;
+
+    if (model == NULL) {
+        add_power_supply (object_path, type, &sysattrs);
+    } else {
+        add_device (object_path, model, type, &sysattrs);
+    }
+
+    close_sysattrs (&sysattrs);
+}
+
+void on_upower_device_changed (const gchar *object_path)
+{
+    /* a device is sampled on its own, the system battery is not updated */
+
+    if (mark_device_changed (object_path) == TRUE) {
+        return;
+    }
+
+    if (is_battery_name (object_path) == TRUE) {
+        uevent_battery_changes = TRUE;
+    }
+
+    schedule_upower_update ();
+}
+
+void on_upower_stopped (void)
+{
+    /* the power supplies are read from sysfs from now on */
+
+    configuration.backend = BACKEND_SYSFS;
+    sysattrs_invalidated = TRUE;
+
+    create_uevent_monitor (upower_tray_icon);
+    schedule_upower_update ();
+}
+
+void schedule_upower_update (void)
+{
+    /* the signals of a change (AC and battery usually change together) are coalesced into one update */
+
+    if (upower_tray_icon != NULL && uevent_timeout_source == 0) {
+        uevent_timeout_source = g_timeout_add (UEVENT_COALESCE_DELAY, (GSourceFunc)on_uevent_timeout, (gpointer)upower_tray_icon);
+    }
+}
+#endif
+
+/*
+ * computation functions
+ */
+
+static gboolean get_battery_charge (gboolean remaining, gint *percentage, gint *time)
+{
+    gdouble full_capacity = 0, remaining_capacity = 0, current_rate = 0;
+    gdouble scaled_full_capacity = 0, scaled_remaining_capacity = 0, scaled_current_rate = 0;
+    gdouble battery_full_capacity, battery_remaining_capacity, battery_current_rate;
+    gboolean use_charge, first_use_charge = FALSE, mixed_units = FALSE, present;
+    static guint last_count = 0;
+    guint i, count = 0;
+
+    g_return_val_if_fail (percentage != NULL, FALSE);
+
+    last_full_capacity      = -1;
+    last_remaining_capacity = -1;
+    last_current_rate       = -1;
+
+    /*
+     * the capacities and rates of the batteries are summed, so the percentage is weighted by the
+     * full capacity of each battery and the time is right whichever battery the firmware drains first
+     * when the batteries report their capacities in different units (energy and charge),
+     * each battery is scaled to a full capacity of 100 and they are weighted equally
+     * a battery that cannot be read is left out, the others are still aggregated
+     */
+
+    for (i = 0; i < batteries->len; i++) {
+        struct battery *battery = g_ptr_array_index (batteries, i);
+
+        if (batteries->len > 1 &&
+            (get_battery_present (&battery->sysattrs, &present) == FALSE || present == FALSE)) {
+            continue;
+        }
+
+        if (get_battery_full_capacity (&battery->sysattrs, &use_charge, &battery_full_capacity) == FALSE) {
+            if (configuration.debug_output == TRUE) {
+                g_printf ("full capacity: %s (%s)\n", "unavailable", battery->path);
+            }
+
+            continue;
+        }
+
+        if (get_battery_remaining_capacity (&battery->sysattrs, use_charge, &battery_remaining_capacity) == FALSE) {
+            if (get_battery_remaining_capacity_pct (&battery->sysattrs, &battery_remaining_capacity) == FALSE) {
+                if (configuration.debug_output == TRUE) {
+                    g_printf ("remaining capacity: %s (%s)\n", "unavailable", battery->path);
+                }
+
+                continue;
+            }
+
+            /* remaining capacity is percentage, compute the actual remaining capacity */
+            battery_remaining_capacity *= battery_full_capacity / 100.0;
+        }
+
+        /* an idle battery does not report a current rate */
+
+        battery_current_rate = 0;
+        if (time != NULL && estimation_needed == FALSE &&
+            get_battery_current_rate (&battery->sysattrs, use_charge, &battery_current_rate) == FALSE) {
+            battery_current_rate = 0;
+        }
+
+        if (count == 0) {
+            first_use_charge = use_charge;
+        } else if (use_charge != first_use_charge) {
+            mixed_units = TRUE;
+        }
+
+        full_capacity             += battery_full_capacity;
+        remaining_capacity        += battery_remaining_capacity;
+        current_rate              += battery_current_rate;
+        scaled_full_capacity      += 100.0;
+        scaled_remaining_capacity += battery_remaining_capacity * 100.0 / battery_full_capacity;
+        scaled_current_rate       += battery_current_rate * 100.0 / battery_full_capacity;
+        count++;
+    }
+
+    if (count == 0) {
+        return FALSE;
+    }
+
+    /* the capacities of another set of batteries do not follow those of the previous samples */
+
+    if (count != last_count) {
+        if (last_count != 0) {
+            reset_battery_time_estimation ();
+        }
+
+        last_count = count;
+    }
+
+    last_capacity_unit = (first_use_charge == TRUE) ? CAPACITY_CHARGE : CAPACITY_ENERGY;
+
+    if (mixed_units == TRUE) {
+        last_capacity_unit = CAPACITY_SCALED;
+        full_capacity      = scaled_full_capacity;
+        remaining_capacity = scaled_remaining_capacity;
+        current_rate       = scaled_current_rate;
+    }
+
+    if (configuration.debug_output == TRUE && batteries->len > 1) {
+        g_printf ("batteries: %u, full capacity: %f, remaining capacity: %f, current rate: %f%s\n",
+            count, full_capacity, remaining_capacity, current_rate, mixed_units == TRUE ? " (mixed units)" : "");
+    }
+
+    *percentage = (gint)fmin (floor (remaining_capacity / full_capacity * 100.0), 100.0);
+
+    last_full_capacity      = full_capacity;
+    last_remaining_capacity = remaining_capacity;
+
+    if (time == NULL) {
+        return TRUE;
+    }
+
+    /* a stale sample holds the capacity of a previous update, at the time of this one */
+
+    if (sample_stale == FALSE) {
+        add_estimator_sample (remaining_capacity, estimation_needed == FALSE && current_rate > 0,
+            remaining == TRUE ? -current_rate : current_rate);
+    }
+
+    *time                = -1;
+    last_time_confidence = 0;
+
+    if (get_estimator_rate (&current_rate, &last_time_confidence) == TRUE && remaining == TRUE) {
+        current_rate = -current_rate;
+    }
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("estimated rate: %f (confidence: %.2f)\n", current_rate, last_time_confidence);
+    }
+
+    /* no estimation yet, or the capacity goes the wrong way */
+
+    if (current_rate <= 0) {
+        if (configuration.debug_output == TRUE) {
+            g_printf ("current rate: %s\n", "unavailable");
+        }
+
+        last_time_confidence = 0;
+        return TRUE;
+    }
+
+    last_current_rate = current_rate;
+
+    if (remaining == TRUE) {
+        *time = (gint)(remaining_capacity / current_rate * 60.0);
+    } else {
+        *time = (gint)((full_capacity - remaining_capacity) / current_rate * 60.0);
+    }
+
+    return TRUE;
+}
+
+/*
+ * estimator functions
+ */
+
+static void add_estimator_sample (gdouble capacity, gboolean has_rate, gdouble rate)
+{
+    struct estimator_sample *sample, *previous;
+    gdouble now, observed_rate = 0, weight = 0, delta;
+
+    now = get_monotonic_time () / (gdouble)G_USEC_PER_SEC;
+
+    if (estimator.count == 0) {
+        estimator.time_origin     = now;
+        estimator.capacity_origin = capacity;
+    }
+
+    now      -= estimator.time_origin;
+    capacity -= estimator.capacity_origin;
+
+    /*
+     * moving average of the rate: the current rate of the battery when it provides one,
+     * the slope since the previous sample otherwise, weighted by the time between the samples
+     */
+
+    if (estimator.count > 0) {
+        gdouble interval;
+
+        previous = &estimator.samples[(estimator.head + ESTIMATOR_SAMPLES - 1) % ESTIMATOR_SAMPLES];
+        interval = now - previous->time;
+
+        if (interval <= 0) {
+            return;
+        }
+
+        observed_rate = (has_rate == TRUE) ? rate : (capacity - previous->capacity) / interval * 3600.0;
+        weight = 1.0 - exp (-interval / ESTIMATOR_EWMA_PERIOD);
+        estimator.elapsed += interval;
+    } else if (has_rate == TRUE) {
+        observed_rate = rate;
+        weight = 1.0;
+    }
+
+    if (weight > 0) {
+        if (estimator.ewma_valid == FALSE) {
+            estimator.ewma_valid    = TRUE;
+            estimator.ewma_rate     = observed_rate;
+            estimator.ewma_variance = 0;
+        } else {
+            delta = observed_rate - estimator.ewma_rate;
+            estimator.ewma_rate    += weight * delta;
+            estimator.ewma_variance = (1.0 - weight) * (estimator.ewma_variance + weight * delta * delta);
+        }
+    }
+
+    /* ring buffer of the samples, the oldest sample leaves the sums when it is overwritten */
+
+    sample = &estimator.samples[estimator.head];
+
+    if (estimator.count == ESTIMATOR_SAMPLES) {
+        add_estimator_sums (sample, -1);
+    } else {
+        estimator.count++;
+    }
+
+    sample->time     = now;
+    sample->capacity = capacity;
+    sample->has_rate = has_rate;
+    add_estimator_sums (sample, 1);
+
+    estimator.head = (estimator.head + 1) % ESTIMATOR_SAMPLES;
+
+    if (estimator.head == 0) {
+        rebase_estimator ();
+    }
+}
+
+static void add_estimator_sums (struct estimator_sample *sample, gdouble sign)
+{
+    estimator.sum_t  += sign * sample->time;
+    estimator.sum_c  += sign * sample->capacity;
+    estimator.sum_tt += sign * sample->time * sample->time;
+    estimator.sum_tc += sign * sample->time * sample->capacity;
+    estimator.sum_cc += sign * sample->capacity * sample->capacity;
+}
+
+static void rebase_estimator (void)
+{
+    struct estimator_sample *oldest;
+    gdouble time_offset, capacity_offset;
+    guint i;
+
+    /*
+     * once per revolution of the ring buffer, move the origins to the oldest sample
+     * and recompute the sums, so they neither lose precision nor accumulate rounding errors
+     */
+
+    oldest = &estimator.samples[estimator.head];
+    time_offset     = oldest->time;
+    capacity_offset = oldest->capacity;
+
+    estimator.time_origin     += time_offset;
+    estimator.capacity_origin += capacity_offset;
+    estimator.sum_t = estimator.sum_c = estimator.sum_tt = estimator.sum_tc = estimator.sum_cc = 0;
+
+    for (i = 0; i < estimator.count; i++) {
+        estimator.samples[i].time     -= time_offset;
+        estimator.samples[i].capacity -= capacity_offset;
+        add_estimator_sums (&estimator.samples[i], 1);
+    }
+}
+
+static gboolean get_estimator_rate (gdouble *rate, gdouble *confidence)
+{
+    struct estimator_sample *latest;
+
+    g_return_val_if_fail (rate != NULL, FALSE);
+    g_return_val_if_fail (confidence != NULL, FALSE);
+
+    *rate       = 0;
+    *confidence = 0;
+
+    if (estimator.count == 0) {
+        return FALSE;
+    }
+
+    switch (configuration.estimator) {
+        case ESTIMATOR_EWMA:
+            return get_estimator_ewma_rate (rate, confidence);
+
+        case ESTIMATOR_REGRESSION:
+            return get_estimator_regression_rate (rate, confidence);
+
+        default:
+            latest = &estimator.samples[(estimator.head + ESTIMATOR_SAMPLES - 1) % ESTIMATOR_SAMPLES];
+
+            /* prefer the current rate of the battery, the regression smooths coarse capacities */
+
+            if (latest->has_rate == TRUE) {
+                return get_estimator_ewma_rate (rate, confidence);
+            }
+
+            return get_estimator_regression_rate (rate, confidence);
+    }
+}
+
+static gboolean get_estimator_ewma_rate (gdouble *rate, gdouble *confidence)
+{
+    gdouble variation;
+
+    if (estimator.ewma_valid == FALSE || estimator.ewma_rate == 0) {
+        return FALSE;
+    }
+
+    /* the confidence grows with the history and decreases with the variation of the rate */
+
+    variation   = sqrt (estimator.ewma_variance) / fabs (estimator.ewma_rate);
+    *rate       = estimator.ewma_rate;
+    *confidence = (1.0 - exp (-estimator.elapsed / ESTIMATOR_EWMA_PERIOD)) / (1.0 + variation);
+
+    return TRUE;
+}
+
+static gboolean get_estimator_regression_rate (gdouble *rate, gdouble *confidence)
+{
+    gdouble n, time_variance, capacity_variance, covariance;
+
+    /*
+     * least-squares slope of the capacity over the time: c = mt + b
+     * the confidence is the coefficient of determination, reduced while the window fills up
+     */
+
+    n                 = estimator.count;
+    time_variance     = n * estimator.sum_tt - estimator.sum_t * estimator.sum_t;
+    capacity_variance = n * estimator.sum_cc - estimator.sum_c * estimator.sum_c;
+    covariance        = n * estimator.sum_tc - estimator.sum_t * estimator.sum_c;
+
+    if (estimator.count < 2 || time_variance <= 0 || capacity_variance <= 0) {
+        return FALSE;
+    }
+
+    *rate       = covariance / time_variance * 3600.0;
+    *confidence = covariance * covariance / (time_variance * capacity_variance) * n / ESTIMATOR_SAMPLES;
+
+    return TRUE;
+}
+
+static void reset_battery_time_estimation (void)
+{
+    memset (&estimator, 0, sizeof (estimator));
+
+    last_time_confidence = 0;
+}
+
+/*
+ * suspend functions
+ */
+
+static gint64 get_suspend_offset (void)
+{
+    struct timespec boot_time, monotonic_time;
+
+#ifdef WITH_TRACE
+    if (replay_data != NULL) {
+        return get_replay_suspend_offset ();
+    }
+#endif
+
+    if (clock_gettime (CLOCK_BOOTTIME, &boot_time) != 0 || clock_gettime (CLOCK_MONOTONIC, &monotonic_time) != 0) {
+        return -1;
+    }
+
+    return (boot_time.tv_sec - monotonic_time.tv_sec) * G_USEC_PER_SEC + (boot_time.tv_nsec - monotonic_time.tv_nsec) / 1000;
+}
+
+static gboolean check_suspend (void)
+{
+    gint64 offset = get_suspend_offset ();
+    gint64 gap;
+
+    if (offset < 0) {
+        return FALSE;
+    }
+
+    gap = suspend_offset >= 0 ? offset - suspend_offset : 0;
+    suspend_offset = offset;
+
+    if (gap < SUSPEND_GAP_MIN * G_USEC_PER_SEC) {
+        return FALSE;
+    }
+
+    /* the samples before the suspend would turn the capacity drained while asleep into an absurd rate */
+
+    stats.suspends++;
+    reset_battery_time_estimation ();
+    invalidate_sysattr_caches ();
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("suspend: resumed after %.1f seconds, estimator reset\n", gap / (gdouble)G_USEC_PER_SEC);
+    }
+
+    return TRUE;
+}
+
+static void create_suspend_watchdog (struct icon *tray_icon)
+{
+    suspend_offset = get_suspend_offset ();
+
+    suspend_watchdog_fd = timerfd_create (CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (suspend_watchdog_fd == -1) {
+        if (configuration.debug_output == TRUE) {
+            g_printf ("suspend: cannot create boot time timer (%s), resumes are noticed at the next update\n", g_strerror (errno));
+        }
+
+        return;
+    }
+
+    g_unix_fd_add (suspend_watchdog_fd, G_IO_IN, (GUnixFDSourceFunc)on_suspend_watchdog, (gpointer)tray_icon);
+}
+
+static void arm_suspend_watchdog (gdouble interval)
+{
+    struct itimerspec deadline = { { 0, 0 }, { 0, 0 } };
+
+    if (suspend_watchdog_fd == -1) {
+        return;
+    }
+
+    interval += SUSPEND_WATCHDOG_SLACK;
+
+    deadline.it_value.tv_sec  = (time_t)interval;
+    deadline.it_value.tv_nsec = (glong)((interval - (time_t)interval) * 1e9);
+
+    timerfd_settime (suspend_watchdog_fd, 0, &deadline, NULL);
+}
+
+static gboolean on_suspend_watchdog (gint fd, GIOCondition condition, struct icon *tray_icon)
+{
+    guint64 expirations;
+
+    if (read (fd, &expirations, sizeof (expirations)) != sizeof (expirations)) {
+        return TRUE;
+    }
+
+    /* the update timer is overdue in boot time, sample now instead of waiting for the rest of its interval */
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("suspend: update overdue, updating now\n");
+    }
+
+    update_tray_icon (tray_icon);
+
+    return TRUE;
+}
+
+/*
+ * tray icon functions
+ */
+
+static struct icon* create_tray_icon (void)
+{
+    struct icon* tray_icon = g_malloc (sizeof(*tray_icon));
+    tray_icon->gtk_icon = NULL;
+    tray_icon->name = g_strdup("");
+    tray_icon->size = 0;
+    tray_icon->scale = 0;
+    tray_icon->tooltip = NULL;
+
+    /* headless, the status is written to the standard output instead of a tray icon */
+
+    if (configuration.headless == FALSE) {
+        tray_icon->gtk_icon = gtk_status_icon_new ();
+    }
+
+    set_tray_icon_tooltip (tray_icon, CBATTICON_STRING);
+
+    if (tray_icon->gtk_icon != NULL) {
+        gtk_status_icon_set_visible (tray_icon->gtk_icon, TRUE);
+    }
+
+    if (configuration.status_only == FALSE && replay_data == NULL) {
+#ifdef WITH_SOCKET
+        if (configuration.socket == TRUE) {
+            create_socket_server ();
+        }
+#endif
+
+#ifdef WITH_SHM
+        if (configuration.shm == TRUE) {
+            create_shm_region ();
+        }
+#endif
+
+#ifdef WITH_UPOWER
+        if (configuration.backend == BACKEND_UPOWER) {
+            upower_tray_icon = tray_icon;
+            create_upower_monitor ();
+        }
+#endif
+
+        if (configuration.backend == BACKEND_SYSFS) {
+            create_uevent_monitor (tray_icon);
+        }
+
+        create_suspend_watchdog (tray_icon);
+        create_configuration_monitor (tray_icon);
+
+        if (configuration.backend == BACKEND_SYSFS && configuration.sampler_timeout > 0) {
+            create_sampler_thread ();
+        }
+    }
+
+    update_tray_icon (tray_icon);
+
+    if (tray_icon->gtk_icon != NULL) {
+        g_signal_connect (G_OBJECT (tray_icon->gtk_icon), "activate", G_CALLBACK (on_tray_icon_click), NULL);
+
+        if (configuration.devices == TRUE) {
+            g_signal_connect (G_OBJECT (tray_icon->gtk_icon), "popup-menu", G_CALLBACK (on_tray_icon_popup_menu), (gpointer)tray_icon);
+        }
+        g_signal_connect (G_OBJECT (tray_icon->gtk_icon), "size-changed", G_CALLBACK (resize_tray_icon), (gpointer)tray_icon);
+        g_signal_connect (G_OBJECT (gtk_icon_theme_get_default ()), "changed", G_CALLBACK (on_icon_theme_changed), (gpointer)tray_icon);
+    }
+
+    return tray_icon;
+}
+
+static void set_tray_icon (struct icon *tray_icon, const gchar *name)
+{
+    gint64 start;
+    gint size, scale;
+
+    if (tray_icon->gtk_icon == NULL) {
+        if (name != NULL) {
+            g_free (tray_icon->name);
+            tray_icon->name = g_strdup (name);
+        }
+
+        return;
+    }
+
+    size = gtk_status_icon_get_size (tray_icon->gtk_icon);
+    scale = get_tray_icon_scale ();
+
+    if (size == tray_icon->size && scale == tray_icon->scale && (name == NULL || g_strcmp0 (name, tray_icon->name) == 0)) {
+        return;
+    }
+
+    /* prewarm the cache with every icon of the icon type at the new size */
+
+    if (configuration.prewarm_icons == TRUE && (size != tray_icon->size || scale != tray_icon->scale)) {
+        prewarm_icon_cache (size, scale);
+    }
+
+    tray_icon->size = size;
+    tray_icon->scale = scale;
+
+    if (name != NULL)
+    {
+        g_free (tray_icon->name);
+        tray_icon->name = g_strdup (name);
+    }
+
+    start = start_stats_latency ();
+    gtk_status_icon_set_from_pixbuf (tray_icon->gtk_icon, get_icon_pixbuf (tray_icon->name, tray_icon->size, tray_icon->scale));
+    add_stats_latency (STATS_THEME_LOAD, start);
+}
+
+static gint get_tray_icon_scale (void)
+{
+#if GTK_CHECK_VERSION (3, 10, 0)
+    return gdk_window_get_scale_factor (gdk_get_default_root_window ());
+#else
+    return 1;
+#endif
+}
+
+static GdkPixbuf* get_icon_pixbuf (const gchar *name, gint size, gint scale)
+{
+    struct icon_cache_entry *entry = NULL;
+    gint i;
+
+    icon_cache_clock++;
+
+    for (i = 0; i < ICON_CACHE_SIZE; i++) {
+        if (icon_cache[i].name != NULL && icon_cache[i].size == size && icon_cache[i].scale == scale &&
+            g_strcmp0 (icon_cache[i].name, name) == 0) {
+            icon_cache[i].last_use = icon_cache_clock;
+
+            if (configuration.debug_output == TRUE) {
+                g_printf ("icon cache: hit %s (size %d, scale %d)\n", name, size, scale);
+            }
+
+            return icon_cache[i].pixbuf;
+        }
+
+        /* the victim is a free entry or else the least recently used one */
+
+        if (entry == NULL || (entry->name != NULL && (icon_cache[i].name == NULL || icon_cache[i].last_use < entry->last_use))) {
+            entry = &icon_cache[i];
+        }
+    }
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("icon cache: miss %s (size %d, scale %d)%s\n", name, size, scale, entry->name != NULL ? ", evicting" : "");
+    }
+
+    g_free (entry->name); entry->name = NULL;
+    if (entry->pixbuf != NULL) {
+        g_object_unref (entry->pixbuf);
+        entry->pixbuf = NULL;
+    }
+
+#if GTK_CHECK_VERSION (3, 10, 0)
+    entry->pixbuf = gtk_icon_theme_load_icon_for_scale (gtk_icon_theme_get_default (),
+                                                        name,
+                                                        MAX (size / scale, 1),
+                                                        scale,
+                                                        GTK_ICON_LOOKUP_USE_BUILTIN,
+                                                        NULL);
+#else
+    entry->pixbuf = gtk_icon_theme_load_icon (gtk_icon_theme_get_default (),
+                                              name,
+                                              size,
+                                              GTK_ICON_LOOKUP_USE_BUILTIN,
+                                              NULL);
+#endif
+
+    /* failed lookups are not cached, the theme may still be loading */
+
+    if (entry->pixbuf != NULL) {
+        entry->name     = g_strdup (name);
+        entry->size     = size;
+        entry->scale    = scale;
+        entry->last_use = icon_cache_clock;
+    }
+
+    return entry->pixbuf;
+}
+
+static void prewarm_icon_cache (gint size, gint scale)
+{
+    gboolean debug_output = configuration.debug_output;
+    gint icon_state, bucket;
+
+    if (size <= 0) {
+        return;
+    }
+
+    if (string_tables_ready == FALSE) {
+        init_string_tables ();
+    }
+
+    /* every icon name that get_icon_name can produce for the configured icon type */
+
+    configuration.debug_output = FALSE;
+
+    get_icon_pixbuf ("ac-adapter", size, scale);
+
+    for (icon_state = 0; icon_state < ICON_STATE_COUNT; icon_state++) {
+        for (bucket = 0; bucket < ICON_BUCKETS; bucket++) {
+            if (icon_state == ICON_STATE_MISSING && bucket > 0) {
+                continue; /* a missing battery has one icon */
+            }
+
+            if (icon_state == ICON_STATE_CHARGED && bucket < ICON_BUCKETS - 1) {
+                continue; /* a charged battery is always displayed full */
+            }
+
+            get_icon_pixbuf (icon_names[configuration.icon_type][icon_state][bucket], size, scale);
+        }
+    }
+
+    configuration.debug_output = debug_output;
+}
+
+static void flush_icon_cache (void)
+{
+    gint i;
+
+    for (i = 0; i < ICON_CACHE_SIZE; i++) {
+        g_free (icon_cache[i].name); icon_cache[i].name = NULL;
+        if (icon_cache[i].pixbuf != NULL) {
+            g_object_unref (icon_cache[i].pixbuf);
+            icon_cache[i].pixbuf = NULL;
+        }
+    }
+}
+
+static void on_icon_theme_changed (GtkIconTheme *icon_theme, struct icon *tray_icon)
+{
+    if (configuration.debug_output == TRUE) {
+        g_printf ("icon cache: theme changed, flushing\n");
+    }
+
+    flush_icon_cache ();
+
+    /* reload the current icon from the new theme */
+
+    tray_icon->size = 0;
+    set_tray_icon (tray_icon, NULL);
+}
+
+static void set_tray_icon_tooltip (struct icon *tray_icon, const gchar *tooltip)
+{
+    gchar tooltip_string[STR_LTH];
+    gint seconds;
+
+    /* a NULL tooltip refreshes the countdown of the grace periods */
+
+    if (tooltip != NULL) {
+        g_free (tray_icon->tooltip);
+        tray_icon->tooltip = g_strdup (tooltip);
+    }
+
+    g_strlcpy (tooltip_string, tray_icon->tooltip, STR_LTH);
+
+    if (critical_grace_period.source != 0) {
+        seconds = (gint)((critical_grace_period.deadline - get_monotonic_time () + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC);
+
+        g_strlcat (tooltip_string, "\n", STR_LTH);
+        g_snprintf (tooltip_string + strlen (tooltip_string), STR_LTH - strlen (tooltip_string),
+            g_dngettext (NULL, "Critical battery level command in %d second", "Critical battery level command in %d seconds", MAX (seconds, 0)), MAX (seconds, 0));
+    } else if (low_grace_period.source != 0) {
+        seconds = (gint)((low_grace_period.deadline - get_monotonic_time () + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC);
+
+        g_strlcat (tooltip_string, "\n", STR_LTH);
+        g_snprintf (tooltip_string + strlen (tooltip_string), STR_LTH - strlen (tooltip_string),
+            g_dngettext (NULL, "Low battery level command in %d second", "Low battery level command in %d seconds", MAX (seconds, 0)), MAX (seconds, 0));
+    }
+
+    if (tray_icon->gtk_icon != NULL) {
+        gtk_status_icon_set_tooltip_text (tray_icon->gtk_icon, tooltip_string);
+    }
+}
+
+static void set_tray_icon_view (struct icon *tray_icon, gint state, gint icon_state, gint percentage, gint time)
+{
+    struct view view;
+
+    view.state          = state;
+    view.icon_state     = icon_state;
+    view.percentage     = percentage;
+    view.time           = time;
+    view.rough_estimate = time >= 0 && last_time_confidence < ESTIMATOR_LOW_CONFIDENCE;
+
+    /* nothing visible changed, neither the strings nor the tray icon are touched */
+
+    tray_icon_view_ticks++;
+
+    if (memcmp (&view, &tray_icon_view, sizeof (view)) == 0) {
+        tray_icon_view_hits++;
+
+        if (configuration.debug_output == TRUE) {
+            g_printf ("view: unchanged (%u/%u updates unchanged)\n", tray_icon_view_hits, tray_icon_view_ticks);
+        }
+
+        return;
+    }
+
+    tray_icon_view = view;
+    tray_icon_view_serial++;
+
+    set_tray_icon_tooltip (tray_icon, get_tooltip_string (get_battery_string (state, percentage), get_time_string (time)));
+    set_tray_icon (tray_icon, get_icon_name (icon_state, percentage));
+}
+
+static void reset_tray_icon_view (void)
+{
+    tray_icon_view.state = -1;
+    tray_icon_view_serial++;
+}
+
+static gboolean resize_tray_icon (GtkStatusIcon *gtk_icon, gint size, struct icon *tray_icon)
+{
+    g_return_val_if_fail (tray_icon != NULL, FALSE);
+
+    set_tray_icon (tray_icon, NULL);
+
+    return TRUE;
+}
+
+static gboolean update_tray_icon (struct icon *tray_icon)
+{
+    gint64 start;
+
+    g_return_val_if_fail (tray_icon != NULL, FALSE);
+
+    /* with the sampler thread, the update runs when the sample it requested is ready */
+
+    if (request_sample (tray_icon) == TRUE) {
+        return TRUE;
+    }
+
+    stats.ticks++;
+
+    /* the trace holds the start of each update, the replay applies the values recorded up to the virtual time */
+
+#ifdef WITH_TRACE
+    if (trace_fd >= 0) {
+        add_trace_tick (get_suspend_offset (), uevent_source != 0, uevent_battery_changes, sample_stale);
+    } else if (replay_data != NULL) {
+        apply_replay_ticks (&uevent_battery_changes, &sample_stale);
+    }
+#endif
+
+    if (configuration_changed == TRUE) {
+        reload_configuration (tray_icon);
+    }
+
+    /* after a resume, this update is the fresh sample and re-evaluates the low/critical levels at once */
+
+    check_suspend ();
+
+    start = start_stats_latency ();
+    update_tray_icon_status (tray_icon);
+    add_stats_latency (STATS_TICK, start);
+
+    /* with --status, cbatticon exits after this update, no command is spawned and no update is scheduled */
+
+    if (configuration.status_only == FALSE) {
+        complete_grace_periods ();
+        schedule_tray_icon_update (tray_icon);
+    }
+
+    if (configuration.debug_output == TRUE) {
+        GString *report = g_string_new ("cache: ");
+
+        append_sysattr_cache_counters (report, "", "; ");
+
+        if (report->len > strlen ("cache: ")) {
+            g_printf ("%s\n", report->str);
+        }
+
+        g_string_free (report, TRUE);
+    }
+
+    if (configuration.headless == TRUE && replay_data == NULL) {
+        write_headless_status (tray_icon);
+    }
+
+#ifdef WITH_SOCKET
+    publish_socket_status (scheduler_status, scheduler_percentage, scheduler_time);
+#endif
+
+#ifdef WITH_SHM
+    publish_shm_state (scheduler_status, scheduler_percentage, scheduler_time, sample_stale);
+#endif
+
+#ifdef WITH_HISTORY
+    if (scheduler_status != -1) {
+        add_history_record (scheduler_status, scheduler_percentage);
+    }
+#endif
+
+#ifdef WITH_TRACE
+    if (trace_fd >= 0) {
+        flush_trace ();
+    } else if (replay_data != NULL) {
+        log_replay_update (scheduler_status, scheduler_percentage, scheduler_time);
+    }
+#endif
+
+    return TRUE;
+}
+
+static gboolean on_update_timeout (struct icon *tray_icon)
+{
+    update_source = 0;
+
+    update_tray_icon (tray_icon);
+
+    return FALSE;
+}
+
+static void schedule_tray_icon_update (struct icon *tray_icon)
+{
+    gdouble interval = configuration.update_interval;
+    gdouble forecast = -1;
+    gboolean deadline = FALSE;
+    gboolean uevents = uevent_source != 0;
+    const gchar *reason;
+
+#ifdef WITH_TRACE
+    /* a replay is scheduled as the recording was, with or without uevents */
+
+    if (replay_data != NULL && get_replay_uevents () == TRUE) {
+        uevents = TRUE;
+    }
+#endif
+
+    switch (scheduler_status) {
+        case MISSING:
+        case UNKNOWN:
+        case CHARGED:
+            interval = configuration.max_interval;
+            reason   = "idle";
+            break;
+
+        case CHARGING:
+            interval = configuration.update_interval * SCHEDULER_CHARGING_FACTOR;
+            reason   = "charging";
+            break;
+
+        case DISCHARGING:
+        case NOTCHARGING:
+            /* polling is only a slow fallback when the battery driver (or upowerd) emits change events */
+
+            if ((uevents == TRUE || configuration.backend == BACKEND_UPOWER) &&
+                uevent_battery_changes == TRUE) {
+                interval *= UEVENT_FALLBACK_FACTOR;
+            }
+
+            /* speed up when approaching a threshold and wake up when it is forecast to be crossed */
+
+            forecast = get_threshold_forecast (scheduler_percentage);
+            if (forecast >= 0 && forecast < interval * 2) {
+                interval = MAX (forecast / 2, configuration.min_interval);
+            }
+
+            reason = "discharging";
+            break;
+
+        default:
+            reason = battery_path == NULL ? "ac only" : "no status";
+
+            if (battery_path == NULL) {
+                interval = configuration.max_interval;
+            }
+            break;
+    }
+
+    /* during a grace period, sample often to cancel it as soon as the battery is no longer discharging */
+
+    if (low_grace_period.source != 0 || critical_grace_period.source != 0) {
+        interval = configuration.min_interval;
+        reason   = "grace period";
+    }
+
+    /* without uevents nor UPower signals, AC changes are only noticed by polling */
+
+    if (uevents == FALSE && configuration.backend == BACKEND_SYSFS) {
+        interval = MIN (interval, configuration.update_interval);
+    }
+
+    interval = CLAMP (interval, configuration.min_interval, configuration.max_interval);
+
+    if (forecast >= 0 && forecast < interval) {
+        interval = forecast;
+        deadline = TRUE;
+        reason   = "threshold deadline";
+    }
+
+    if (update_source != 0) {
+        remove_timeout (update_source);
+    }
+
+    /* whole seconds are grouped with other wakeups, deadlines need a precise timer */
+
+    if (deadline == TRUE) {
+        update_source = add_timeout ((guint)(interval * 1000.0), (GSourceFunc)on_update_timeout, (gpointer)tray_icon);
+    } else {
+        update_source = add_timeout_seconds ((guint)interval, (GSourceFunc)on_update_timeout, (gpointer)tray_icon);
+    }
+
+    arm_suspend_watchdog (interval);
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("scheduler: status %d, percentage %d, forecast %.1f seconds, next update in %.1f seconds (%s)\n",
+            scheduler_status, scheduler_percentage, forecast, interval, reason);
+    }
+}
+
+static gdouble get_threshold_forecast (gint percentage)
+{
+    gdouble threshold, threshold_capacity;
+
+    if (last_current_rate <= 0 || last_full_capacity <= 0 || last_remaining_capacity < 0) {
+        return -1;
+    }
+
+    /* the next threshold to be crossed (the low and critical levels are reached when percentage <= level) */
+
+    if (percentage > configuration.low_level)
+        threshold = configuration.low_level;
+    else if (percentage > configuration.critical_level)
+        threshold = configuration.critical_level;
+    else
+        return -1;
+
+    /* the percentage is floored, the threshold is reached as soon as the capacity is below threshold + 1 percent */
+
+    threshold_capacity = (threshold + 1) * last_full_capacity / 100.0;
+
+    return fmax (last_remaining_capacity - threshold_capacity, 0) / last_current_rate * 3600.0;
+}
+
+static void update_tray_icon_status (struct icon *tray_icon)
+{
+    gboolean battery_present = FALSE;
+    gboolean ac_online       = FALSE;
+
+    gint battery_status            = -1;
+    static gint old_battery_status = -1;
+
+    /* battery statuses:                                      */
+    /* not present => ac_only, battery_missing                */
+    /* present     => charging, charged, discharging, unknown */
+    /* (present and not present are exclusive)                */
+
+    static gboolean ac_only                = FALSE;
+    static gboolean battery_low            = FALSE;
+    static gboolean battery_critical       = FALSE;
+    static gboolean spawn_command_low      = FALSE;
+    static gboolean spawn_command_critical = FALSE;
+
+    gint percentage, time, view_state;
+
+#ifdef WITH_NOTIFY
+    static NotifyNotification *notification = NULL;
+#endif
+
+    /* start a new sample of the power supplies */
+
+    sampler_tick++;
+
+    scheduler_status     = -1;
+    scheduler_percentage = -1;
+    scheduler_time       = -1;
+
+    /* update power supplies */
+
+    if (changed_power_supplies () == TRUE)
+    {
+        gchar *old_battery_path = g_strdup (battery_path);
+
+        get_power_supplies ();
+        reset_tray_icon_view ();
+
+        /* a device that appears or a rescan keeps the levels and the grace periods of the same battery */
+
+        if (battery_path != NULL && g_strcmp0 (battery_path, old_battery_path) != 0) {
+            cancel_grace_periods (TRUE);
+
+            old_battery_status = -1;
+
+            ac_only                = FALSE;
+            battery_low            = FALSE;
+            battery_critical       = FALSE;
+            spawn_command_low      = FALSE;
+            spawn_command_critical = FALSE;
+        }
+
+        g_free (old_battery_path);
+    }
+
+    /* update tray icon for AC only */
+
+    if (battery_path == NULL) {
+        cancel_grace_periods (TRUE);
+
+        old_battery_status = -1;
+
+        battery_low            = FALSE;
+        battery_critical       = FALSE;
+        spawn_command_low      = FALSE;
+        spawn_command_critical = FALSE;
+
+        if (ac_only == FALSE) {
+            ac_only = TRUE;
+
+            NOTIFY_MESSAGE (&notification, _("AC only, no battery!"), NULL, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_NORMAL);
+
+            set_tray_icon_tooltip (tray_icon, _("AC only, no battery!"));
+            set_tray_icon (tray_icon, "ac-adapter");
+            reset_tray_icon_view ();
+        }
+
+        return;
+    }
+
+    /* update tray icon for battery */
+
+    if (get_batteries_present (&battery_present) == FALSE) {
+        return;
+    }
+
+    if (battery_present == FALSE) {
+        battery_status = MISSING;
+    } else {
+        if (get_batteries_status (&battery_status) == FALSE) {
+            return;
+        }
+
+        /* workaround for limited/bugged batteries/drivers */
+        /* that unduly return unknown status               */
+
+        if (battery_status == UNKNOWN && get_ac_online (&ac_sysattrs, &ac_online) == TRUE) {
+            if (ac_online == TRUE) {
+                battery_status = CHARGING;
+
+                if (get_battery_charge (FALSE, &percentage, NULL) == TRUE && percentage >= 99) {
+                    battery_status = CHARGED;
+                }
+            } else {
+                battery_status = DISCHARGING;
+            }
+        }
+    }
+
+    /* the low/critical level commands are only spawned while discharging */
+
+    if (battery_status != DISCHARGING && battery_status != NOTCHARGING) {
+        cancel_grace_periods (FALSE);
+    }
+
+    #define HANDLE_BATTERY_STATUS(PCT,TIM,EXP,URG)                                                          \
+                                                                                                            \
+            percentage = PCT;                                                                               \
+                                                                                                            \
+            if (old_battery_status != battery_status) {                                                     \
+                old_battery_status  = battery_status;                                                       \
+                NOTIFY_MESSAGE (&notification, get_battery_string (battery_status, percentage),             \
+                    get_time_string (TIM), EXP, URG);                                                       \
+            }                                                                                               \
+                                                                                                            \
+            set_tray_icon_view (tray_icon, battery_status, battery_status, percentage, TIM);                \
+                                                                                                            \
+            scheduler_status     = battery_status;                                                          \
+            scheduler_percentage = percentage;                                                              \
+            scheduler_time       = TIM;
+
+    switch (battery_status) {
+        case MISSING:
+            HANDLE_BATTERY_STATUS (0, -1, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_NORMAL)
+            break;
+
+        case UNKNOWN:
+            HANDLE_BATTERY_STATUS (0, -1, NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_NORMAL)
+            break;
+
+        case CHARGED:
+            HANDLE_BATTERY_STATUS (100, -1, NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_NORMAL)
+            break;
+
+        case CHARGING:
+            if (old_battery_status != CHARGING) {
+                reset_battery_time_estimation ();
+            }
+
+            if (get_battery_charge (FALSE, &percentage, &time) == FALSE) {
+                return;
+            }
+
+            HANDLE_BATTERY_STATUS (percentage, time, NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_NORMAL)
+            break;
+
+        case DISCHARGING:
+        case NOTCHARGING:
+            if (old_battery_status != DISCHARGING) {
+                reset_battery_time_estimation ();
+            }
+
+            if (get_battery_charge (TRUE, &percentage, &time) == FALSE) {
+                return;
+            }
+
+            view_state = battery_status;
+
+            if (old_battery_status != DISCHARGING) {
+                old_battery_status  = DISCHARGING;
+                NOTIFY_MESSAGE (&notification, get_battery_string (battery_status, percentage), get_time_string (time), NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_NORMAL);
+
+                battery_low            = FALSE;
+                battery_critical       = FALSE;
+                spawn_command_low      = FALSE;
+                spawn_command_critical = FALSE;
+            }
+
+            if (battery_low == FALSE && percentage <= configuration.low_level) {
+                battery_low = TRUE;
+
+                view_state = LOW_LEVEL;
+                NOTIFY_MESSAGE (&notification, get_battery_string (LOW_LEVEL, percentage), get_time_string (time), NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_NORMAL);
+
+                spawn_command_low = TRUE;
+            }
+
+            if (battery_critical == FALSE && percentage <= configuration.critical_level) {
+                battery_critical = TRUE;
+
+                view_state = CRITICAL_LEVEL;
+                NOTIFY_MESSAGE (&notification, get_battery_string (CRITICAL_LEVEL, percentage), get_time_string (time), NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_CRITICAL);
+
+                spawn_command_critical = TRUE;
+            }
+
+            set_tray_icon_view (tray_icon, view_state, battery_status, percentage, time);
+
+            scheduler_status     = battery_status;
+            scheduler_percentage = percentage;
+            scheduler_time       = time;
+
+            if (spawn_command_low == TRUE) {
+                spawn_command_low = FALSE;
+                start_grace_period (&low_grace_period, tray_icon);
+            }
+
+            if (spawn_command_critical == TRUE) {
+                spawn_command_critical = FALSE;
+                start_grace_period (&critical_grace_period, tray_icon);
+            }
+            break;
+    }
+}
+
+/*
+ * grace period functions
+ */
+
+static void start_grace_period (struct grace_period *grace_period, struct icon *tray_icon)
+{
+    if (grace_period->source != 0 || grace_period->expired == TRUE || configuration.status_only == TRUE) {
+        return;
+    }
+
+    if (grace_period->level == LOW_LEVEL) {
+        if (configuration.command_low_level == NULL) {
+            return;
+        }
+
+        log_event (LOG_CRIT, g_dngettext (NULL, "Spawning low battery level command in %d second: %s", "Spawning low battery level command in %d seconds: %s", LOW_LEVEL_GRACE_PERIOD),
+                   LOW_LEVEL_GRACE_PERIOD, configuration.command_low_level);
+    } else {
+        if (configuration.command_critical_level == NULL) {
+            return;
+        }
+
+        log_event (LOG_CRIT, g_dngettext (NULL, "Spawning critical battery level command in %d second: %s", "Spawning critical battery level command in %d seconds: %s", CRITICAL_LEVEL_GRACE_PERIOD),
+                   CRITICAL_LEVEL_GRACE_PERIOD, configuration.command_critical_level);
+    }
+
+    grace_period->tray_icon     = tray_icon;
+    grace_period->deadline      = get_monotonic_time () + grace_period->duration * G_USEC_PER_SEC;
+    grace_period->dispatch_time = get_monotonic_time () + G_USEC_PER_SEC;
+    grace_period->source        = add_timeout (1000, (GSourceFunc)on_grace_period_timeout, (gpointer)grace_period);
+
+    set_tray_icon_tooltip (tray_icon, NULL);
+}
+
+static void cancel_grace_periods (gboolean removed)
+{
+    if (low_grace_period.source != 0 || low_grace_period.expired == TRUE) {
+        if (low_grace_period.source != 0) {
+            remove_timeout (low_grace_period.source);
+        }
+
+        low_grace_period.source  = 0;
+        low_grace_period.expired = FALSE;
+
+        if (removed == TRUE) {
+            log_event (LOG_NOTICE, _("Skipping low battery level command, battery removed"));
+        } else {
+            log_event (LOG_NOTICE, _("Skipping low battery level command, no longer discharging"));
+        }
+        set_tray_icon_tooltip (low_grace_period.tray_icon, NULL);
+    }
+
+    if (critical_grace_period.source != 0 || critical_grace_period.expired == TRUE) {
+        if (critical_grace_period.source != 0) {
+            remove_timeout (critical_grace_period.source);
+        }
+
+        critical_grace_period.source  = 0;
+        critical_grace_period.expired = FALSE;
+
+        if (removed == TRUE) {
+            log_event (LOG_NOTICE, _("Skipping critical battery level command, battery removed"));
+        } else {
+            log_event (LOG_NOTICE, _("Skipping critical battery level command, no longer discharging"));
+        }
+        set_tray_icon_tooltip (critical_grace_period.tray_icon, NULL);
+    }
+}
+
+static gboolean on_grace_period_timeout (struct grace_period *grace_period)
+{
+    gint64 now = get_monotonic_time ();
+    gint64 latency = now - grace_period->dispatch_time;
+
+    /* the dispatch latency of the countdown measures the responsiveness of the main loop */
+
+    grace_period_latency = MAX (grace_period_latency, latency);
+    grace_period->dispatch_time = now + G_USEC_PER_SEC;
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("grace period: level %d, %.1f seconds left, dispatch latency %" G_GINT64_FORMAT " us (max %" G_GINT64_FORMAT " us)\n",
+            grace_period->level, (gdouble)(grace_period->deadline - now) / G_USEC_PER_SEC, latency, grace_period_latency);
+    }
+
+    if (now < grace_period->deadline) {
+        set_tray_icon_tooltip (grace_period->tray_icon, NULL);
+        return TRUE;
+    }
+
+    /* last regular update, it cancels the grace period if the battery is no longer discharging */
+    /* with the sampler thread, it only requests the sample: the command waits for its update */
+
+    grace_period->source  = 0;
+    grace_period->expired = TRUE;
+    grace_period->request = sampler_requests + 1;
+
+    update_tray_icon (grace_period->tray_icon);
+
+    return FALSE;
+}
+
+static void complete_grace_periods (void)
+{
+    struct grace_period *grace_periods[] = { &low_grace_period, &critical_grace_period };
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (grace_periods); i++) {
+        struct grace_period *grace_period = grace_periods[i];
+
+        if (grace_period->expired == FALSE) {
+            continue;
+        }
+
+        /* a stale sample, or one requested before the deadline, may not show the AC plugged during the countdown */
+
+        if (sampler_thread != NULL &&
+            (sample_stale == TRUE || current_sample == NULL || current_sample->request < grace_period->request)) {
+            continue;
+        }
+
+        grace_period->expired = FALSE;
+        set_tray_icon_tooltip (grace_period->tray_icon, NULL);
+
+        spawn_level_command (grace_period->level);
+    }
+}
+
+static void spawn_level_command (gint level)
+{
+    GError *error = NULL;
+
+    /* a replay logs the commands it would spawn */
+
+    if (replay_data != NULL) {
+        log_event (LOG_CRIT, "command: %s", level == LOW_LEVEL ? configuration.command_low_level : configuration.command_critical_level);
+        return;
+    }
+
+    if (level == LOW_LEVEL) {
+        if (g_spawn_command_line_async (configuration.command_low_level, &error) == FALSE) {
+            syslog (LOG_CRIT, _("Cannot spawn low battery level command: %s\n"), error->message);
+
+            g_printerr (_("Cannot spawn low battery level command: %s\n"), error->message);
+            g_error_free (error); error = NULL;
+
+#ifdef WITH_NOTIFY
+            static NotifyNotification *spawn_notification = NULL;
+            NOTIFY_MESSAGE (&spawn_notification, _("Cannot spawn low battery level command!"), configuration.command_low_level, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_CRITICAL);
+#endif
+        }
+    } else {
+        if (g_spawn_command_line_async (configuration.command_critical_level, &error) == FALSE) {
+            syslog (LOG_CRIT, _("Cannot spawn critical battery level command: %s\n"), error->message);
+
+            g_printerr (_("Cannot spawn critical battery level command: %s\n"), error->message);
+            g_error_free (error); error = NULL;
+
+#ifdef WITH_NOTIFY
+            static NotifyNotification *spawn_notification = NULL;
+            NOTIFY_MESSAGE (&spawn_notification, _("Cannot spawn critical battery level command!"), configuration.command_critical_level, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_CRITICAL);
+#endif
+        }
+    }
+}
+
+static void on_tray_icon_click (struct icon *tray_icon, gpointer user_data)
+{
+    GError *error = NULL;
+
+    if (configuration.command_left_click != NULL) {
+        if (g_spawn_command_line_async (configuration.command_left_click, &error) == FALSE) {
+            syslog (LOG_ERR, _("Cannot spawn left click command: %s\n"), error->message);
+
+            g_printerr (_("Cannot spawn left click command: %s\n"), error->message);
+            g_error_free (error); error = NULL;
+
+#ifdef WITH_NOTIFY
+            static NotifyNotification *spawn_notification = NULL;
+            NOTIFY_MESSAGE (&spawn_notification, _("Cannot spawn left click command!"), configuration.command_left_click, NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_CRITICAL);
+#endif
+        }
+    }
+}
+
+#ifdef WITH_NOTIFY
+static void notify_message (NotifyNotification **notification, gchar *summary, gchar *body, gint timeout, NotifyUrgency urgency)
+{
+    struct pending_notification *pending = NULL;
+    GList *link;
+
+    g_return_if_fail (notification != NULL);
+    g_return_if_fail (summary != NULL);
+
+    if (configuration.hide_notification == TRUE) {
+        return;
+    }
+
+    /* a replay logs the notifications it would show, before any coalescing */
+
+    if (replay_data != NULL) {
+        log_event (LOG_INFO, "notification: %s%s%s", summary, body != NULL ? ", " : "", body != NULL ? body : "");
+        return;
+    }
+
+    /* a queued message of the same category is superseded */
+
+    for (link = notification_queue.head; link != NULL; link = link->next) {
+        if (((struct pending_notification *)link->data)->notification == notification) {
+            pending = link->data;
+            g_free (pending->summary);
+            g_free (pending->body);
+            notification_dropped++;
+
+            if (configuration.debug_output == TRUE) {
+                g_printf ("notification: superseded (%u dropped)\n", notification_dropped);
+            }
+            break;
+        }
+    }
+
+    if (pending == NULL) {
+        pending = g_new0 (struct pending_notification, 1);
+        pending->notification = notification;
+        pending->queue_time   = get_stats_time ();
+        g_queue_push_tail (&notification_queue, pending);
+    }
+
+    pending->summary = g_strdup (summary);
+    pending->body    = g_strdup (body);
+    pending->timeout = timeout;
+    pending->urgency = urgency;
+
+    dispatch_notifications (0);
+}
+
+static void dispatch_notifications (guint delay)
+{
+    if (notification_in_flight == TRUE || notification_dispatch_source != 0 || g_queue_is_empty (&notification_queue) == TRUE) {
+        return;
+    }
+
+    /* the messages of an update are all queued before the first one is dispatched */
+
+    if (delay == 0) {
+        notification_dispatch_source = g_idle_add_full (G_PRIORITY_LOW, on_notification_dispatch, NULL, NULL);
+    } else {
+        notification_dispatch_source = g_timeout_add (delay, on_notification_dispatch, NULL);
+    }
+}
+
+static gboolean on_notification_dispatch (gpointer user_data)
+{
+    struct pending_notification *pending = NULL;
+    gint64 now = get_stats_time ();
+    gint64 *last_time, wait = G_MAXINT64;
+    GVariantBuilder hints;
+    GList *link;
+    gint id;
+
+    notification_dispatch_source = 0;
+
+    /* libnotify is initialized after the first icon is drawn, the notifications wait for it */
+
+    if (notify_is_initted () == FALSE && configuration.hide_notification == FALSE) {
+        if (notify_init (CBATTICON_STRING) == TRUE) {
+            profile_startup ("libnotify");
+        } else {
+            g_printerr (_("Cannot initialize libnotify, the notifications are disabled\n"));
+            configuration.hide_notification = TRUE;
+        }
+    }
+
+    if (configuration.hide_notification == TRUE) {
+        while (g_queue_is_empty (&notification_queue) == FALSE) {
+            free_pending_notification (g_queue_pop_head (&notification_queue));
+        }
+        return FALSE;
+    }
+
+    /* the session bus is connected once, the queue waits for it */
+
+    if (notification_bus == NULL) {
+        notification_in_flight = TRUE;
+        g_bus_get (G_BUS_TYPE_SESSION, NULL, on_notification_bus, NULL);
+        return FALSE;
+    }
+
+    if (notification_times == NULL) {
+        notification_times = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+    }
+
+    /* the oldest message whose category is not rate limited */
+
+    for (link = notification_queue.head; link != NULL; link = link->next) {
+        struct pending_notification *candidate = link->data;
+
+        last_time = g_hash_table_lookup (notification_times, candidate->notification);
+        if (last_time == NULL || now - *last_time >= NOTIFY_RATE_LIMIT * G_GINT64_CONSTANT (1000000)) {
+            pending = candidate;
+            g_queue_delete_link (&notification_queue, link);
+            break;
+        }
+
+        wait = MIN (wait, *last_time + NOTIFY_RATE_LIMIT * G_GINT64_CONSTANT (1000000) - now);
+    }
+
+    if (pending == NULL) {
+        dispatch_notifications ((guint)(wait / 1000000) + 1);
+        return FALSE;
+    }
+
+    last_time = g_new (gint64, 1);
+    *last_time = now;
+    g_hash_table_replace (notification_times, pending->notification, last_time);
+
+    /* the notification holds the id given by the daemon, a message replaces the previous one of its category */
+
+    if (*pending->notification == NULL) {
+#if NOTIFY_CHECK_VERSION (0, 7, 0)
+        *pending->notification = notify_notification_new (pending->summary, pending->body, NULL);
+#else
+        *pending->notification = notify_notification_new (pending->summary, pending->body, NULL, NULL);
+#endif
+    } else {
+        notify_notification_update (*pending->notification, pending->summary, pending->body, NULL);
+    }
+
+    notify_notification_set_timeout (*pending->notification, pending->timeout);
+    notify_notification_set_urgency (*pending->notification, pending->urgency);
+    g_object_get (*pending->notification, "id", &id, NULL);
+
+    g_variant_builder_init (&hints, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (&hints, "{sv}", "urgency", g_variant_new_byte ((guchar)pending->urgency));
+
+    pending->dispatch_time = now;
+    notification_in_flight = TRUE;
+
+    /* the daemon is given NOTIFY_TIMEOUT to answer, a hung daemon only costs the message in flight */
+
+    g_dbus_connection_call (notification_bus, "org.freedesktop.Notifications", "/org/freedesktop/Notifications",
+        "org.freedesktop.Notifications", "Notify",
+        g_variant_new ("(susssasa{sv}i)", notify_get_app_name (), (guint32)id, "", pending->summary,
+            pending->body != NULL ? pending->body : "", NULL, &hints, pending->timeout),
+        G_VARIANT_TYPE ("(u)"), G_DBUS_CALL_FLAGS_NONE, NOTIFY_TIMEOUT, NULL, on_notification_shown, pending);
+
+    return FALSE;
+}
+
+static void on_notification_bus (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+    GError *error = NULL;
+
+    notification_in_flight = FALSE;
+    notification_bus = g_bus_get_finish (result, &error);
+
+    if (notification_bus == NULL) {
+        g_printerr (_("Cannot connect to the session bus, the notifications are disabled: %s\n"), error->message);
+        g_error_free (error); error = NULL;
+        configuration.hide_notification = TRUE;
+    }
+
+    dispatch_notifications (0);
+}
+
+static void on_notification_shown (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+    GError *error = NULL;
+    struct pending_notification *pending = user_data;
+    GVariant *reply;
+    guint32 id;
+
+    add_stats_latency (STATS_NOTIFICATION, pending->dispatch_time);
+
+    reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), result, &error);
+    if (reply == NULL) {
+        /* the daemon is slow or hung, the queue keeps one message per category until it answers */
+
+        if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT) == TRUE) {
+            notification_stalls++;
+        }
+
+        if (configuration.debug_output == TRUE) {
+            g_printf ("notification: cannot show \"%s\" (%s), %u queued, %u stalls\n", pending->summary, error->message,
+                g_queue_get_length (&notification_queue), notification_stalls);
+        }
+
+        g_error_free (error); error = NULL;
+    } else {
+        g_variant_get (reply, "(u)", &id);
+        g_variant_unref (reply);
+
+        g_object_set (*pending->notification, "id", (gint)id, NULL);
+
+        if (configuration.debug_output == TRUE) {
+            g_printf ("notification: shown \"%s\" in %.1f ms (%.1f ms after it was queued), %u dropped, %u stalls\n", pending->summary,
+                (get_stats_time () - pending->dispatch_time) / 1e6, (get_stats_time () - pending->queue_time) / 1e6, notification_dropped, notification_stalls);
+        }
+    }
+
+    free_pending_notification (pending);
+
+    notification_in_flight = FALSE;
+    dispatch_notifications (0);
+}
+
+static void free_pending_notification (struct pending_notification *pending)
 {
-    estimation_remaining_capacity = -1;
-    estimation_time               = -1;
-    g_timer_start (estimation_timer);
+    g_free (pending->summary);
+    g_free (pending->body);
+    g_free (pending);
 }
+#endif
 
-/*
- * tray icon functions
- */
-
-static void create_tray_icon (void)
+static gchar* get_tooltip_string (gchar *battery, gchar *time)
 {
-    struct icon* tray_icon = g_malloc (sizeof(*tray_icon));
-    tray_icon->gtk_icon = gtk_status_icon_new ();
-    tray_icon->name = g_strdup("");
-    tray_icon->size = 0;
+    static gchar tooltip_string[STR_LTH];
 
-    gtk_status_icon_set_tooltip_text (tray_icon->gtk_icon, CBATTICON_STRING);
-    gtk_status_icon_set_visible (tray_icon->gtk_icon, TRUE);
+    tooltip_string[0] = '\0';
 
-    update_tray_icon (tray_icon);
-    g_timeout_add_seconds (configuration.update_interval, (GSourceFunc)update_tray_icon, (gpointer)tray_icon);
+    g_return_val_if_fail (battery != NULL, tooltip_string);
+
+    g_strlcpy (tooltip_string, battery, STR_LTH);
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("tooltip: %s\n", battery);
+    }
+
+    if (time != NULL) {
+        g_strlcat (tooltip_string, "\n", STR_LTH);
+        g_strlcat (tooltip_string, time, STR_LTH);
+
+        if (last_time_confidence < ESTIMATOR_LOW_CONFIDENCE) {
+            if (string_tables_ready == FALSE) {
+                init_string_tables ();
+            }
 
-    g_signal_connect (G_OBJECT (tray_icon->gtk_icon), "activate", G_CALLBACK (on_tray_icon_click), NULL);
-    g_signal_connect (G_OBJECT (tray_icon->gtk_icon), "size-changed", G_CALLBACK (resize_tray_icon), (gpointer)tray_icon);
+            g_strlcat (tooltip_string, string_table.rough_estimate, STR_LTH);
+        }
+
+        if (configuration.debug_output == TRUE) {
+            g_printf ("tooltip: %s\n", time);
+        }
+    }
+
+    return tooltip_string;
 }
 
-static void set_tray_icon (struct icon *tray_icon, const gchar *name)
+static gchar* get_battery_string (gint state, gint percentage)
 {
-    gint size = gtk_status_icon_get_size (tray_icon->gtk_icon);
+    static gchar battery_string[STR_LTH];
 
-    if (size == tray_icon->size && (name == NULL || g_strcmp0 (name, tray_icon->name) == 0)) {
-        return;
+    if (string_tables_ready == FALSE) {
+        init_string_tables ();
     }
 
-    tray_icon->size = size;
+    switch (state) {
+        case MISSING:
+        case UNKNOWN:
+        case CHARGED:
+            g_strlcpy (battery_string, string_table.battery[state], STR_LTH);
+            break;
 
-    if (name != NULL)
-    {
-        g_free (tray_icon->name);
-        tray_icon->name = g_strdup (name);
+        case DISCHARGING:
+        case NOTCHARGING:
+        case LOW_LEVEL:
+        case CRITICAL_LEVEL:
+        case CHARGING:
+            g_snprintf (battery_string, STR_LTH, string_table.battery[state], percentage);
+            break;
+
+        default:
+            battery_string[0] = '\0';
+            break;
     }
 
-    GdkPixbuf *pix = gtk_icon_theme_load_icon (gtk_icon_theme_get_default(),
-                                               tray_icon->name,
-                                               tray_icon->size,
-                                               GTK_ICON_LOOKUP_USE_BUILTIN,
-                                               NULL);
-    gtk_status_icon_set_from_pixbuf (tray_icon->gtk_icon, pix);
+    if (configuration.debug_output == TRUE) {
+        g_printf ("battery string: %s\n", battery_string);
+    }
+
+    return battery_string;
 }
 
-static gboolean resize_tray_icon (GtkStatusIcon *gtk_icon, gint size, struct icon *tray_icon)
+static gchar* get_time_string (gint minutes)
 {
-    g_return_val_if_fail (tray_icon != NULL, FALSE);
+    static gchar time_string[STR_LTH];
+    static gchar minutes_string[STR_LTH];
+    const gchar *hours_format;
+    gint hours;
 
-    set_tray_icon (tray_icon, NULL);
+    if (minutes < 0) {
+        return NULL;
+    }
 
-    return TRUE;
+    if (string_tables_ready == FALSE) {
+        init_string_tables ();
+    }
+
+    hours   = minutes / 60;
+    minutes = minutes % 60;
+
+    if (hours > 0) {
+        hours_format = hours < STRING_TABLE_HOURS ? string_table.hours_remaining[hours] :
+            g_dngettext (NULL, "%d hour, %s remaining", "%d hours, %s remaining", hours);
+
+        g_sprintf (minutes_string, string_table.minutes[minutes], minutes);
+        g_sprintf (time_string, hours_format, hours, minutes_string);
+    } else {
+        g_sprintf (time_string, string_table.minutes_remaining[minutes], minutes);
+    }
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("time string: %s\n", time_string);
+    }
+
+    return time_string;
 }
 
-static gboolean update_tray_icon (struct icon *tray_icon)
+static const gchar* get_icon_name (gint state, gint percentage)
 {
-    g_return_val_if_fail (tray_icon != NULL, FALSE);
+    const gchar *icon_name;
+    gint icon_state, bucket;
 
-    update_tray_icon_status (tray_icon);
+    if (string_tables_ready == FALSE) {
+        init_string_tables ();
+    }
 
-    return TRUE;
+    switch (state) {
+        case MISSING:
+        case UNKNOWN:
+            icon_state = ICON_STATE_MISSING;
+            break;
+
+        case CHARGING:
+            icon_state = ICON_STATE_CHARGING;
+            break;
+
+        case CHARGED:
+            icon_state = ICON_STATE_CHARGED;
+            break;
+
+        default:
+            icon_state = ICON_STATE_DISCHARGING;
+            break;
+    }
+
+    bucket = 0;
+    while (bucket < ICON_BUCKETS - 1 && percentage > icon_bucket_levels[bucket]) {
+        bucket++;
+    }
+
+    icon_name = icon_names[configuration.icon_type][icon_state][bucket];
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("icon name: %s\n", icon_name);
+    }
+
+    return icon_name;
 }
 
-static void update_tray_icon_status (struct icon *tray_icon)
+static void init_string_tables (void)
 {
-    GError *error = NULL;
+    gint n;
+
+    /* gettext returns the translations from the catalog mapped in memory, they are not copied */
+
+    string_table.battery[MISSING]        = _("Battery is missing!");
+    string_table.battery[UNKNOWN]        = _("Battery status is unknown!");
+    string_table.battery[CHARGED]        = _("Battery is charged!");
+    string_table.battery[CHARGING]       = _("Battery is charging (%i%%)");
+    string_table.battery[DISCHARGING]    = _("Battery is discharging (%i%% remaining)");
+    string_table.battery[NOTCHARGING]    = _("Battery is not charging (%i%% remaining)");
+    string_table.battery[LOW_LEVEL]      = _("Battery level is low! (%i%% remaining)");
+    string_table.battery[CRITICAL_LEVEL] = _("Battery level is critical! (%i%% remaining)");
+
+    for (n = 0; n < 60; n++) {
+        string_table.minutes_remaining[n] = g_dngettext (NULL, "%d minute remaining", "%d minutes remaining", n);
+        string_table.minutes[n]           = g_dngettext (NULL, "%d minute", "%d minutes", n);
+    }
 
-    gboolean battery_present = FALSE;
-    gboolean ac_online       = FALSE;
+    for (n = 0; n < STRING_TABLE_HOURS; n++) {
+        string_table.hours_remaining[n] = g_dngettext (NULL, "%d hour, %s remaining", "%d hours, %s remaining", n);
+    }
 
-    gint battery_status            = -1;
-    static gint old_battery_status = -1;
+    string_table.rough_estimate = _(" (rough estimate)");
 
-    /* battery statuses:                                      */
-    /* not present => ac_only, battery_missing                */
-    /* present     => charging, charged, discharging, unknown */
-    /* (present and not present are exclusive)                */
+    init_icon_names ();
 
-    static gboolean ac_only                = FALSE;
-    static gboolean battery_low            = FALSE;
-    static gboolean battery_critical       = FALSE;
-    static gboolean spawn_command_low      = FALSE;
-    static gboolean spawn_command_critical = FALSE;
+    string_tables_ready = TRUE;
+}
 
-    gint percentage, time;
-    gchar *battery_string, *time_string;
+static void init_icon_names (void)
+{
+    static const gchar *notification_levels[ICON_BUCKETS] = { "-020", "-040", "-060", "-080", "-100" };
+    static const gchar *standard_levels[ICON_BUCKETS]     = { "-caution", "-low", "-good", "-good", "-full" };
+    gint icon_type, icon_state, bucket;
 
-#ifdef WITH_NOTIFY
-    static NotifyNotification *notification = NULL;
-#endif
+    for (icon_type = 0; icon_type < ICON_TYPE_COUNT; icon_type++) {
+        gboolean notification = (icon_type == BATTERY_ICON_NOTIFICATION);
 
-    /* update power supplies */
+        for (icon_state = 0; icon_state < ICON_STATE_COUNT; icon_state++) {
+            for (bucket = 0; bucket < ICON_BUCKETS; bucket++) {
+                gchar *icon_name = icon_names[icon_type][icon_state][bucket];
 
-    if (changed_power_supplies () == TRUE)
-    {
-        get_power_supplies ();
+                g_strlcpy (icon_name, notification == TRUE ? "notification-battery" : "battery", ICON_NAME_LTH);
 
-        old_battery_status = -1;
+                if (icon_state == ICON_STATE_MISSING) {
+                    g_strlcat (icon_name, notification == TRUE ? "-empty" : "-missing", ICON_NAME_LTH);
+                } else {
+                    g_strlcat (icon_name, notification == TRUE ? notification_levels[bucket] : standard_levels[bucket], ICON_NAME_LTH);
 
-        ac_only                = FALSE;
-        battery_low            = FALSE;
-        battery_critical       = FALSE;
-        spawn_command_low      = FALSE;
-        spawn_command_critical = FALSE;
+                         if (icon_state == ICON_STATE_CHARGING) g_strlcat (icon_name, notification == TRUE ? "-plugged" : "-charging", ICON_NAME_LTH);
+                    else if (icon_state == ICON_STATE_CHARGED)  g_strlcat (icon_name, notification == TRUE ? "-plugged" : "-charged", ICON_NAME_LTH);
+                }
+
+                if (icon_type == BATTERY_ICON_SYMBOLIC) {
+                    g_strlcat (icon_name, "-symbolic", ICON_NAME_LTH);
+                }
+            }
+        }
     }
+}
 
-    /* update tray icon for AC only */
+/*
+ * headless functions
+ */
 
-    if (battery_path == NULL) {
-        if (ac_only == FALSE) {
-            ac_only = TRUE;
+static void write_headless_status (struct icon *tray_icon)
+{
+    static gchar *last_output = NULL;
+    static gboolean i3bar_header = FALSE;
+    static guint last_serial = 0;
+    static gint last_status = -2;
 
-            NOTIFY_MESSAGE (&notification, _("AC only, no battery!"), NULL, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_NORMAL);
+    const gchar *state;
+    gchar *text;
+    GString *output;
+    gboolean low, critical;
 
-            gtk_status_icon_set_tooltip_text (tray_icon->gtk_icon, _("AC only, no battery!"));
-            set_tray_icon (tray_icon, "ac-adapter");
-        }
+    /* the tray icon view and the status are unchanged, so is the output */
 
+    if (last_output != NULL && last_serial == tray_icon_view_serial && last_status == scheduler_status) {
         return;
     }
 
-    /* update tray icon for battery */
+    last_serial = tray_icon_view_serial;
+    last_status = scheduler_status;
 
-    if (get_battery_present (battery_path, &battery_present) == FALSE) {
-        return;
+    state    = get_state_string (scheduler_status);
+    low      = (scheduler_status == DISCHARGING || scheduler_status == NOTCHARGING) && scheduler_percentage <= configuration.low_level;
+    critical = (scheduler_status == DISCHARGING || scheduler_status == NOTCHARGING) && scheduler_percentage <= configuration.critical_level;
+
+    text   = get_output_string (configuration.output_template, state, scheduler_percentage, scheduler_time);
+    output = g_string_new (NULL);
+
+    switch (configuration.output) {
+        case OUTPUT_I3BAR:
+            g_string_append (output, "[{\"name\":\"battery\",\"instance\":\"" CBATTICON_STRING "\",\"full_text\":");
+            append_json_string (output, text);
+            g_string_append_printf (output, ",\"urgent\":%s}]", critical == TRUE ? "true" : "false");
+            break;
+
+        case OUTPUT_WAYBAR:
+            g_string_append (output, "{\"text\":");
+            append_json_string (output, text);
+            g_string_append (output, ",\"tooltip\":");
+            append_json_string (output, tray_icon->tooltip);
+            g_string_append_printf (output, ",\"class\":\"%s\",\"percentage\":%d}",
+                critical == TRUE ? "critical" : low == TRUE ? "low" : state, MAX (scheduler_percentage, 0));
+            break;
+
+        default:
+            g_string_append (output, text);
+            break;
     }
 
-    if (battery_present == FALSE) {
-        battery_status = MISSING;
+    g_free (text);
+
+    /* the status is written only when it changes */
+
+    if (g_strcmp0 (output->str, last_output) != 0) {
+        if (configuration.output == OUTPUT_I3BAR && configuration.status_only == FALSE) {
+            if (i3bar_header == FALSE) {
+                i3bar_header = TRUE;
+                g_print ("{\"version\":1}\n[\n");
+            }
+
+            g_print ("%s,\n", output->str);
+        } else {
+            g_print ("%s\n", output->str);
+        }
+
+        g_free (last_output);
+        last_output = g_string_free (output, FALSE);
     } else {
-        if (get_battery_status (&battery_status) == FALSE) {
-            return;
+        g_string_free (output, TRUE);
+    }
+}
+
+const gchar* get_state_string (gint status)
+{
+    switch (status) {
+        case MISSING:     return "missing";
+        case CHARGED:     return "charged";
+        case CHARGING:    return "charging";
+        case DISCHARGING: return "discharging";
+        case NOTCHARGING: return "not-charging";
+        default:          return (battery_path == NULL) ? "ac" : "unknown";
+    }
+}
+
+static gchar* get_output_string (const gchar *output_template, const gchar *state, gint percentage, gint time)
+{
+    GString *string = g_string_new (NULL);
+    const gchar *c;
+
+    /* %s: state, %p: percentage, %t: remaining time (h:mm), %%: percent sign */
+
+    for (c = output_template; *c != '\0'; c++) {
+        if (*c != '%' || *(c + 1) == '\0') {
+            g_string_append_c (string, *c);
+            continue;
         }
 
-        /* workaround for limited/bugged batteries/drivers */
-        /* that unduly return unknown status               */
+        switch (*++c) {
+            case 's':
+                g_string_append (string, state);
+                break;
 
-        if (battery_status == UNKNOWN && get_ac_online (ac_path, &ac_online) == TRUE) {
-            if (ac_online == TRUE) {
-                battery_status = CHARGING;
+            case 'p':
+                if (percentage >= 0) {
+                    g_string_append_printf (string, "%d", percentage);
+                } else if (g_str_has_prefix (c + 1, "%%") == TRUE) {
+                    c += 2; /* no percentage, no percent sign */
+                }
+                break;
 
-                if (get_battery_charge (FALSE, &percentage, NULL) == TRUE && percentage >= 99) {
-                    battery_status = CHARGED;
+            case 't':
+                if (time >= 0) {
+                    g_string_append_printf (string, "%d:%02d", time / 60, time % 60);
                 }
-            } else {
-                battery_status = DISCHARGING;
-            }
+                break;
+
+            default:
+                g_string_append_c (string, *c);
+                break;
         }
     }
 
-    #define HANDLE_BATTERY_STATUS(PCT,TIM,EXP,URG)                                                          \
-                                                                                                            \
-            percentage = PCT;                                                                               \
-                                                                                                            \
-            battery_string = get_battery_string (battery_status, percentage);                               \
-            time_string    = get_time_string (TIM);                                                         \
-                                                                                                            \
-            if (old_battery_status != battery_status) {                                                     \
-                old_battery_status  = battery_status;                                                       \
-                NOTIFY_MESSAGE (&notification, battery_string, time_string, EXP, URG);                      \
-            }                                                                                               \
-                                                                                                            \
-            gtk_status_icon_set_tooltip_text (tray_icon->gtk_icon, get_tooltip_string (battery_string, time_string)); \
-            set_tray_icon (tray_icon, get_icon_name (battery_status, percentage));
+    return g_strchomp (g_string_free (string, FALSE));
+}
+
+static void append_json_string (GString *string, const gchar *value)
+{
+    const gchar *c;
+
+    g_string_append_c (string, '"');
+
+    for (c = value != NULL ? value : ""; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\')
+            g_string_append_printf (string, "\\%c", *c);
+        else if (*c == '\n')
+            g_string_append (string, "\\n");
+        else if ((guchar)*c < 0x20)
+            g_string_append_printf (string, "\\u%04x", (guint)(guchar)*c);
+        else
+            g_string_append_c (string, *c);
+    }
+
+    g_string_append_c (string, '"');
+}
+
+/*
+ * sampler thread functions
+ */
+
+static void create_sampler_thread (void)
+{
+    GError *error = NULL;
+
+    sampler_event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sampler_event_fd < 0) {
+        g_printerr (_("Cannot create sampler thread: %s\n"), g_strerror (errno));
+        return;
+    }
+
+    g_unix_fd_add (sampler_event_fd, G_IO_IN, on_sample_ready, NULL);
+
+    /* the first job is handed over before the thread starts, every request has one */
+
+    set_sampler_job ();
+
+    sampler_thread = g_thread_try_new ("sampler", run_sampler_thread, NULL, &error);
+    if (sampler_thread == NULL) {
+        g_printerr (_("Cannot create sampler thread: %s\n"), error->message);
+        g_error_free (error); error = NULL;
+    }
+}
+
+static void set_sampler_job (void)
+{
+    struct sampler_job *job;
+    gint attribute;
+    guint i;
+
+    job = g_new0 (struct sampler_job, 1);
+    job->generation = ++sampler_generation;
+    job->uevent     = configuration.sampler == SAMPLER_UEVENT;
+    job->events     = uevent_source != 0;
+    job->timeout    = (gint64)configuration.sampler_timeout * 1000000;
+    job->count      = MIN (batteries->len, SAMPLER_SUPPLIES - 1) + 1;
+    job->fds        = g_malloc (job->count * sizeof (*job->fds));
+    job->caches     = g_malloc0 (job->count * sizeof (*job->caches));
 
-    switch (battery_status) {
-        case MISSING:
-            HANDLE_BATTERY_STATUS (0, -1, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_NORMAL)
-            break;
+    for (i = 0; i < job->count; i++) {
+        struct sysattrs *sysattrs = i < job->count - 1 ? &((struct battery *)g_ptr_array_index (batteries, i))->sysattrs : &ac_sysattrs;
 
-        case UNKNOWN:
-            HANDLE_BATTERY_STATUS (0, -1, NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_NORMAL)
-            break;
+        sysattrs->sample_index = i;
 
-        case CHARGED:
-            HANDLE_BATTERY_STATUS (100, -1, NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_NORMAL)
-            break;
+        /* the thread reads its own duplicates, a rescan closes the handles of the main loop while it may read them */
 
-        case CHARGING:
-            if (old_battery_status != CHARGING && estimation_needed == TRUE) {
-                reset_battery_time_estimation ();
-            }
+        for (attribute = 0; attribute < SYSATTR_COUNT; attribute++) {
+            job->fds[i][attribute] = sysattrs->fds[attribute] >= 0 ? fcntl (sysattrs->fds[attribute], F_DUPFD_CLOEXEC, 0) : -1;
+        }
+    }
 
-            if (get_battery_charge (FALSE, &percentage, &time) == FALSE) {
-                return;
-            }
+    g_mutex_lock (&sampler_mutex);
+    free_sampler_job (sampler_next_job);
+    sampler_next_job = job;
+    g_mutex_unlock (&sampler_mutex);
+}
 
-            HANDLE_BATTERY_STATUS (percentage, time, NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_NORMAL)
-            break;
+static void free_sampler_job (struct sampler_job *job)
+{
+    gint attribute;
+    guint i;
 
-        case DISCHARGING:
-        case NOTCHARGING:
-            if (old_battery_status != DISCHARGING && estimation_needed == TRUE) {
-                reset_battery_time_estimation ();
-            }
+    if (job == NULL) {
+        return;
+    }
 
-            if (get_battery_charge (TRUE, &percentage, &time) == FALSE) {
-                return;
+    for (i = 0; i < job->count; i++) {
+        for (attribute = 0; attribute < SYSATTR_COUNT; attribute++) {
+            if (job->fds[i][attribute] >= 0) {
+                close (job->fds[i][attribute]);
             }
+        }
+    }
 
-            battery_string = get_battery_string (battery_status, percentage);
-            time_string    = get_time_string (time);
+    g_free (job->fds);
+    g_free (job->caches);
+    g_free (job);
+}
 
-            if (old_battery_status != DISCHARGING) {
-                old_battery_status  = DISCHARGING;
-                NOTIFY_MESSAGE (&notification, battery_string, time_string, NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_NORMAL);
+static gpointer run_sampler_thread (gpointer data)
+{
+    struct sampler_job *job = NULL;
+    struct sample *sample;
+    guint64 event = 1;
+    guint request = 0;
+    guint back = 0;
 
-                battery_low            = FALSE;
-                battery_critical       = FALSE;
-                spawn_command_low      = FALSE;
-                spawn_command_critical = FALSE;
-            }
+    /* the thread only reads the job and writes the sample, the main loop owns everything else */
 
-            if (battery_low == FALSE && percentage <= configuration.low_level) {
-                battery_low = TRUE;
+    for (;;) {
+        g_mutex_lock (&sampler_mutex);
 
-                battery_string = get_battery_string (LOW_LEVEL, percentage);
-                NOTIFY_MESSAGE (&notification, battery_string, time_string, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_NORMAL);
+        while (sampler_requests == request) {
+            g_cond_wait (&sampler_cond, &sampler_mutex);
+        }
 
-                spawn_command_low = TRUE;
-            }
+        request = sampler_requests;
 
-            if (battery_critical == FALSE && percentage <= configuration.critical_level) {
-                battery_critical = TRUE;
+        if (sampler_next_job != NULL) {
+            free_sampler_job (job);
+            job = sampler_next_job;
+            sampler_next_job = NULL;
+        }
 
-                battery_string = get_battery_string (CRITICAL_LEVEL, percentage);
-                NOTIFY_MESSAGE (&notification, battery_string, time_string, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_CRITICAL);
+        job->epoch = sampler_epoch;
 
-                spawn_command_critical = TRUE;
-            }
+        g_mutex_unlock (&sampler_mutex);
 
-            gtk_status_icon_set_tooltip_text (tray_icon->gtk_icon, get_tooltip_string (battery_string, time_string));
-            set_tray_icon (tray_icon, get_icon_name (battery_status, percentage));
+        sample = &sampler_samples[back];
+        take_sample (job, sample);
+        sample->request = request;
 
-            if (spawn_command_low == TRUE) {
-                spawn_command_low = FALSE;
+        /* a ready sample that the main loop did not adopt yet is superseded by this one, and written next */
 
-                if (configuration.command_low_level != NULL) {
-                    syslog (LOG_CRIT, _("Spawning low battery level command in 5 seconds: %s"), configuration.command_low_level);
-                    g_usleep (G_USEC_PER_SEC * 5);
+        back = __atomic_exchange_n (&sampler_ready, back | SAMPLER_FRESH, __ATOMIC_ACQ_REL) & ~SAMPLER_FRESH;
 
-                    if (get_battery_status (&battery_status) == TRUE) {
-                        if (battery_status != DISCHARGING && battery_status != NOTCHARGING) {
-                            syslog (LOG_NOTICE, _("Skipping low battery level command, no longer discharging"));
-                            return;
-                        }
-                    }
+        while (write (sampler_event_fd, &event, sizeof (event)) < 0 && errno == EINTR);
+    }
 
-                    if (g_spawn_command_line_async (configuration.command_low_level, &error) == FALSE) {
-                        syslog (LOG_CRIT, _("Cannot spawn low battery level command: %s\n"), error->message);
+    return NULL;
+}
 
-                        g_printerr (_("Cannot spawn low battery level command: %s\n"), error->message);
-                        g_error_free (error); error = NULL;
+static void take_sample (struct sampler_job *job, struct sample *sample)
+{
+    gchar buffer[SYSUEVENT_LTH];
+    gint64 start = get_stats_time ();
+    gint64 now = g_get_monotonic_time ();
+    gint64 latency;
+    gint attribute;
+    guint i;
 
-#ifdef WITH_NOTIFY
-                        static NotifyNotification *spawn_notification = NULL;
-                        NOTIFY_MESSAGE (&spawn_notification, _("Cannot spawn low battery level command!"), configuration.command_low_level, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_CRITICAL);
-#endif
-                    }
-                }
-            }
+    job->tick++;
 
-            if (spawn_command_critical == TRUE) {
-                spawn_command_critical = FALSE;
+    /* the buffer is recycled, only the power supplies of the job are cleared */
 
-                if (configuration.command_critical_level != NULL) {
-                    syslog (LOG_CRIT, _("Spawning critical battery level command in 30 seconds: %s"), configuration.command_critical_level);
-                    g_usleep (G_USEC_PER_SEC * 30);
+    memset (sample, 0, G_STRUCT_OFFSET (struct sample, supplies) + job->count * sizeof (struct sample_supply));
+    sample->generation = job->generation;
+    sample->count      = job->count;
 
-                    if (get_battery_status (&battery_status) == TRUE) {
-                        if (battery_status != DISCHARGING && battery_status != NOTCHARGING) {
-                            syslog (LOG_NOTICE, _("Skipping critical battery level command, no longer discharging"));
-                            return;
-                        }
-                    }
+    for (i = 0; i < job->count; i++) {
+        struct sample_supply *supply = &sample->supplies[i];
+        gint *fds = job->fds[i];
 
-                    if (g_spawn_command_line_async (configuration.command_critical_level, &error) == FALSE) {
-                        syslog (LOG_CRIT, _("Cannot spawn critical battery level command: %s\n"), error->message);
+        /* as on the main loop: the uevent file when it is readable, every attribute file otherwise */
 
-                        g_printerr (_("Cannot spawn critical battery level command: %s\n"), error->message);
-                        g_error_free (error); error = NULL;
+        if (job->uevent == TRUE && fds[SYSATTR_UEVENT] >= 0) {
+            if (read_sample_fd (sample, job, fds[SYSATTR_UEVENT], buffer, SYSUEVENT_LTH, &latency) >= 0) {
+                parse_uevent_sample (buffer, supply->values, &supply->mask);
+                continue;
+            }
 
-#ifdef WITH_NOTIFY
-                        static NotifyNotification *spawn_notification = NULL;
-                        NOTIFY_MESSAGE (&spawn_notification, _("Cannot spawn critical battery level command!"), configuration.command_critical_level, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_CRITICAL);
-#endif
-                    }
+            if (sample->invalidated == TRUE) {
+                continue;
+            }
+
+            close (fds[SYSATTR_UEVENT]);
+            fds[SYSATTR_UEVENT] = -1;
+        }
+
+        for (attribute = 0; attribute < SYSATTR_UEVENT; attribute++) {
+            struct sysattr_cache *cache = &job->caches[i][attribute];
+
+            if (fds[attribute] < 0) {
+                continue;
+            }
+
+            if (get_cached_sysattr (cache, attribute, job->tick, job->epoch, job->events, now, supply->values[attribute], SYSATTR_LTH,
+                    &sample->cache_counters[attribute]) == FALSE) {
+                if (read_sample_fd (sample, job, fds[attribute], supply->values[attribute], SYSATTR_LTH, &latency) < 0) {
+                    continue;
                 }
+
+                g_strchomp (supply->values[attribute]);
+                set_cached_sysattr (cache, job->tick, job->epoch, now, latency, supply->values[attribute], &sample->cache_counters[attribute]);
             }
-            break;
+
+            supply->mask |= 1 << attribute;
+        }
     }
+
+    sample->duration = get_stats_time () - start;
 }
 
-static void on_tray_icon_click (struct icon *tray_icon, gpointer user_data)
+static gssize read_sample_fd (struct sample *sample, struct sampler_job *job, gint fd, gchar *buffer, gsize size, gint64 *latency)
 {
-    GError *error = NULL;
+    gint64 start;
+    gssize length;
 
-    if (configuration.command_left_click != NULL) {
-        if (g_spawn_command_line_async (configuration.command_left_click, &error) == FALSE) {
-            syslog (LOG_ERR, _("Cannot spawn left click command: %s\n"), error->message);
+    start    = get_stats_time ();
+    length   = pread (fd, buffer, size - 1, 0);
+    *latency = get_stats_time () - start;
 
-            g_printerr (_("Cannot spawn left click command: %s\n"), error->message);
-            g_error_free (error); error = NULL;
+    add_stats_histogram_latency (&sample->reads, *latency);
 
-#ifdef WITH_NOTIFY
-            static NotifyNotification *spawn_notification = NULL;
-            NOTIFY_MESSAGE (&spawn_notification, _("Cannot spawn left click command!"), configuration.command_left_click, NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_CRITICAL);
-#endif
+    /* a read cannot be interrupted, a late one delays the sample while the updates render the previous one */
+
+    if (*latency > job->timeout) {
+        sample->slow_reads++;
+    }
+
+    if (length < 0) {
+        if (errno == ENODEV || errno == ENOENT) {
+            sample->invalidated = TRUE;
         }
+
+        return -1;
     }
+
+    buffer[length] = '\0';
+    sample->bytes_read += length;
+
+    return length;
 }
 
-#ifdef WITH_NOTIFY
-static void notify_message (NotifyNotification **notification, gchar *summary, gchar *body, gint timeout, NotifyUrgency urgency)
+static gboolean request_sample (struct icon *tray_icon)
 {
-    g_return_if_fail (notification != NULL);
-    g_return_if_fail (summary != NULL);
+    /* FALSE when the update runs now: no sampler thread, or the sample it requested is delivered */
 
-    if (configuration.hide_notification == TRUE) {
-        return;
+    if (sampler_thread == NULL || sample_delivered == TRUE) {
+        sample_delivered = FALSE;
+        return FALSE;
     }
 
-    if (*notification == NULL) {
-#if NOTIFY_CHECK_VERSION (0, 7, 0)
-        *notification = notify_notification_new (summary, body, NULL);
-#else
-        *notification = notify_notification_new (summary, body, NULL, NULL);
-#endif
-    } else {
-        notify_notification_update (*notification, summary, body, NULL);
+    sampler_icon = tray_icon;
+
+    g_mutex_lock (&sampler_mutex);
+    sampler_requests++;
+    sampler_epoch = sysattr_cache_epoch;
+    g_cond_signal (&sampler_cond);
+    g_mutex_unlock (&sampler_mutex);
+
+    if (sampler_timeout_source == 0) {
+        sampler_timeout_source = g_timeout_add (configuration.sampler_timeout, on_sampler_timeout, NULL);
     }
 
-    notify_notification_set_timeout (*notification, timeout);
-    notify_notification_set_urgency (*notification, urgency);
-    notify_notification_show (*notification, NULL);
+    return TRUE;
 }
-#endif
 
-static gchar* get_tooltip_string (gchar *battery, gchar *time)
+static gboolean on_sample_ready (gint fd, GIOCondition condition, gpointer user_data)
 {
-    static gchar tooltip_string[STR_LTH];
+    struct sample *sample;
+    guint64 events;
+    guint ready;
 
-    tooltip_string[0] = '\0';
-
-    g_return_val_if_fail (battery != NULL, tooltip_string);
+    if (read (fd, &events, sizeof (events)) < 0 && errno != EAGAIN) {
+        return TRUE;
+    }
 
-    g_strlcpy (tooltip_string, battery, STR_LTH);
+    /* the sample may have been adopted by the callback of a previous event */
 
-    if (configuration.debug_output == TRUE) {
-        g_printf ("tooltip: %s\n", battery);
+    if ((__atomic_load_n (&sampler_ready, __ATOMIC_ACQUIRE) & SAMPLER_FRESH) == 0) {
+        return TRUE;
     }
 
-    if (time != NULL) {
-        g_strlcat (tooltip_string, "\n", STR_LTH);
-        g_strlcat (tooltip_string, time, STR_LTH);
+    /* the sample of the previous updates goes back to the thread, only the thread marks a sample fresh */
 
-        if (configuration.debug_output == TRUE) {
-            g_printf ("tooltip: %s\n", time);
-        }
-    }
+    ready = __atomic_exchange_n (&sampler_ready, sampler_current, __ATOMIC_ACQ_REL);
+    sampler_current = ready & ~SAMPLER_FRESH;
 
-    return tooltip_string;
-}
+    sample = &sampler_samples[sampler_current];
+    current_sample = sample;
 
-static gchar* get_battery_string (gint state, gint percentage)
-{
-    static gchar battery_string[STR_LTH];
+    /* the counters of the thread are merged by the main loop, which owns the stats */
 
-    switch (state) {
-        case MISSING:
-            g_strlcpy (battery_string, _("Battery is missing!"), STR_LTH);
-            break;
+    add_stats_histogram (&stats.histograms[STATS_SYSFS_READ], &sample->reads);
+    add_sysattr_cache_counters (sysattr_cache_counters, sample->cache_counters);
+    stats.bytes_read += sample->bytes_read;
+    slow_reads       += sample->slow_reads;
 
-        case UNKNOWN:
-            g_strlcpy (battery_string, _("Battery status is unknown!"), STR_LTH);
-            break;
+    if (sample->invalidated == TRUE) {
+        sysattrs_invalidated = TRUE;
+    }
 
-        case CHARGED:
-            g_strlcpy (battery_string, _("Battery is charged!"), STR_LTH);
-            break;
+    if (sampler_timeout_source != 0) {
+        g_source_remove (sampler_timeout_source);
+        sampler_timeout_source = 0;
+    }
 
-        case DISCHARGING:
-            g_snprintf (battery_string, STR_LTH, _("Battery is discharging (%i%% remaining)"), percentage);
-            break;
+    if (configuration.debug_output == TRUE) {
+        g_printf ("sampler: %u power supplies sampled in %.1f ms, %u slow reads\n", sample->count, sample->duration / 1e6, sample->slow_reads);
+    }
 
-        case NOTCHARGING:
-            g_snprintf (battery_string, STR_LTH, _("Battery is not charging (%i%% remaining)"), percentage);
-            break;
+    sample_stale     = FALSE;
+    sample_delivered = TRUE;
+    update_tray_icon (sampler_icon);
 
-        case LOW_LEVEL:
-            g_snprintf (battery_string, STR_LTH, _("Battery level is low! (%i%% remaining)"), percentage);
-            break;
+    return TRUE;
+}
 
-        case CRITICAL_LEVEL:
-            g_snprintf (battery_string, STR_LTH, _("Battery level is critical! (%i%% remaining)"), percentage);
-            break;
+static gboolean on_sampler_timeout (gpointer user_data)
+{
+    sampler_timeout_source = 0;
 
-        case CHARGING:
-            g_snprintf (battery_string, STR_LTH, _("Battery is charging (%i%%)"), percentage);
-            break;
+    /* nothing to render before the first sample, its arrival runs the update */
 
-        default:
-            battery_string[0] = '\0';
-            break;
+    if (current_sample == NULL) {
+        return FALSE;
     }
 
     if (configuration.debug_output == TRUE) {
-        g_printf ("battery string: %s\n", battery_string);
+        g_printf ("sampler: no sample after %d ms, the update renders the previous one\n", configuration.sampler_timeout);
     }
 
-    return battery_string;
+    stale_updates++;
+
+    sample_stale     = TRUE;
+    sample_delivered = TRUE;
+    update_tray_icon (sampler_icon);
+
+    return FALSE;
 }
 
-static gchar* get_time_string (gint minutes)
+/*
+ * log functions
+ */
+
+void log_event (gint priority, const gchar *format, ...)
 {
-    static gchar time_string[STR_LTH];
-    static gchar minutes_string[STR_LTH];
-    gint hours;
+    va_list arguments;
+    gchar *message;
 
-    if (minutes < 0) {
-        return NULL;
-    }
+    va_start (arguments, format);
+    message = g_strdup_vprintf (format, arguments);
+    va_end (arguments);
 
-    hours   = minutes / 60;
-    minutes = minutes % 60;
+#ifdef WITH_TRACE
+    /* a replay writes the events with their virtual time to the standard output instead of the system log */
 
-    if (hours > 0) {
-        g_sprintf (minutes_string, g_dngettext (NULL, "%d minute", "%d minutes", minutes), minutes);
-        g_sprintf (time_string, g_dngettext (NULL, "%d hour, %s remaining", "%d hours, %s remaining", hours), hours, minutes_string);
-    } else {
-        g_sprintf (time_string, g_dngettext (NULL, "%d minute remaining", "%d minutes remaining", minutes), minutes);
+    if (replay_data != NULL) {
+        log_replay_event (message);
+        g_free (message);
+        return;
     }
+#endif
 
-    if (configuration.debug_output == TRUE) {
-        g_printf ("time string: %s\n", time_string);
-    }
+    syslog (priority, "%s", message);
+    g_free (message);
+}
 
-    return time_string;
+/*
+ * stats functions
+ */
+
+gint64 get_stats_time (void)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+
+    return (gint64)now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
-static gchar* get_icon_name (gint state, gint percentage)
+void append_stats_latency (GString *report, guint64 latency)
 {
-    static gchar icon_name[STR_LTH];
+    if (latency < 1000)
+        g_string_append_printf (report, "%" G_GUINT64_FORMAT " ns", latency);
+    else if (latency < 1000000)
+        g_string_append_printf (report, "%.1f us", latency / 1e3);
+    else if (latency < 1000000000)
+        g_string_append_printf (report, "%.1f ms", latency / 1e6);
+    else
+        g_string_append_printf (report, "%.2f s", latency / 1e9);
+}
 
-    if (configuration.icon_type == BATTERY_ICON_NOTIFICATION) {
-        g_strlcpy (icon_name, "notification-battery", STR_LTH);
-    } else {
-        g_strlcpy (icon_name, "battery", STR_LTH);
-    }
+#ifdef WITH_STATS
+void append_update_stats (GString *report)
+{
+    gsize length;
 
-    if (state == MISSING || state == UNKNOWN) {
-        if (configuration.icon_type == BATTERY_ICON_NOTIFICATION) {
-            g_strlcat (icon_name, "-empty", STR_LTH);
-        } else {
-            g_strlcat (icon_name, "-missing", STR_LTH);
-        }
-    } else {
-        if (configuration.icon_type == BATTERY_ICON_NOTIFICATION) {
-                 if (percentage <= 20)  g_strlcat (icon_name, "-020", STR_LTH);
-            else if (percentage <= 40)  g_strlcat (icon_name, "-040", STR_LTH);
-            else if (percentage <= 60)  g_strlcat (icon_name, "-060", STR_LTH);
-            else if (percentage <= 80)  g_strlcat (icon_name, "-080", STR_LTH);
-            else                        g_strlcat (icon_name, "-100", STR_LTH);
-
-                 if (state == CHARGING) g_strlcat (icon_name, "-plugged", STR_LTH);
-            else if (state == CHARGED)  g_strlcat (icon_name, "-plugged", STR_LTH);
-        } else {
-                 if (percentage <= 20)  g_strlcat (icon_name, "-caution", STR_LTH);
-            else if (percentage <= 40)  g_strlcat (icon_name, "-low", STR_LTH);
-            else if (percentage <= 80)  g_strlcat (icon_name, "-good", STR_LTH);
-            else                        g_strlcat (icon_name, "-full", STR_LTH);
+    g_string_append_printf (report, "stats: %u/%u updates with an unchanged view\n", tray_icon_view_hits, tray_icon_view_ticks);
 
-                 if (state == CHARGING) g_strlcat (icon_name, "-charging", STR_LTH);
-            else if (state == CHARGED)  g_strlcat (icon_name, "-charged", STR_LTH);
-        }
+    if (sampler_thread != NULL) {
+        g_string_append_printf (report, "stats: %u updates on a stale sample, %u slow reads\n", stale_updates, slow_reads);
     }
 
-    if (configuration.icon_type == BATTERY_ICON_SYMBOLIC) {
-        g_strlcat (icon_name, "-symbolic", STR_LTH);
+    length = report->len;
+    append_sysattr_cache_counters (report, "stats: cache ", "\n");
+
+    if (report->len > length) {
+        g_string_append_c (report, '\n');
     }
 
-    if (configuration.debug_output == TRUE) {
-        g_printf ("icon name: %s\n", icon_name);
+#ifdef WITH_NOTIFY
+    g_string_append_printf (report, "stats: %u notifications dropped, %u notification stalls\n", notification_dropped, notification_stalls);
+#endif
+}
+#endif
+
+static gboolean on_exit_signal (gpointer user_data)
+{
+    if (main_loop != NULL) {
+        g_main_loop_quit (main_loop);
+    } else {
+        gtk_main_quit ();
     }
 
-    return icon_name;
+    return FALSE;
 }
 
 int main (int argc, char **argv)
@@ -1212,26 +5376,98 @@ int main (int argc, char **argv)
     bind_textdomain_codeset (CBATTICON_STRING, "UTF-8");
     textdomain (CBATTICON_STRING);
 
+    startup_time = g_get_monotonic_time ();
+
     ret = get_options (argc, argv);
     if (ret <= 0) {
         return ret;
     }
 
-#ifdef WITH_NOTIFY
-    if (configuration.hide_notification == FALSE) {
-        if (notify_init (CBATTICON_STRING) == FALSE) {
-            return -1;
+    if (argc > 1) {
+        battery_suffix = argv[1];
+    }
+
+    /* headless, the status bar reads the standard output through a pipe and needs each line as soon as it is written */
+
+    if (configuration.headless == TRUE) {
+        setvbuf (stdout, NULL, _IOLBF, 0);
+    }
+
+    init_string_tables ();
+    profile_startup ("string tables");
+
+    get_power_supplies();
+    profile_startup ("power supplies");
+
+#ifdef WITH_TRACE
+    if (replay_data != NULL) {
+        /* the first recorded update is the one of the creation of the tray icon */
+
+        run_replay ((GSourceFunc)update_tray_icon, create_tray_icon ());
+
+#ifdef WITH_STATS
+        if (configuration.stats == TRUE) {
+            dump_stats ();
         }
+#endif
+
+        return 0;
     }
 #endif
 
-    if (argc > 1) {
-        battery_suffix = argv[1];
+    if (configuration.status_only == TRUE) {
+        create_tray_icon ();
+
+#ifdef WITH_STATS
+        if (configuration.stats == TRUE) {
+            dump_stats ();
+        }
+#endif
+
+        return 0;
     }
 
-    get_power_supplies();
+#ifdef WITH_HISTORY
+    if (configuration.no_history == FALSE) {
+        open_history (FALSE);
+        profile_startup ("history");
+    }
+#endif
+
     create_tray_icon ();
-    gtk_main();
+    profile_startup ("tray icon");
+
+    g_idle_add_full (G_PRIORITY_LOW, on_startup_idle, NULL, NULL);
+
+#ifdef WITH_STATS
+    create_stats_monitor ();
+#endif
+
+    /* the main loop is left at SIGINT and SIGTERM, so the statistics are dumped, the socket is removed and the trace is flushed */
+
+    g_unix_signal_add (SIGINT, on_exit_signal, NULL);
+    g_unix_signal_add (SIGTERM, on_exit_signal, NULL);
+
+    if (configuration.headless == TRUE) {
+        main_loop = g_main_loop_new (NULL, FALSE);
+        g_main_loop_run (main_loop);
+    } else {
+        gtk_main();
+    }
+
+#ifdef WITH_STATS
+    if (configuration.stats == TRUE) {
+        dump_stats ();
+    }
+#endif
+
+#ifdef WITH_SOCKET
+    close_socket_server ();
+#endif
+
+#ifdef WITH_TRACE
+    close_trace ();
+#endif
 
     return 0;
 }
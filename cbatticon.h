@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2011-2013 Colin Jones
+ * Copyright (C) 2014-2023 Valère Monseur
+ *
+ * Based on code by Matteo Marchesotti
+ * Copyright (C) 2007 Matteo Marchesotti <matteo.marchesotti@fsfe.org>
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * declarations shared by cbatticon.c and the optional parts of cbatticon (history, local socket, shared memory,
+ * UPower backend, trace and replay, statistics), each one compiled in by its WITH_* switch of the Makefile
+ */
+
+#ifndef CBATTICON_H
+#define CBATTICON_H
+
+#include <glib.h>
+#include <glib/gi18n.h>
+#include <glib/gprintf.h>
+
+#define CBATTICON_VERSION_NUMBER 1.6.13
+#define CBATTICON_VERSION_STRING "1.6.13"
+#define CBATTICON_STRING         "cbatticon"
+
+#define STR_LTH 256
+
+enum {
+    UNKNOWN_ICON = 0,
+    BATTERY_ICON_STANDARD,
+    BATTERY_ICON_SYMBOLIC,
+    BATTERY_ICON_NOTIFICATION,
+    ICON_TYPE_COUNT
+};
+
+enum {
+    MISSING = 0,
+    UNKNOWN,
+    CHARGED,
+    CHARGING,
+    DISCHARGING,
+    NOTCHARGING,
+    LOW_LEVEL,
+    CRITICAL_LEVEL
+};
+
+enum {
+    SYSATTR_PRESENT = 0,
+    SYSATTR_ONLINE,
+    SYSATTR_STATUS,
+    SYSATTR_ENERGY_FULL,
+    SYSATTR_ENERGY_NOW,
+    SYSATTR_POWER_NOW,
+    SYSATTR_CHARGE_FULL,
+    SYSATTR_CHARGE_NOW,
+    SYSATTR_CURRENT_NOW,
+    SYSATTR_CAPACITY,
+    SYSATTR_UEVENT,
+    SYSATTR_COUNT
+};
+
+enum {
+    SAMPLER_FILE = 0,
+    SAMPLER_UEVENT
+};
+
+enum {
+    BACKEND_SYSFS = 0,
+    BACKEND_UPOWER
+};
+
+enum {
+    OUTPUT_TEMPLATE = 0,
+    OUTPUT_I3BAR,
+    OUTPUT_WAYBAR
+};
+
+enum {
+    CAPACITY_ENERGY = 0, /* Wh */
+    CAPACITY_CHARGE,     /* Ah */
+    CAPACITY_SCALED      /* batteries with mixed units, each one scaled to 100 */
+};
+
+enum {
+    ESTIMATOR_HYBRID = 0,
+    ESTIMATOR_EWMA,
+    ESTIMATOR_REGRESSION
+};
+
+struct configuration {
+    gboolean display_version;
+    gboolean debug_output;
+    gint     update_interval;
+    gint     min_interval;
+    gint     max_interval;
+    gint     icon_type;
+    gint     low_level;
+    gint     critical_level;
+    gchar   *command_low_level;
+    gchar   *command_critical_level;
+    gchar   *command_left_click;
+#ifdef WITH_NOTIFY
+    gboolean hide_notification;
+#endif
+    gboolean list_icon_types;
+    gboolean list_power_supplies;
+    gboolean prewarm_icons;
+    gboolean aggregate_batteries;
+    gint     sampler;
+    gint     sampler_timeout;
+    gint     estimator;
+#ifdef WITH_HISTORY
+    gint     history_hours;
+    gboolean no_history;
+#endif
+    gboolean headless;
+    gboolean status_only;
+    gint     output;
+    gchar   *output_template;
+    gboolean startup_profile;
+    gchar   *sysfs_root;
+#ifdef WITH_STATS
+    gboolean stats;
+#endif
+    gint     backend;
+    gboolean devices;
+    gchar  **device_levels;
+#ifdef WITH_SOCKET
+    gboolean socket;
+#endif
+#ifdef WITH_SHM
+    gboolean shm;
+#endif
+#ifdef WITH_TRACE
+    gchar   *record_file;
+    gchar   *replay_file;
+#endif
+};
+
+#define STATS_BUCKETS 32 /* power of two buckets of nanoseconds, the last one holds everything above 2 seconds */
+
+enum {
+    STATS_SYSFS_READ = 0,
+    STATS_THEME_LOAD,
+    STATS_NOTIFICATION,
+    STATS_TICK,
+    STATS_HISTOGRAM_COUNT
+};
+
+struct stats_histogram {
+    guint64 count;
+    guint64 sum; /* nanoseconds */
+    guint64 max;
+    guint64 buckets[STATS_BUCKETS];
+};
+
+struct stats {
+    struct stats_histogram histograms[STATS_HISTOGRAM_COUNT];
+    guint64 ticks;
+    guint64 wakeups;
+    guint64 files_opened;
+    guint64 bytes_read;
+    guint64 suspends;
+    gint64  stall_max;   /* nanoseconds spent by the main loop between two polls */
+    gint64  poll_return; /* time of the last return from poll, 0 while polling */
+};
+
+/*
+ * options of the command line, then of the configuration file
+ */
+
+extern struct configuration configuration;
+
+/*
+ * last charge computed by the updates (the current rate is in capacity per hour, -1 when it is unknown)
+ */
+
+extern gdouble last_full_capacity;
+extern gdouble last_remaining_capacity;
+extern gdouble last_current_rate;
+extern gdouble last_time_confidence;
+extern gint    last_capacity_unit;
+
+#define ESTIMATOR_LOW_CONFIDENCE 0.5 /* below this confidence, the time is a rough estimate */
+
+/*
+ * runtime statistics, only updated by the main thread
+ */
+
+extern struct stats stats;
+
+/*
+ * start of the process
+ */
+
+extern gint64 startup_time;
+
+/*
+ * attribute files of the power supplies
+ */
+
+extern const gchar *sysattr_names[SYSATTR_COUNT];
+
+/*
+ * functions of cbatticon.c used by the optional parts
+ */
+
+const gchar* get_state_string (gint status);
+gint64 get_stats_time (void);
+void append_stats_latency (GString *report, guint64 latency);
+void log_event (gint priority, const gchar *format, ...) G_GNUC_PRINTF (2, 3);
+
+#endif